@@ -0,0 +1,848 @@
+#include "incl/c_cpp.hpp"
+#include "converter.hpp"
+
+//microbenchmarks for the converter hot paths. every case works in frames of
+//fftSize (a spectrum row for the compander, a block of samples for the
+//readers), sweeps fftSize over powers of two and reports the best of a few
+//runs as ns/frame and GB/s of input consumed.
+//--roundtrip instead converts synthetic WAVs at every depth, channel count,
+//compander, image orientation and pixel layout forward and back through
+//files, and fails (exit code 1) if the SNR of any of them drops below its
+//compander's threshold for that layout.
+//--quantize-check compares spectrum::Quantize and QuantizePolar with a plain
+//per-bin copy of the old valarray code, and fails on any pixel that differs.
+//--compander-check does the same for Compander16::Compress alone, at every
+//code boundary of the plain float formulas.
+//usage: avbridge_bench [--roundtrip] [--quantize-check] [--compander-check] [--json file] [--filter substring] [--min-fft n] [--max-fft n] [--min-time ms]
+
+namespace
+{
+    struct Result
+    {
+        std::string name;
+        uint32_t fftSize;
+        uint64_t frames;
+        double nsPerFrame;
+        double gbPerSec;
+    };
+
+    struct RoundTripResult
+    {
+        std::string name;
+        uint32_t bits;
+        uint32_t numCh;
+        bool horizontal;
+        uint32_t layout;
+        double snr;
+        double threshold;
+        double forwardRealtime;
+        double backwardRealtime;
+        bool passed;
+    };
+
+    struct Options
+    {
+        bool roundtrip;
+        bool quantizeCheck;
+        bool companderCheck;
+        std::string jsonFilename;
+        std::string filter;
+        uint32_t minFFT;
+        uint32_t maxFFT;
+        double minTime;
+    };
+
+    std::vector<Result> results;
+    std::vector<RoundTripResult> roundTripResults;
+    Options opt;
+
+    std::valarray<float> sinewave(uint32_t len, float freq, float phase, float amplitude)
+    {
+        std::valarray<float> r(len);
+        for(uint32_t i=0; i<len; i++)
+        {
+            double x = i;
+            r[i] = amplitude*std::sin(2.0*3.141592653589793*freq*x-phase);
+        }
+        return r;
+    }
+    //a few partials and a little noise, so companders and the fft see more than one bin
+    std::vector<float> MakeSignal(uint32_t len)
+    {
+        std::valarray<float> s = sinewave(len, 0.01f, 0.0f, 0.4f) + sinewave(len, 0.0731f, 1.0f, 0.2f) + sinewave(len, 0.31f, 2.0f, 0.05f);
+        std::vector<float> r(std::begin(s), std::end(s));
+        uint32_t x = 2463534242U;
+        for(auto& v : r)
+        {
+            x ^= x<<13;
+            x ^= x>>17;
+            x ^= x<<5;
+            v += (float)(int32_t)x * (0.01f/2147483648.0f);
+        }
+        return r;
+    }
+
+    double Now()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    //fn(n) runs n iterations of framesPerIter frames each. the iteration
+    //count is doubled until one run takes minTime, then the best of 3 runs counts
+    void Run(const std::string& name, uint32_t fftSize, uint64_t framesPerIter, double bytesPerFrame, std::function<void(uint32_t)> fn)
+    {
+        uint32_t n = 1;
+        double t;
+        fn(1);
+        for(;;)
+        {
+            double t0 = Now();
+            fn(n);
+            t = Now()-t0;
+            if(t >= opt.minTime || n >= (1U<<30))
+                break;
+            n *= 2;
+        }
+        for(int rep=0; rep<2; rep++)
+        {
+            double t0 = Now();
+            fn(n);
+            t = std::min(t, Now()-t0);
+        }
+        Result r;
+        r.name = name;
+        r.fftSize = fftSize;
+        r.frames = framesPerIter*n;
+        r.nsPerFrame = t*1e9/r.frames;
+        r.gbPerSec = bytesPerFrame*r.frames/t/1e9;
+        results.push_back(r);
+        printf("%-28s %6u %14.1f %10.3f\n", name.c_str(), fftSize, r.nsPerFrame, r.gbPerSec);
+        fflush(stdout);
+    }
+
+    bool Wanted(const std::string& name)
+    {
+        return opt.filter.empty() || name.find(opt.filter) != std::string::npos;
+    }
+
+    //enough frames per iteration that per-call overhead doesn't show at small sizes
+    uint32_t FramesFor(uint32_t fftSize)
+    {
+        uint32_t n = std::max<uint32_t>(AVB_FFT_BATCH, (1U<<19)/fftSize);
+        return (n+AVB_FFT_BATCH-1)/AVB_FFT_BATCH*AVB_FFT_BATCH;
+    }
+
+    void BenchForward(uint32_t fftSize, uint32_t layout)
+    {
+        std::string name = layout == AVB_LAYOUT_RG16 ? "forward_process_blocks_rg16" : "forward_process_blocks";
+        if(!Wanted(name))
+            return;
+        avb::ConverterSettings s = avb::MakeDefaultConverterSettings();
+        s.fftSize = fftSize;
+        auto ctx = avb::ConversionContext::Get(s, AVB_FFT_FORWARD);
+        avb::ForwardConverterThread thr;
+        if(!ctx || !thr.Init(s, ctx))
+            return;
+        thr.SetLayout(layout);
+        uint32_t hop = fftSize/2, bins = fftSize/2+1;
+        uint32_t frames = FramesFor(fftSize);
+        std::vector<float> samples = MakeSignal((frames+1)*hop);
+        std::vector<avb::Pixel16> out((uint64_t)frames*bins);
+        Run(name, fftSize, frames, hop*sizeof(float), [&](uint32_t n)
+        {
+            for(uint32_t i=0; i<n; i++)
+                thr.ProcessBlocks(&out[0], &samples[0], frames);
+        });
+    }
+
+    void BenchBackward(uint32_t fftSize, uint32_t layout)
+    {
+        std::string name = layout == AVB_LAYOUT_RG16 ? "backward_process_chunks_rg16" : "backward_process_chunks";
+        if(!Wanted(name))
+            return;
+        avb::ConverterSettings s = avb::MakeDefaultConverterSettings();
+        s.fftSize = fftSize;
+        auto fwdCtx = avb::ConversionContext::Get(s, AVB_FFT_FORWARD);
+        auto ctx = avb::ConversionContext::Get(s, AVB_FFT_INVERSE);
+        avb::ForwardConverterThread fwd;
+        avb::BackwardConverterThread thr;
+        if(!fwdCtx || !ctx || !fwd.Init(s, fwdCtx) || !thr.Init(s, ctx))
+            return;
+        fwd.SetLayout(layout);
+        thr.SetLayout(layout);
+        //the reader wants a file, so the image is made by the forward path first
+        uint32_t hop = fftSize/2, bins = fftSize/2+1;
+        uint32_t chunks = FramesFor(fftSize)/2;
+        uint32_t rows = 2*chunks+1;
+        std::vector<float> samples = MakeSignal((rows+1)*hop);
+        std::vector<avb::Pixel16> img((uint64_t)rows*bins);
+        fwd.ProcessBlocks(&img[0], &samples[0], rows);
+        std::string fn = "avbridge_bench_" + std::to_string(fftSize) + ".raw";
+        FILE* f = fopen(fn.c_str(), "wb");
+        if(!f)
+            return;
+        avb::WritePixels(f, &img[0], img.size(), layout);
+        fclose(f);
+        std::vector<avb::RawImgReader16> readers(1);
+        if(readers[0].Open(fn.c_str(), bins, 0, nullptr, layout))
+        {
+            std::vector<float> out((uint64_t)chunks*fftSize);
+            Run(name, fftSize, 2*chunks, bins*avb::GetPixelBytes(layout), [&](uint32_t n)
+            {
+                for(uint32_t i=0; i<n; i++)
+                    thr.ProcessChunks(&out[0], readers, 0, chunks);
+            });
+            readers[0].Close();
+        }
+        remove(fn.c_str());
+    }
+
+    void BenchCompander(uint32_t fftSize)
+    {
+        const char* names[] = {"m_sqrt", "mu_law", "uv_law"};
+        uint32_t ids[] = {AVB_COMPANDING_M_SQRT, AVB_COMPANDING_MU_LAW, AVB_COMPANDING_UV_LAW};
+        uint32_t bins = fftSize/2+1;
+        uint32_t rows = FramesFor(fftSize);
+        //magnitudes as the forward path sees them, spread over a few decades
+        std::vector<float> magn((uint64_t)rows*bins);
+        std::vector<float> sig = MakeSignal(magn.size());
+        for(size_t i=0; i<magn.size(); i++)
+            magn[i] = std::fabs(sig[i])*std::pow(10.0f, -3.0f*(float)(i%bins)/bins);
+        std::vector<uint16_t> codes(magn.size());
+        std::vector<float> expanded(magn.size());
+        for(uint32_t m=0; m<3; m++)
+        {
+            avb::Compander16 comp;
+            comp.Init(ids[m]);
+            std::string cn = std::string("compander_compress_") + names[m];
+            std::string en = std::string("compander_expand_") + names[m];
+            if(Wanted(cn))
+            {
+                Run(cn, fftSize, rows, bins*sizeof(float), [&](uint32_t n)
+                {
+                    for(uint32_t i=0; i<n; i++)
+                        comp.Compress(&magn[0], &codes[0], magn.size());
+                });
+            }
+            comp.Compress(&magn[0], &codes[0], magn.size());
+            if(Wanted(en))
+            {
+                Run(en, fftSize, rows, bins*sizeof(uint16_t), [&](uint32_t n)
+                {
+                    for(uint32_t i=0; i<n; i++)
+                        comp.Expand(&codes[0], &expanded[0], codes.size());
+                });
+            }
+        }
+    }
+
+    void BenchWindow(uint32_t fftSize)
+    {
+        if(!Wanted("make_window"))
+            return;
+        float sink = 0.0f;
+        Run("make_window", fftSize, 1, fftSize*sizeof(float), [&](uint32_t n)
+        {
+            for(uint32_t i=0; i<n; i++)
+                sink += avb::MakeWindow(fftSize, AVB_WINDOW_BLACKMAN_HARRIS)[i%fftSize];
+        });
+        if(sink == 12345.0f)
+            puts("");
+    }
+
+    //a stereo file at every depth the reader supports, 32 meaning float
+    const uint32_t wavDepths[] = {8, 16, 24, 32};
+    const uint32_t wavSeconds = 8;
+    std::string WavFilename(uint32_t bits)
+    {
+        return "avbridge_bench_" + std::to_string(bits) + ".wav";
+    }
+    bool WriteTestWav(const std::string& filename, uint32_t bits, uint32_t numCh, uint32_t seconds)
+    {
+        const uint32_t rate = 44100;
+        uint64_t len = (uint64_t)seconds*rate;
+        avb::wav::Header h;
+        memset(&h, 0, sizeof(h));
+        h.sub1.AudioFormat = bits == 32 ? 3 : 1;
+        h.sub1.NumChannels = numCh;
+        h.sub1.SampleRate = rate;
+        h.sub1.BitsPerSample = bits;
+        h.sub1.BlockAlign = numCh*bits/8;
+        h.sub1.ByteRate = rate*h.sub1.BlockAlign;
+        std::vector<uint8_t> data = avb::wav::MakeHeader(h, len*h.sub1.BlockAlign, AVB_WAV_CONTAINER_RIFF);
+        size_t hdrSize = data.size();
+        data.resize(hdrSize + len*h.sub1.BlockAlign);
+        std::vector<float> sig = MakeSignal(len*numCh);
+        uint8_t* p = &data[hdrSize];
+        for(uint64_t i=0; i<len*numCh; i++)
+        {
+            float v = sig[i];
+            if(bits == 8)
+                *p++ = (uint8_t)(int32_t)std::lrint(v*127.0f + 128.0f);
+            else if(bits == 16)
+            {
+                int16_t x = (int16_t)std::lrint(v*32767.0f);
+                memcpy(p, &x, 2);
+                p += 2;
+            }
+            else if(bits == 24)
+            {
+                int32_t x = (int32_t)std::lrint(v*8388607.0f);
+                *p++ = x & 0xFF;
+                *p++ = (x>>8) & 0xFF;
+                *p++ = (x>>16) & 0xFF;
+            }
+            else
+            {
+                memcpy(p, &v, 4);
+                p += 4;
+            }
+        }
+        FILE* f = fopen(filename.c_str(), "wb");
+        if(!f)
+            return false;
+        bool ok = fwrite(&data[0], 1, data.size(), f) == data.size();
+        fclose(f);
+        return ok;
+    }
+
+    void BenchWavReader(uint32_t fftSize)
+    {
+        for(uint32_t bits : wavDepths)
+        {
+            std::string rn = "wav_read_block_" + std::to_string(bits);
+            std::string fn = "wav_read_frames_" + std::to_string(bits);
+            if(!Wanted(rn) && !Wanted(fn))
+                continue;
+            avb::WavReader reader;
+            if(!reader.Open(WavFilename(bits).c_str()))
+            {
+                printf("could not open %s: %s\n", WavFilename(bits).c_str(), reader.status.errorMessage.c_str());
+                continue;
+            }
+            uint32_t numCh = reader.status.hdr.sub1.NumChannels;
+            uint32_t blocks = reader.status.totalSamples/fftSize;
+            double bytes = (double)fftSize*reader.status.hdr.sub1.BlockAlign;
+            if(!blocks)
+                continue;
+            //ReadBlock allocates its valarrays per call, ReadFrames is what the converters use
+            if(Wanted(rn))
+            {
+                Run(rn, fftSize, blocks, bytes, [&](uint32_t n)
+                {
+                    for(uint32_t i=0; i<n; i++)
+                    {
+                        reader.status.samplePos = 0;
+                        for(uint32_t b=0; b<blocks; b++)
+                            reader.ReadBlock(fftSize);
+                    }
+                });
+            }
+            if(Wanted(fn))
+            {
+                std::vector<std::vector<float>> buf(numCh, std::vector<float>(fftSize));
+                std::vector<float*> dst(numCh);
+                for(uint32_t c=0; c<numCh; c++)
+                    dst[c] = &buf[c][0];
+                Run(fn, fftSize, blocks, bytes, [&](uint32_t n)
+                {
+                    for(uint32_t i=0; i<n; i++)
+                    {
+                        reader.status.samplePos = 0;
+                        for(uint32_t b=0; b<blocks; b++)
+                            reader.ReadFrames(&dst[0], fftSize);
+                    }
+                });
+            }
+            reader.Close();
+        }
+    }
+
+    bool ReadWholeWav(const std::string& filename, std::vector<std::vector<float>>& out)
+    {
+        avb::WavReader reader;
+        if(!reader.Open(filename.c_str()))
+            return false;
+        uint32_t numCh = reader.status.hdr.sub1.NumChannels;
+        uint64_t len = reader.status.totalSamples;
+        out.assign(numCh, std::vector<float>(len));
+        std::vector<float*> dst(numCh);
+        for(uint32_t c=0; c<numCh; c++)
+            dst[c] = out[c].data();
+        bool ok = reader.ReadFrames(dst.data(), len) == len;
+        reader.Close();
+        return ok;
+    }
+
+    //the thresholds sit 6 dB under what each compander reaches on this
+    //signal with its default parameters (about 82, 80 and 68 dB at every
+    //depth, RG16 a few tenths more), so a regression shows up long before
+    //it becomes audible
+    struct RoundTripCompander
+    {
+        const char* name;
+        uint32_t id;
+        float param[2];
+        double minSNR;
+        //the same for AVB_LAYOUT_RG16, where the 16-bit phase angle adds its own error
+        double minSNRPolar;
+    };
+    const RoundTripCompander roundTripCompanders[] =
+    {
+        {"m_sqrt", AVB_COMPANDING_M_SQRT, {1.0f, 0.0f}, 76.0, 76.5},
+        {"mu_law", AVB_COMPANDING_MU_LAW, {64.0f, 0.0f}, 74.0, 74.0},
+        {"uv_law", AVB_COMPANDING_UV_LAW, {768.0f, 0.125f}, 62.0, 62.0},
+    };
+    const uint32_t roundTripSeconds = 3;
+
+    bool RoundTrip(const RoundTripCompander& comp, uint32_t bits, uint32_t numCh, bool horizontal, uint32_t layout)
+    {
+        RoundTripResult r;
+        bool polar = layout == AVB_LAYOUT_RG16;
+        r.name = std::string(comp.name) + "_" + std::to_string(bits) + (numCh == 1 ? "_mono" : "_stereo") + (horizontal ? "_h" : "_v") + (polar ? "_rg16" : "");
+        r.bits = bits;
+        r.numCh = numCh;
+        r.horizontal = horizontal;
+        r.layout = layout;
+        r.snr = 0.0;
+        r.threshold = polar ? comp.minSNRPolar : comp.minSNR;
+        r.forwardRealtime = r.backwardRealtime = 0.0;
+        r.passed = false;
+        if(!Wanted(r.name))
+            return true;
+        std::string base = "avbridge_roundtrip_" + r.name;
+        std::string input = base + ".wav", output = base + "_modified.wav";
+        bool ok = WriteTestWav(input, bits, numCh, roundTripSeconds);
+
+        avb::ConverterSettings s = avb::MakeDefaultConverterSettings();
+        s.compandingMethod = comp.id;
+        s.companderParam[0] = comp.param[0];
+        s.companderParam[1] = comp.param[1];
+        s.horizontalTime = horizontal;
+        if(ok)
+        {
+            avb::ForwardConverter fwd;
+            fwd.SetLayout(layout);
+            double t0 = Now();
+            ok = fwd.Init(s) && fwd.Convert(input.c_str());
+            r.forwardRealtime = roundTripSeconds/(Now()-t0);
+        }
+        if(ok)
+        {
+            //the point is the synthesis, not a copy of the unedited input
+            avb::BackwardConverter bwd;
+            bwd.SetIncremental(false);
+            double t0 = Now();
+            ok = bwd.Init(s) && bwd.Convert(base.c_str());
+            r.backwardRealtime = roundTripSeconds/(Now()-t0);
+        }
+        std::vector<std::vector<float>> a, b;
+        if(ok)
+            ok = ReadWholeWav(input, a) && ReadWholeWav(output, b) && a.size() == b.size() && a[0].size() == b[0].size();
+        if(ok)
+        {
+            double sig = 0.0, err = 0.0;
+            for(uint32_t c=0; c<a.size(); c++)
+            {
+                for(size_t i=0; i<a[c].size(); i++)
+                {
+                    double d = (double)b[c][i] - a[c][i];
+                    sig += (double)a[c][i]*a[c][i];
+                    err += d*d;
+                }
+            }
+            r.snr = err > 0.0 ? 10.0*std::log10(sig/err) : 999.0;
+            r.passed = r.snr >= r.threshold;
+        }
+        remove(input.c_str());
+        remove(output.c_str());
+        for(uint32_t c=0; c<numCh; c++)
+        {
+            remove((base + "_ch" + std::to_string(c+1) + ".raw").c_str());
+            remove((base + "_ch" + std::to_string(c+1) + ".idx").c_str());
+        }
+        roundTripResults.push_back(r);
+        return r.passed;
+    }
+
+    bool RunRoundTrips()
+    {
+        bool allPassed = true;
+        for(const RoundTripCompander& comp : roundTripCompanders)
+            for(uint32_t bits : wavDepths)
+                for(uint32_t numCh=1; numCh<=2; numCh++)
+                    for(int h=0; h<2; h++)
+                        for(uint32_t layout : {AVB_LAYOUT_RGB16, AVB_LAYOUT_RG16})
+                            allPassed &= RoundTrip(comp, bits, numCh, h != 0, layout);
+        printf("\n%-28s %10s %10s %12s %12s\n", "round trip", "SNR dB", "min dB", "fwd x rt", "bwd x rt");
+        for(const RoundTripResult& r : roundTripResults)
+        {
+            printf("%-28s %10.2f %10.2f %12.1f %12.1f %s\n", r.name.c_str(), r.snr, r.threshold,
+                r.forwardRealtime, r.backwardRealtime, r.passed ? "ok" : "FAILED");
+        }
+        return allPassed;
+    }
+
+    //companders the exactness checks run through, the defaults first
+    struct CheckCompander
+    {
+        const char* name;
+        uint32_t id;
+        float param[2];
+    };
+    const CheckCompander checkCompanders[] =
+    {
+        {"m_sqrt", AVB_COMPANDING_M_SQRT, {1.0f, 0.0f}},
+        {"mu_law", AVB_COMPANDING_MU_LAW, {64.0f, 0.0f}},
+        {"uv_law", AVB_COMPANDING_UV_LAW, {256.0f, 0.25f}},
+        {"m_sqrt_3", AVB_COMPANDING_M_SQRT, {3.0f, 0.0f}},
+        {"mu_law_255", AVB_COMPANDING_MU_LAW, {255.0f, 0.0f}},
+        {"mu_law_8", AVB_COMPANDING_MU_LAW, {8.0f, 0.0f}},
+        {"uv_law_768", AVB_COMPANDING_UV_LAW, {768.0f, 0.125f}},
+        {"uv_law_64", AVB_COMPANDING_UV_LAW, {64.0f, 0.5f}},
+    };
+
+    //the old float to code conversion. it left NaN to the cast, which gives 0 on x86
+    uint16_t RefCode(float v)
+    {
+        v *= 65535.0f;
+        v = std::max(v, 0.0f);
+        v = std::min(v, 65535.0f);
+        return v == v ? (uint16_t)v : 0;
+    }
+    //the compander formulas one value at a time, as the valarray code had them
+    uint16_t RefCompress(const CheckCompander& c, float v)
+    {
+        if(c.id == AVB_COMPANDING_MU_LAW)
+        {
+            float k = 1.0f / std::log(1.0f+c.param[0]);
+            return RefCode(k * std::log(1.0f+c.param[0]*v));
+        }
+        if(c.id == AVB_COMPANDING_UV_LAW)
+        {
+            float gamma = (c.param[0]*c.param[1]-1.0f) / (c.param[0]+c.param[1]-2.0f);
+            float beta = 1.0f / (1.0f - gamma);
+            float alpha = 1.0f / (c.param[0]-gamma);
+            return RefCode(v / ((beta-alpha)*v + alpha) + gamma*v);
+        }
+        float r = std::sqrt(v);
+        for(int i=0; i<int(c.param[0])-1; i++)
+            r = std::sqrt(r);
+        return RefCode(r);
+    }
+    //cephes' atanf reduction and polynomial, which the RG16 angle is defined by
+    uint16_t RefAngle(float re, float im)
+    {
+        float ax = std::fabs(re), ay = std::fabs(im);
+        float t = std::min(ax, ay) / std::max(std::max(ax, ay), std::numeric_limits<float>::min());
+        bool big = t > 0.414213562f;
+        float x = big ? (t-1.0f)/(t+1.0f) : t;
+        float z = x*x;
+        float a = (((8.05374449538e-2f*z - 1.38776856032e-1f)*z + 1.99777106478e-1f)*z - 3.33329491539e-1f)*z*x + x;
+        if(big)
+            a = a + 0.785398163f;
+        if(ay > ax)
+            a = 1.57079633f - a;
+        if(re < 0.0f)
+            a = 3.14159265f - a;
+        if(im < 0.0f)
+            a = -a;
+        return (uint16_t)std::lrint(a*(65536.0f/6.28318531f));
+    }
+    avb::Pixel16 RefPixel(const CheckCompander& c, float re, float im, float norm, bool polar)
+    {
+        re /= norm;
+        im /= norm;
+        float m = std::sqrt(re*re + im*im);
+        avb::Pixel16 p;
+        p.g = RefCompress(c, m);
+        if(polar)
+        {
+            p.r = RefAngle(re, im);
+            p.b = 0;
+            return p;
+        }
+        re /= m;
+        im /= m;
+        p.r = RefCode(re*0.5f + 0.5f);
+        p.b = RefCode(im*0.5f + 0.5f);
+        return p;
+    }
+
+    //random bins over many decades, with zero, signed zero and denormal bins
+    //mixed in. returns the number of pixels that differ from RefPixel
+    uint64_t QuantizeCheck(const CheckCompander& c, uint32_t fftSize, bool polar)
+    {
+        avb::Compander16 comp;
+        float param[2] = {c.param[0], c.param[1]};
+        comp.Init(c.id, param);
+        uint32_t bins = fftSize/2+1;
+        uint32_t rows = std::max(4U, (1U<<17)/bins);
+        float norm = float(fftSize/2);
+        std::vector<fftwf_complex> dft(bins);
+        std::vector<avb::Pixel16> out(bins);
+        uint32_t x = 2463534242U + fftSize;
+        auto next = [&x]()
+        {
+            x ^= x<<13;
+            x ^= x>>17;
+            x ^= x<<5;
+            return (float)(int32_t)x / 2147483648.0f;
+        };
+        uint64_t bad = 0;
+        for(uint32_t row=0; row<rows; row++)
+        {
+            for(uint32_t i=0; i<bins; i++)
+            {
+                float scale = norm*std::pow(10.0f, 2.0f - 9.0f*std::fabs(next()));
+                float re = next()*scale, im = next()*scale;
+                switch((row+i) % 13)
+                {
+                case 0: re = im = 0.0f; break;
+                case 1: re = -0.0f; im = 0.0f; break;
+                case 2: re = next()*1e-39f; im = next()*1e-40f; break;
+                case 3: re = 0.0f; im = next()*1e-42f; break;
+                case 4: im = 0.0f; break;
+                }
+                dft[i][0] = re;
+                dft[i][1] = im;
+            }
+            if(polar)
+                avb::spectrum::QuantizePolar(&dft[0], bins, norm, comp, &out[0]);
+            else
+                avb::spectrum::Quantize(&dft[0], bins, norm, comp, &out[0]);
+            for(uint32_t i=0; i<bins; i++)
+            {
+                avb::Pixel16 ref = RefPixel(c, dft[i][0], dft[i][1], norm, polar);
+                if(out[i].r == ref.r && out[i].g == ref.g && out[i].b == ref.b)
+                    continue;
+                if(bad++ < 4)
+                {
+                    printf("  bin %u (%g, %g): %u %u %u, expected %u %u %u\n", i, dft[i][0], dft[i][1],
+                        out[i].r, out[i].g, out[i].b, ref.r, ref.g, ref.b);
+                }
+            }
+        }
+        return bad;
+    }
+
+    bool RunQuantizeChecks()
+    {
+        bool allPassed = true;
+        printf("%-28s %6s %10s\n", "quantize check", "fft", "mismatch");
+        for(const CheckCompander& c : checkCompanders)
+        {
+            for(uint32_t fftSize : {4U, 16U, 100U, 512U, 2048U, 16384U})
+            {
+                for(int polar=0; polar<2; polar++)
+                {
+                    std::string name = std::string("quantize_") + c.name + (polar ? "_rg16" : "");
+                    if(!Wanted(name))
+                        continue;
+                    uint64_t bad = QuantizeCheck(c, fftSize, polar != 0);
+                    printf("%-28s %6u %10llu %s\n", name.c_str(), fftSize, (unsigned long long)bad, bad ? "FAILED" : "ok");
+                    allPassed &= bad == 0;
+                }
+            }
+        }
+        return allPassed;
+    }
+
+    float FloatFromBits(uint32_t b)
+    {
+        float f;
+        memcpy(&f, &b, sizeof(f));
+        return f;
+    }
+
+    //a sweep of [0, 2] (denormals and everything past the top code included)
+    //plus, for every code, the first float the plain formula gives it and a
+    //few neighbours either side. returns the number of codes that differ.
+    //boundaryFallbacks counts the mu-law inputs whose log is too close to a
+    //boundary for the cephes bracket, the ones the vector path hands to std::log
+    uint64_t CompanderCheck(const CheckCompander& c, uint64_t* boundaryFallbacks)
+    {
+        const uint32_t top = 0x40000000U;
+        std::vector<float> v;
+        for(uint32_t b=0; b<=top; b+=997)
+            v.push_back(FloatFromBits(b));
+        *boundaryFallbacks = 0;
+        for(uint32_t code=1; code<65536; code++)
+        {
+            //the formulas only grow with the input, so the boundary bisects
+            //over the bit patterns of positive floats
+            uint32_t lo = 0, hi = top;
+            if(RefCompress(c, FloatFromBits(hi)) < code)
+                break;
+            while(lo < hi)
+            {
+                uint32_t mid = lo + (hi-lo)/2;
+                if(RefCompress(c, FloatFromBits(mid)) >= code)
+                    hi = mid;
+                else
+                    lo = mid+1;
+            }
+            for(uint32_t b=std::max(lo, 4U)-4; b<=lo+4; b++)
+            {
+                float x = FloatFromBits(b);
+                v.push_back(x);
+                if(c.id != AVB_COMPANDING_MU_LAW)
+                    continue;
+                float k = 1.0f / std::log(1.0f+c.param[0]);
+                float l = std::log(1.0f+c.param[0]*x);
+                if(RefCode(k*(l*(1.0f-2.5e-7f))) != RefCode(k*(l*(1.0f+2.5e-7f))))
+                    (*boundaryFallbacks)++;
+            }
+        }
+        avb::Compander16 comp;
+        float param[2] = {c.param[0], c.param[1]};
+        comp.Init(c.id, param);
+        std::vector<uint16_t> codes(v.size());
+        comp.Compress(&v[0], &codes[0], v.size());
+        uint64_t bad = 0;
+        for(size_t i=0; i<v.size(); i++)
+        {
+            uint16_t ref = RefCompress(c, v[i]);
+            if(codes[i] != ref && bad++ < 4)
+                printf("  %.9g: %u, expected %u\n", v[i], codes[i], ref);
+        }
+        return bad;
+    }
+
+    bool RunCompanderChecks()
+    {
+        bool allPassed = true;
+        printf("%-28s %10s %10s\n", "compander check", "mismatch", "fallback");
+        for(const CheckCompander& c : checkCompanders)
+        {
+            std::string name = std::string("compander_") + c.name;
+            if(!Wanted(name))
+                continue;
+            uint64_t fallbacks;
+            uint64_t bad = CompanderCheck(c, &fallbacks);
+            //a mu-law run that never reaches std::log would leave that path untested
+            bool passed = bad == 0 && (c.id != AVB_COMPANDING_MU_LAW || fallbacks > 0);
+            printf("%-28s %10llu %10llu %s\n", name.c_str(), (unsigned long long)bad, (unsigned long long)fallbacks, passed ? "ok" : "FAILED");
+            allPassed &= passed;
+        }
+        return allPassed;
+    }
+
+    bool WriteJson(const std::string& filename)
+    {
+        FILE* f = fopen(filename.c_str(), "w");
+        if(!f)
+            return false;
+        fprintf(f, "{\n  \"benchmark\": \"avbridge_bench\",\n  \"threads\": 1,\n  \"results\": [\n");
+        for(size_t i=0; i<results.size(); i++)
+        {
+            const Result& r = results[i];
+            fprintf(f, "    {\"name\": \"%s\", \"fft_size\": %u, \"frames\": %llu, \"ns_per_frame\": %.3f, \"gb_per_s\": %.6f}%s\n",
+                r.name.c_str(), r.fftSize, (unsigned long long)r.frames, r.nsPerFrame, r.gbPerSec, i+1<results.size() ? "," : "");
+        }
+        fprintf(f, "  ],\n  \"roundtrip\": [\n");
+        for(size_t i=0; i<roundTripResults.size(); i++)
+        {
+            const RoundTripResult& r = roundTripResults[i];
+            fprintf(f, "    {\"name\": \"%s\", \"bits\": %u, \"channels\": %u, \"horizontal\": %s, \"layout\": \"%s\", \"snr_db\": %.3f, \"min_snr_db\": %.3f, \"forward_realtime\": %.3f, \"backward_realtime\": %.3f, \"passed\": %s}%s\n",
+                r.name.c_str(), r.bits, r.numCh, r.horizontal ? "true" : "false", r.layout == AVB_LAYOUT_RG16 ? "rg16" : "rgb16", r.snr, r.threshold,
+                r.forwardRealtime, r.backwardRealtime, r.passed ? "true" : "false", i+1<roundTripResults.size() ? "," : "");
+        }
+        fprintf(f, "  ]\n}\n");
+        return fclose(f) == 0;
+    }
+
+    bool ParseArgs(int argc, char** argv)
+    {
+        opt.minFFT = 256;
+        opt.maxFFT = 65536;
+        opt.minTime = 0.05;
+        opt.roundtrip = false;
+        opt.quantizeCheck = false;
+        opt.companderCheck = false;
+        for(int i=1; i<argc; i++)
+        {
+            std::string a = argv[i];
+            if(a == "--roundtrip")
+            {
+                opt.roundtrip = true;
+                continue;
+            }
+            if(a == "--quantize-check")
+            {
+                opt.quantizeCheck = true;
+                continue;
+            }
+            if(a == "--compander-check")
+            {
+                opt.companderCheck = true;
+                continue;
+            }
+            if(i+1 >= argc)
+                return false;
+            if(a == "--json")
+                opt.jsonFilename = argv[++i];
+            else if(a == "--filter")
+                opt.filter = argv[++i];
+            else if(a == "--min-fft")
+                opt.minFFT = strtoul(argv[++i], nullptr, 10);
+            else if(a == "--max-fft")
+                opt.maxFFT = strtoul(argv[++i], nullptr, 10);
+            else if(a == "--min-time")
+                opt.minTime = strtod(argv[++i], nullptr)/1000.0;
+            else
+                return false;
+        }
+        return opt.minFFT >= 4 && opt.minFFT <= opt.maxFFT;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if(!ParseArgs(argc, argv))
+    {
+        printf("usage: %s [--roundtrip] [--quantize-check] [--compander-check] [--json file] [--filter substring] [--min-fft n] [--max-fft n] [--min-time ms]\n", argv[0]);
+        return 1;
+    }
+    if(opt.roundtrip)
+    {
+        bool passed = RunRoundTrips();
+        if(opt.jsonFilename.size() && !WriteJson(opt.jsonFilename))
+        {
+            printf("could not write %s\n", opt.jsonFilename.c_str());
+            return 1;
+        }
+        return passed ? 0 : 1;
+    }
+    if(opt.quantizeCheck)
+        return RunQuantizeChecks() ? 0 : 1;
+    if(opt.companderCheck)
+        return RunCompanderChecks() ? 0 : 1;
+    for(uint32_t bits : wavDepths)
+    {
+        if(!WriteTestWav(WavFilename(bits), bits, 2, wavSeconds))
+        {
+            printf("could not write %s\n", WavFilename(bits).c_str());
+            return 1;
+        }
+    }
+    printf("%-28s %6s %14s %10s\n", "benchmark", "fft", "ns/frame", "GB/s");
+    for(uint32_t fftSize=opt.minFFT; fftSize<=opt.maxFFT; fftSize*=2)
+    {
+        BenchForward(fftSize, AVB_LAYOUT_RGB16);
+        BenchForward(fftSize, AVB_LAYOUT_RG16);
+        BenchBackward(fftSize, AVB_LAYOUT_RGB16);
+        BenchBackward(fftSize, AVB_LAYOUT_RG16);
+        BenchCompander(fftSize);
+        BenchWindow(fftSize);
+        BenchWavReader(fftSize);
+    }
+    for(uint32_t bits : wavDepths)
+        remove(WavFilename(bits).c_str());
+    if(opt.jsonFilename.size() && !WriteJson(opt.jsonFilename))
+    {
+        printf("could not write %s\n", opt.jsonFilename.c_str());
+        return 1;
+    }
+    return 0;
+}
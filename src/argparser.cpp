@@ -0,0 +1,81 @@
+#include "argparser.hpp"
+
+void avb::ArgParser::AddOption(const char* name)
+{
+    knownOptions.insert(name);
+}
+void avb::ArgParser::AddFlag(const char* name)
+{
+    knownFlags.insert(name);
+}
+
+bool avb::ArgParser::Parse(int argc, char** argv)
+{
+    bool optionsEnded = false;
+    for(int i=1; i<argc; i++)
+    {
+        std::string arg(argv[i]);
+        //a lone "-" is a filename (stdin/stdout) like any other
+        if(optionsEnded || arg.size() < 2 || arg[0] != '-')
+        {
+            positional.push_back(arg);
+            continue;
+        }
+        if(arg == "--")
+        {
+            optionsEnded = true;
+            continue;
+        }
+        if(knownFlags.count(arg))
+        {
+            flagsGiven.insert(arg);
+            continue;
+        }
+        if(!knownOptions.count(arg))
+        {
+            errorMessage = "unknown option " + arg;
+            return false;
+        }
+        if(i+1 >= argc)
+        {
+            errorMessage = "missing value for " + arg;
+            return false;
+        }
+        values[arg] = argv[++i];
+    }
+    return true;
+}
+
+bool avb::ArgParser::IsSet(const char* name)
+{
+    return flagsGiven.count(name) || values.count(name);
+}
+std::string avb::ArgParser::Get(const char* name, const char* def)
+{
+    auto it = values.find(name);
+    return it == values.end() ? std::string(def) : it->second;
+}
+bool avb::ArgParser::GetUInt(const char* name, uint32_t def, uint32_t* out)
+{
+    *out = def;
+    auto it = values.find(name);
+    if(it == values.end())
+        return true;
+    char* end = nullptr;
+    unsigned long v = strtoul(it->second.c_str(), &end, 10);
+    if(it->second.empty() || *end || it->second[0] == '-' || v > 0xFFFFFFFFUL)
+    {
+        errorMessage = "not a number: " + std::string(name) + " " + it->second;
+        return false;
+    }
+    *out = v;
+    return true;
+}
+const std::vector<std::string>& avb::ArgParser::GetPositional()
+{
+    return positional;
+}
+std::string avb::ArgParser::GetError()
+{
+    return errorMessage;
+}
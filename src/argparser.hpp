@@ -0,0 +1,31 @@
+#ifndef AVB_ARGPARSER_H
+#define AVB_ARGPARSER_H
+
+#include "incl/c_cpp.hpp"
+
+namespace avb
+{
+    //"--name value" options, "--name" flags and positional arguments in any
+    //order. names have to be added before Parse, anything after "--" is positional
+    class ArgParser
+    {
+        std::set<std::string> knownOptions, knownFlags;
+        std::map<std::string, std::string> values;
+        std::set<std::string> flagsGiven;
+        std::vector<std::string> positional;
+        std::string errorMessage;
+    public:
+        void AddOption(const char* name);
+        void AddFlag(const char* name);
+        bool Parse(int argc, char** argv);
+
+        bool IsSet(const char* name);
+        std::string Get(const char* name, const char* def);
+        //false if the option is there but not a number
+        bool GetUInt(const char* name, uint32_t def, uint32_t* out);
+        const std::vector<std::string>& GetPositional();
+        std::string GetError();
+    };
+}
+
+#endif // AVB_ARGPARSER_H
@@ -0,0 +1,10 @@
+#ifndef AVB_AVBRIDGE_H
+#define AVB_AVBRIDGE_H
+
+//everything an embedding program needs: the file converters, batch
+//conversion and the in-memory streams, with ConverterSettings from converter.hpp
+#include "converter.hpp"
+#include "batch.hpp"
+#include "stream.hpp"
+
+#endif // AVB_AVBRIDGE_H
@@ -0,0 +1,187 @@
+#include "batch.hpp"
+
+bool HasWavExtension(const std::string& s)
+{
+    if(s.size() < 4)
+        return false;
+    std::string ext = s.substr(s.size()-4);
+    for(auto& c : ext)
+        c = tolower(c);
+    return ext == ".wav";
+}
+
+std::vector<std::string> avb::FindBatchInputs(const char* path)
+{
+    std::vector<std::string> r;
+    std::string path_s(path);
+    if(IsDirectory(path))
+    {
+        std::vector<std::string> names = ListDirectory(path);
+        std::sort(names.begin(), names.end());
+        std::string dir = path_s;
+        if(dir.size() && dir.back() != '/' && dir.back() != '\\')
+            dir += '/';
+        for(auto& n : names)
+            if(HasWavExtension(n) && !IsDirectory((dir+n).c_str()))
+                r.push_back(dir+n);
+        return r;
+    }
+    if(HasWavExtension(path_s))
+    {
+        r.push_back(path_s);
+        return r;
+    }
+    //anything else is a list, one filename per line, # starts a comment
+    std::ifstream f(path);
+    std::string line;
+    while(std::getline(f, line))
+    {
+        while(line.size() && isspace((unsigned char)line.back()))
+            line.pop_back();
+        if(line.size() && line[0] != '#')
+            r.push_back(line);
+    }
+    return r;
+}
+
+avb::BatchConverter::BatchConverter()
+{
+    maxOpenFiles = AVB_BATCH_DEFAULT_MAX_OPEN_FILES;
+    openFiles = 0;
+    pyramidBits = 0;
+    inputs = nullptr;
+    nextInput = 0;
+    numDone = 0;
+    numFailed = 0;
+    audioSeconds = 0.0;
+}
+avb::BatchConverter::~BatchConverter()
+{
+    //the converters go before the pool they run on
+    jobs.clear();
+    pool.Stop();
+}
+
+bool avb::BatchConverter::Init(ConverterSettings t_settings, uint32_t t_jobs, uint32_t t_maxOpenFiles)
+{
+    settings = t_settings;
+    maxOpenFiles = std::max(1U, t_maxOpenFiles);
+    if(!pool.Start(std::thread::hardware_concurrency()))
+        return false;
+    uint32_t numWorkers = pool.GetWorkerCount();
+    ctx = ConversionContext::Get(settings, AVB_FFT_FORWARD);
+    if(!ctx)
+        return false;
+    //a few files in flight are enough to hide the per-file setup and the
+    //serial start and end of each one, stereo files take two slots
+    uint32_t numJobs = t_jobs ? t_jobs : std::max(2U, numWorkers/2);
+    numJobs = std::min(numJobs, std::max(1U, maxOpenFiles/2));
+    printf("Batch: %d workers, %d files at a time, at most %d open outputs\n", numWorkers, numJobs, maxOpenFiles);
+    jobs.clear();
+    for(uint32_t i=0; i<numJobs; i++)
+    {
+        jobs.push_back(std::unique_ptr<ForwardConverter>(new ForwardConverter));
+        jobs.back()->SetVerbose(false);
+        if(!jobs.back()->Init(settings, &pool, numJobs))
+            return false;
+    }
+    return true;
+}
+
+void avb::BatchConverter::SetPyramid(uint32_t bits)
+{
+    for(auto& job : jobs)
+        job->SetPyramid(bits);
+    pyramidBits = bits;
+}
+void avb::BatchConverter::SetLayout(uint32_t layout)
+{
+    for(auto& job : jobs)
+        job->SetLayout(layout);
+}
+
+void avb::BatchConverter::AcquireFiles(uint32_t n)
+{
+    //a file with more channels than the cap still gets to run, alone
+    n = std::min(n, maxOpenFiles);
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this, n]{return openFiles + n <= maxOpenFiles;});
+    openFiles += n;
+}
+void avb::BatchConverter::ReleaseFiles(uint32_t n)
+{
+    n = std::min(n, maxOpenFiles);
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        openFiles -= n;
+    }
+    cv.notify_all();
+}
+
+void avb::BatchConverter::JobMain(uint32_t job)
+{
+    for(;;)
+    {
+        uint32_t i = nextInput++;
+        if(i >= inputs->size())
+            return;
+        const char* fn = (*inputs)[i].c_str();
+        //the header alone tells how many outputs the file will hold open
+        uint32_t numCh = 1;
+        uint32_t totalBlocks = 0;
+        double seconds = 0.0;
+        {
+            WavReader probe;
+            if(probe.Open(fn))
+            {
+                uint32_t hop = settings.fftSize/2;
+                numCh = std::max<uint32_t>(1, probe.status.hdr.sub1.NumChannels);
+                seconds = (double)probe.status.totalSamples / std::max<uint32_t>(1, probe.status.hdr.sub1.SampleRate);
+                totalBlocks = (probe.status.totalSamples+(hop-1))/hop;
+            }
+        }
+        //per channel, the image and its previews
+        uint32_t filesPerChannel = 1 + (pyramidBits ? PreviewPyramid::CountLevels(settings.fftSize/2+1, totalBlocks) : 0);
+        AcquireFiles(numCh*filesPerChannel);
+        uint64_t t0 = RunStats::Now();
+        bool ok = jobs[job]->Convert(fn);
+        double elapsed = (RunStats::Now()-t0) * 1e-9;
+        ReleaseFiles(numCh*filesPerChannel);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        numDone++;
+        if(ok)
+        {
+            audioSeconds += seconds;
+            printf("[%d/%d] %s (%.1fx realtime)\n", numDone, (int)inputs->size(), fn, elapsed > 0.0 ? seconds/elapsed : 0.0);
+        }
+        else
+        {
+            numFailed++;
+            printf("[%d/%d] %s failed\n", numDone, (int)inputs->size(), fn);
+        }
+        fflush(stdout);
+    }
+}
+
+uint32_t avb::BatchConverter::Convert(const std::vector<std::string>& filenames)
+{
+    inputs = &filenames;
+    nextInput = 0;
+    numDone = 0;
+    numFailed = 0;
+    audioSeconds = 0.0;
+    if(jobs.empty())
+        return filenames.size();
+    uint64_t t0 = RunStats::Now();
+    std::vector<std::thread> threads;
+    for(uint32_t i=0; i<jobs.size(); i++)
+        threads.push_back(std::thread(&BatchConverter::JobMain, this, i));
+    for(auto& t : threads)
+        t.join();
+    double elapsed = (RunStats::Now()-t0) * 1e-9;
+    printf("\nConverted %d of %d files, %.1f s of audio in %.2f s (%.1fx realtime)\n",
+           numDone-numFailed, (int)filenames.size(), audioSeconds, elapsed, elapsed > 0.0 ? audioSeconds/elapsed : 0.0);
+    inputs = nullptr;
+    return numFailed;
+}
@@ -0,0 +1,59 @@
+#ifndef AVB_BATCH_H
+#define AVB_BATCH_H
+
+#include "incl/c_cpp.hpp"
+#include "converter.hpp"
+
+#define AVB_BATCH_DEFAULT_MAX_OPEN_FILES 64
+
+namespace avb
+{
+    //the WAV files a batch argument stands for: the file itself, every
+    //*.wav in a directory (sorted), or the lines of a list file
+    std::vector<std::string> FindBatchInputs(const char* path);
+
+    //forward conversion of many files at once. every file gets its reader
+    //and writer, but frames from all of them go to one pool of workers and
+    //one set of plans, so a corpus of short clips keeps every core as busy
+    //as one long file does
+    class BatchConverter
+    {
+        ThreadPool pool;
+        ConverterSettings settings;
+        //held for the whole batch so the converters never rebuild it
+        std::shared_ptr<const ConversionContext> ctx;
+        std::vector<std::unique_ptr<ForwardConverter>> jobs;
+        uint32_t maxOpenFiles;
+        //output files of the conversions in progress
+        uint32_t openFiles;
+        //previews add files per channel, as many as the file's length needs
+        uint32_t pyramidBits;
+        std::mutex mtx;
+        std::condition_variable cv;
+        const std::vector<std::string>* inputs;
+        std::atomic<uint32_t> nextInput;
+        uint32_t numDone, numFailed;
+        double audioSeconds;
+
+        BatchConverter(const BatchConverter&) = delete;
+        BatchConverter& operator=(const BatchConverter&) = delete;
+        void AcquireFiles(uint32_t n);
+        void ReleaseFiles(uint32_t n);
+        void JobMain(uint32_t job);
+    public:
+        BatchConverter();
+        ~BatchConverter();
+
+        //t_jobs files are converted at the same time, 0 picks a number from
+        //the core count. never more than t_maxOpenFiles outputs are open
+        bool Init(ConverterSettings t_settings, uint32_t t_jobs, uint32_t t_maxOpenFiles);
+        //see ForwardConverter::SetPyramid
+        void SetPyramid(uint32_t bits);
+        //see ForwardConverter::SetLayout
+        void SetLayout(uint32_t layout);
+        //returns the number of files that failed
+        uint32_t Convert(const std::vector<std::string>& filenames);
+    };
+}
+
+#endif // AVB_BATCH_H
@@ -1,90 +1,195 @@
 #include "compander.hpp"
 
-std::valarray<uint16_t> avb::compfn::F32toUI16(std::valarray<float> v, bool checkRange)
+#if defined(__SSE2__) || defined(_M_X64)
+#define AVB_COMPANDER_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
 {
-    std::valarray<uint16_t> r(v.size());
-    v *= 65535.0f;
-    if(checkRange)
+    //scale [0,1] to 16 bits, clamping anything outside
+    inline uint16_t ToUI16(float v)
     {
-        for(auto& i : v)
-            i = std::max(i, 0.0f);
-        for(auto& i : v)
-            i = std::min(i, 65535.0f);
+        v *= 65535.0f;
+        v = std::max(v, 0.0f);
+        v = std::min(v, 65535.0f);
+        return v;
+    }
+
+#ifdef AVB_COMPANDER_SSE2
+    //ToUI16 on 4 values, maxps gives 0 for NaN like the scalar conversion does
+    inline __m128i Code4(__m128 v)
+    {
+        const __m128 top = _mm_set1_ps(65535.0f);
+        v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(v, top), _mm_setzero_ps()), top);
+        return _mm_cvttps_epi32(v);
+    }
+    inline void Store8(__m128i a, __m128i b, uint16_t* out)
+    {
+        const __m128i bias = _mm_set1_epi32(32768);
+        __m128i r = _mm_packs_epi32(_mm_sub_epi32(a, bias), _mm_sub_epi32(b, bias));
+        _mm_storeu_si128((__m128i*)out, _mm_xor_si128(r, _mm_set1_epi16(-32768)));
     }
-    for(uint32_t i=0; i<v.size(); i++)
-        r[i] = v[i];
-    return r;
-}
-std::valarray<float> avb::expnfn::UI16toF32(std::valarray<uint16_t>& v)
-{
-    std::valarray<float> r(v.size());
-    for(uint32_t i=0; i<v.size(); i++)
-        r[i] = (float)v[i] / 65535.0f;
-    return r;
-}
 
+    //cephes logf, for finite u >= 1. the relative error against the true
+    //log is below 8.2e-8 over that whole range (checked on every float)
+    inline __m128 Log4(__m128 u)
+    {
+        __m128i bits = _mm_castps_si128(u);
+        __m128i e = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126));
+        __m128 x = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_set1_epi32(0x3F000000)));
+        __m128 small = _mm_cmplt_ps(x, _mm_set1_ps(0.707106781186547524f));
+        e = _mm_add_epi32(e, _mm_castps_si128(small));
+        x = _mm_sub_ps(_mm_add_ps(x, _mm_and_ps(x, small)), _mm_set1_ps(1.0f));
+        __m128 fe = _mm_cvtepi32_ps(e);
+        __m128 z = _mm_mul_ps(x, x);
+        __m128 y = _mm_set1_ps(7.0376836292E-2f);
+        y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.1514610310E-1f));
+        y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.1676998740E-1f));
+        y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.2420140846E-1f));
+        y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.4249322787E-1f));
+        y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.6668057665E-1f));
+        y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(2.0000714765E-1f));
+        y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-2.4999993993E-1f));
+        y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(3.3333331174E-1f));
+        y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+        y = _mm_add_ps(y, _mm_mul_ps(fe, _mm_set1_ps(-2.12194440e-4f)));
+        y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+        x = _mm_add_ps(x, y);
+        return _mm_add_ps(x, _mm_mul_ps(fe, _mm_set1_ps(0.693359375f)));
+    }
+    //mu-law codes of 4 values, returns a lane mask of the ones left to std::log.
+    //std::log is within 7.9e-8 of the true log, so it lies within 2.5e-7 of
+    //ours (rounding of the bracket included). the code only grows with the log,
+    //so where both ends of that bracket give the same code it is the std::log one
+    inline int MuLaw4(__m128 v, __m128 p, __m128 k, __m128i* code)
+    {
+        const __m128 one = _mm_set1_ps(1.0f);
+        __m128 u = _mm_add_ps(one, _mm_mul_ps(p, v));
+        __m128 l = Log4(u);
+        __m128i lo = Code4(_mm_mul_ps(k, _mm_mul_ps(l, _mm_set1_ps(1.0f - 2.5e-7f))));
+        __m128i hi = Code4(_mm_mul_ps(k, _mm_mul_ps(l, _mm_set1_ps(1.0f + 2.5e-7f))));
+        __m128 valid = _mm_and_ps(_mm_cmpge_ps(u, one), _mm_cmple_ps(u, _mm_set1_ps(std::numeric_limits<float>::max())));
+        __m128 sure = _mm_and_ps(valid, _mm_castsi128_ps(_mm_cmpeq_epi32(lo, hi)));
+        *code = lo;
+        return _mm_movemask_ps(sure) ^ 0xF;
+    }
+#endif
+}
 
-std::valarray<uint16_t> avb::compfn::MuLaw(std::valarray<float>& v, float* param)
+void avb::compfn::MuLaw(const float* v, uint16_t* out, uint32_t n, const float* param)
 {
-    std::valarray<float> rf(1.0f / std::log(1.0f+param[0]), v.size());
-    rf *= std::log(1.0f+param[0]*v);
-    return F32toUI16(rf, true);
+    float k = 1.0f / std::log(1.0f+param[0]);
+    uint32_t i = 0;
+#ifdef AVB_COMPANDER_SSE2
+    const __m128 kp = _mm_set1_ps(param[0]), kk = _mm_set1_ps(k);
+    for(; i+8<=n; i+=8)
+    {
+        __m128i a, b;
+        int redo = MuLaw4(_mm_loadu_ps(v+i), kp, kk, &a);
+        redo |= MuLaw4(_mm_loadu_ps(v+i+4), kp, kk, &b) << 4;
+        Store8(a, b, out+i);
+        for(uint32_t j=0; redo; j++, redo>>=1)
+            if(redo & 1)
+                out[i+j] = ToUI16(k * std::log(1.0f+param[0]*v[i+j]));
+    }
+#endif
+    for(; i<n; i++)
+        out[i] = ToUI16(k * std::log(1.0f+param[0]*v[i]));
 }
-std::valarray<uint16_t> avb::compfn::UVLaw(std::valarray<float>& v, float* param)
+void avb::compfn::UVLaw(const float* v, uint16_t* out, uint32_t n, const float* param)
 {
     float gamma = (param[0]*param[1]-1.0f) / (param[0]+param[1]-2.0f);
     float beta = 1.0f / (1.0f - gamma);
     float alpha = 1.0f / (param[0]-gamma);
-    std::valarray<float> rf = v / ((beta-alpha)*v + alpha) + gamma*v;
-    return F32toUI16(rf, true);
+    float ba = beta-alpha;
+    uint32_t i = 0;
+#ifdef AVB_COMPANDER_SSE2
+    const __m128 kba = _mm_set1_ps(ba), kalpha = _mm_set1_ps(alpha), kgamma = _mm_set1_ps(gamma);
+    for(; i+8<=n; i+=8)
+    {
+        __m128 a = _mm_loadu_ps(v+i);
+        __m128 b = _mm_loadu_ps(v+i+4);
+        a = _mm_add_ps(_mm_div_ps(a, _mm_add_ps(_mm_mul_ps(kba, a), kalpha)), _mm_mul_ps(kgamma, a));
+        b = _mm_add_ps(_mm_div_ps(b, _mm_add_ps(_mm_mul_ps(kba, b), kalpha)), _mm_mul_ps(kgamma, b));
+        Store8(Code4(a), Code4(b), out+i);
+    }
+#endif
+    for(; i<n; i++)
+        out[i] = ToUI16(v[i] / (ba*v[i] + alpha) + gamma*v[i]);
 }
-std::valarray<uint16_t> avb::compfn::MSqrt(std::valarray<float>& v, float* param)
+void avb::compfn::MSqrt(const float* v, uint16_t* out, uint32_t n, const float* param)
 {
-    std::valarray<float> rf = std::sqrt(v);
     int numIter = int(param[0])-1;
-    for(int i=0; i<numIter; i++)
-        rf = std::sqrt(rf);
-    return F32toUI16(rf, true);
+    uint32_t i = 0;
+#ifdef AVB_COMPANDER_SSE2
+    for(; i+8<=n; i+=8)
+    {
+        __m128 a = _mm_sqrt_ps(_mm_loadu_ps(v+i));
+        __m128 b = _mm_sqrt_ps(_mm_loadu_ps(v+i+4));
+        for(int j=0; j<numIter; j++)
+        {
+            a = _mm_sqrt_ps(a);
+            b = _mm_sqrt_ps(b);
+        }
+        Store8(Code4(a), Code4(b), out+i);
+    }
+#endif
+    for(; i<n; i++)
+    {
+        float r = std::sqrt(v[i]);
+        for(int j=0; j<numIter; j++)
+            r = std::sqrt(r);
+        out[i] = ToUI16(r);
+    }
 }
 
-std::valarray<float> avb::expnfn::MuLaw(std::valarray<uint16_t>& v, float* param)
+void avb::expnfn::MuLaw(const uint16_t* v, float* out, uint32_t n, const float* param)
 {
-    std::valarray<float> rf(1.0f / param[0], v.size());
-    std::valarray<float> vf = UI16toF32(v);
-    for(uint32_t i=0; i<v.size(); i++)
-        rf[i] *= std::pow(1.0f + param[0], vf[i]) - 1.0f;
-    return rf;
+    float k = 1.0f / param[0];
+    for(uint32_t i=0; i<n; i++)
+        out[i] = k * (std::pow(1.0f + param[0], (float)v[i] / 65535.0f) - 1.0f);
 }
-std::valarray<float> avb::expnfn::UVLaw(std::valarray<uint16_t>& v, float* param)
+void avb::expnfn::UVLaw(const uint16_t* v, float* out, uint32_t n, const float* param)
 {
-    std::valarray<float> vf = UI16toF32(v);
     float gamma = (param[0]*param[1]-1.0f) / (param[0]+param[1]-2.0f);
     float beta = 1.0f / (1.0f - gamma);
     float alpha = 1.0f / (param[0]-gamma);
 
     float a = gamma*(alpha-beta);
-    std::valarray<float> b = vf*(beta-alpha) - gamma*alpha - 1.0f;
-    std::valarray<float> c = vf*alpha;
-
-    return (-b-std::sqrt(b*b - 4.0f*a*c)) / (2.0f*a);
+    float ba = beta-alpha, ga = gamma*alpha, a4 = 4.0f*a, a2 = 2.0f*a;
+    for(uint32_t i=0; i<n; i++)
+    {
+        float vf = (float)v[i] / 65535.0f;
+        float b = vf*ba - ga - 1.0f;
+        float c = vf*alpha;
+        out[i] = (-b-std::sqrt(b*b - a4*c)) / a2;
+    }
 }
-std::valarray<float> avb::expnfn::MSqrt(std::valarray<uint16_t>& v, float* param)
+void avb::expnfn::MSqrt(const uint16_t* v, float* out, uint32_t n, const float* param)
 {
-    std::valarray<float> vf = UI16toF32(v);
-    vf *= vf;
     int numIter = int(param[0])-1;
-    for(int i=0; i<numIter; i++)
+    for(uint32_t i=0; i<n; i++)
+    {
+        float vf = (float)v[i] / 65535.0f;
         vf *= vf;
-    return vf;
+        for(int j=0; j<numIter; j++)
+            vf *= vf;
+        out[i] = vf;
+    }
 }
 
 
-void avb::Compander16::Method::CreateExLookupTable(float* param)
+void avb::Compander16::Method::CreateExLookupTable(const float* param)
 {
-    std::valarray<uint16_t> v(65536);
-    for(uint32_t i=0; i<65536; i++)
-        v[i] = i;
-    expansionLookupTable = (*expFn)(v, param);
+    uint16_t v[256];
+    expansionLookupTable.resize(65536);
+    for(uint32_t base=0; base<65536; base+=256)
+    {
+        for(uint32_t i=0; i<256; i++)
+            v[i] = base+i;
+        (*expFn)(v, &expansionLookupTable[base], 256, param);
+    }
 }
 
 avb::Compander16::Compander16()
@@ -154,16 +259,18 @@ void avb::Compander16::Init(uint32_t method, float* params)
 }
 
 
-std::valarray<uint16_t> avb::Compander16::Compress(std::valarray<float>& v)
+void avb::Compander16::Compress(const float* v, uint16_t* out, uint32_t n) const
 {
-    return (*(cur_method->cmpFn))(v, param);
+    (*(cur_method->cmpFn))(v, out, n, param);
 }
-std::valarray<float> avb::Compander16::Expand(std::valarray<uint16_t>& v)
+void avb::Compander16::Expand(const uint16_t* v, float* out, uint32_t n) const
 {
     if(!cur_method->useExpansionLookupTable)
-         return (*(cur_method->expFn))(v, param);
-    std::valarray<float> r(v.size());
-    for(uint32_t i=0; i<v.size(); i++)
-        r[i] = cur_method->expansionLookupTable[v[i]];
-    return r;
+    {
+        (*(cur_method->expFn))(v, out, n, param);
+        return;
+    }
+    const float* table = &cur_method->expansionLookupTable[0];
+    for(uint32_t i=0; i<n; i++)
+        out[i] = table[v[i]];
 }
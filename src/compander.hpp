@@ -9,25 +9,22 @@
 
 namespace avb
 {
-    typedef std::valarray<uint16_t> (*CompressionFunc16)(std::valarray<float>&, float*);
-    typedef std::valarray<float> (*ExpansionFunc16)(std::valarray<uint16_t>&, float*);
+    typedef void (*CompressionFunc16)(const float*, uint16_t*, uint32_t, const float*);
+    typedef void (*ExpansionFunc16)(const uint16_t*, float*, uint32_t, const float*);
 
     namespace compfn
     {
-        std::valarray<uint16_t> F32toUI16(std::valarray<float> v, bool checkRange);
-
-        std::valarray<uint16_t> MuLaw(std::valarray<float>& v, float* param);
-        std::valarray<uint16_t> UVLaw(std::valarray<float>& v, float* param);
-        std::valarray<uint16_t> MSqrt(std::valarray<float>& v, float* param);
+        //vectorised, but every code is the same as the plain float formula gives
+        void MuLaw(const float* v, uint16_t* out, uint32_t n, const float* param);
+        void UVLaw(const float* v, uint16_t* out, uint32_t n, const float* param);
+        void MSqrt(const float* v, uint16_t* out, uint32_t n, const float* param);
     }
 
     namespace expnfn
     {
-        std::valarray<float> UI16toF32(std::valarray<uint16_t>& v);
-
-        std::valarray<float> MuLaw(std::valarray<uint16_t>& v, float* param);
-        std::valarray<float> UVLaw(std::valarray<uint16_t>& v, float* param);
-        std::valarray<float> MSqrt(std::valarray<uint16_t>& v, float* param);
+        void MuLaw(const uint16_t* v, float* out, uint32_t n, const float* param);
+        void UVLaw(const uint16_t* v, float* out, uint32_t n, const float* param);
+        void MSqrt(const uint16_t* v, float* out, uint32_t n, const float* param);
     }
 
     class Compander16
@@ -40,7 +37,7 @@ namespace avb
             bool useExpansionLookupTable;
             float paramDefault[2];
             std::valarray<float> expansionLookupTable;
-            void CreateExLookupTable(float* param);
+            void CreateExLookupTable(const float* param);
         };
         std::map<std::string, uint32_t> methodID;
         std::map<uint32_t, Method> methods;
@@ -58,8 +55,8 @@ namespace avb
         void Init(uint32_t method);
         void Init(uint32_t method, float* params);
 
-        std::valarray<uint16_t> Compress(std::valarray<float>& v);
-        std::valarray<float> Expand(std::valarray<uint16_t>& v);
+        void Compress(const float* v, uint16_t* out, uint32_t n) const;
+        void Expand(const uint16_t* v, float* out, uint32_t n) const;
     };
 }
 
@@ -1,14 +1,46 @@
 #include "converter.hpp"
 
+uint32_t avb::GetBackwardOutputBits(const ImageFileHeader& hdr, ConverterSettings settings)
+{
+    uint32_t bits = hdr.inputWavHeader.sub1.BitsPerSample;
+    if(settings.outputFloat32Audio || hdr.convSettingsUsed.outputFloat32Audio || bits == 32)
+        return 32;
+    return bits == 24 ? 24 : 16;
+}
+
 avb::ImageFileHeader avb::MakeBlankImageFileHeader()
 {
     ImageFileHeader r;
     memset(&r, 0, sizeof(r));
     r.magicNumber = 0x42069AB6;
-    r.headerVersion = 1;
+    r.headerVersion = 2;
     r.headerSize = sizeof(r);
     return r;
 }
+uint32_t avb::GetImageLayout(const ImageFileHeader& hdr)
+{
+    return hdr.headerVersion == 3 ? AVB_LAYOUT_RG16 : AVB_LAYOUT_RGB16;
+}
+void avb::SetImageLayout(ImageFileHeader* hdr, uint32_t layout)
+{
+    hdr->headerVersion = layout == AVB_LAYOUT_RG16 ? 3 : 2;
+}
+bool avb::ReadImageFileHeader(const char* filename, ImageFileHeader* hdr)
+{
+    MappedFile f;
+    if(!f.Open(filename) || f.Size() < 12)
+        return false;
+    ImageFileHeader r;
+    memset(&r, 0, sizeof(r));
+    memcpy(&r, f.Data(), 12);
+    if(r.magicNumber != 0x42069AB6 || r.headerSize > f.Size() || r.headerSize < offsetof(ImageFileHeader, totalSamples))
+        return false;
+    memcpy(&r, f.Data(), std::min<uint64_t>(r.headerSize, sizeof(r)));
+    if(r.headerVersion < 2)
+        r.totalSamples = r.inputWavHeader.sub2.Subchunk2Size / std::max<uint32_t>(1, r.inputWavHeader.sub1.BlockAlign);
+    *hdr = r;
+    return true;
+}
 avb::ConverterSettings avb::MakeDefaultConverterSettings()
 {
     ConverterSettings r;
@@ -22,107 +54,142 @@ avb::ConverterSettings avb::MakeDefaultConverterSettings()
     r.horizontalTime = false;
     r.forceOverwrite = false;
     r.outputFloat32Audio = false;
+    r.ditherOutput = false;
     return r;
 }
 
+avb::ConversionContext::ConversionContext()
+{
+    direction = AVB_FFT_FORWARD;
+}
+bool avb::ConversionContext::Init(ConverterSettings t_settings, uint32_t t_direction)
+{
+    direction = t_direction;
+    window = MakeWindow(t_settings.fftSize, t_settings.windowFunction);
+    inverseSquareWindow = window*window;
+    inverseSquareWindow += inverseSquareWindow.cshift(t_settings.fftSize/2);
+    inverseSquareWindow = 1.0f / inverseSquareWindow;
+    compander.Init(t_settings.compandingMethod, t_settings.companderParam);
+    return plans.Init(t_settings.fftSize, direction);
+}
+std::shared_ptr<const avb::ConversionContext> avb::ConversionContext::Get(ConverterSettings t_settings, uint32_t t_direction)
+{
+    //only the fields the context is built from, so padding and output
+    //options never split the cache
+    std::array<uint32_t, 6> key = {{t_settings.fftSize, t_settings.compandingMethod, t_settings.windowFunction, 0, 0, t_direction}};
+    memcpy(&key[3], t_settings.companderParam, 2*sizeof(float));
+
+    //held while building, so equal settings never plan twice
+    static std::mutex cacheMutex;
+    static std::map<std::array<uint32_t, 6>, std::weak_ptr<const ConversionContext>> cache;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    std::shared_ptr<const ConversionContext> r = cache[key].lock();
+    if(r)
+        return r;
+    std::shared_ptr<ConversionContext> ctx = std::make_shared<ConversionContext>();
+    if(!ctx->Init(t_settings, t_direction))
+        return nullptr;
+    cache[key] = ctx;
+    return ctx;
+}
+
 avb::ForwardConverterThread::ForwardConverterThread()
 {
-    fftwPlanExists = false;
     fftwAudioBuffer = nullptr;
     fftwDFTBuffer = nullptr;
+    stats = nullptr;
+    layout = AVB_LAYOUT_RGB16;
     //Init(MakeDefaultConverterSettings());
 }
-avb::ForwardConverterThread::ForwardConverterThread(avb::ConverterSettings t_settings)
+avb::ForwardConverterThread::ForwardConverterThread(avb::ConverterSettings t_settings, std::shared_ptr<const ConversionContext> t_ctx)
 {
-    fftwPlanExists = false;
     fftwAudioBuffer = nullptr;
     fftwDFTBuffer = nullptr;
-    Init(t_settings);
+    stats = nullptr;
+    layout = AVB_LAYOUT_RGB16;
+    Init(t_settings, t_ctx);
 }
 avb::ForwardConverterThread::~ForwardConverterThread()
 {
     Deinit();
 }
 
-bool avb::ForwardConverterThread::Init(avb::ConverterSettings t_settings)
+bool avb::ForwardConverterThread::Init(avb::ConverterSettings t_settings, std::shared_ptr<const ConversionContext> t_ctx)
 {
     settings = t_settings;
+    ctx = t_ctx;
     uint32_t bins = settings.fftSize/2+1;
 
-    outTmpReal = outTmpImag = outTmpMagn = std::valarray<float>(bins);
-    outTmpReal16 = outTmpImag16 = std::valarray<uint16_t>(bins);
-    outTmpMagn16 = std::valarray<uint16_t>(bins);
-    fftwAudioBuffer = (float*)fftwf_malloc(2*bins*sizeof(float));
-    fftwDFTBuffer = (fftwf_complex*)fftwf_malloc(bins*sizeof(fftwf_complex));
-    fftwPlan = fftwf_plan_dft_r2c_1d(settings.fftSize, fftwAudioBuffer, fftwDFTBuffer, FFTW_MEASURE);
-    fftwPlanExists = true;
-    window = MakeWindow(settings.fftSize, settings.windowFunction);
-
-    compressor.Init(t_settings.compandingMethod, t_settings.companderParam);
+    //frames sit back to back, fftSize floats in and bins complex out apiece
+    fftwAudioBuffer = (float*)fftwf_malloc(AVB_FFT_BATCH*settings.fftSize*sizeof(float));
+    fftwDFTBuffer = (fftwf_complex*)fftwf_malloc(AVB_FFT_BATCH*bins*sizeof(fftwf_complex));
     if(!fftwAudioBuffer || !fftwDFTBuffer)
         return false;
     return true;
 }
 void avb::ForwardConverterThread::Deinit()
 {
-    if(fftwPlanExists)
-    {
-        fftwf_destroy_plan(fftwPlan);
-        fftwPlanExists = false;
-    }
+    ctx.reset();
     fftwf_free(fftwAudioBuffer);
     fftwf_free(fftwDFTBuffer);
+    fftwAudioBuffer = nullptr;
+    fftwDFTBuffer = nullptr;
 }
 
-void avb::ForwardConverterThread::ProcessBlock(Pixel16* output, std::valarray<float>& input)
+void avb::ForwardConverterThread::QuantizeBlock(Pixel16* output, fftwf_complex* dft)
 {
-    uint32_t bins = (settings.fftSize/2+1);
-    input *= window;
-    memcpy(fftwAudioBuffer, &input[0], settings.fftSize*sizeof(float));
-    fftwf_execute(fftwPlan);
-    for(uint32_t i=0; i<bins; i++)
-        outTmpReal[i] = fftwDFTBuffer[i][0];
-    for(uint32_t i=0; i<bins; i++)
-        outTmpImag[i] = fftwDFTBuffer[i][1];
-    outTmpReal /= float(settings.fftSize/2);
-    outTmpImag /= float(settings.fftSize/2);
-    outTmpMagn = outTmpReal*outTmpReal + outTmpImag*outTmpImag;
-    outTmpMagn = std::sqrt(outTmpMagn);
-    outTmpReal /= outTmpMagn;
-    outTmpImag /= outTmpMagn;
-    outTmpReal16 = compfn::F32toUI16(outTmpReal*0.5f + 0.5f, true);
-    outTmpImag16 = compfn::F32toUI16(outTmpImag*0.5f + 0.5f, true);
-    outTmpMagn16 = compressor.Compress(outTmpMagn);
-    for(uint32_t i=0; i<bins; i++)
-    {
-        output[i].r = outTmpReal16[i];
-        output[i].b = outTmpImag16[i];
-        output[i].g = outTmpMagn16[i];
-    }
-    //puts("ProcessBlock done");
-}
-
-void avb::ForwardConverterThread::Process()
+    if(layout == AVB_LAYOUT_RG16)
+        spectrum::QuantizePolar(dft, settings.fftSize/2+1, float(settings.fftSize/2), ctx->compander, output);
+    else
+        spectrum::Quantize(dft, settings.fftSize/2+1, float(settings.fftSize/2), ctx->compander, output);
+}
+void avb::ForwardConverterThread::SetStats(RunStats* t_stats)
 {
-    uint32_t bins = (settings.fftSize/2+1);
-    outputs.resize(inputs.size()*bins);
-    for(uint32_t i=0; i<inputs.size(); i++)
-        ProcessBlock(&outputs[i*bins], inputs[i]);
-    inputs.resize(0);
+    stats = t_stats;
 }
-
-void avb::ForwardConverterThread::ProcessAsync()
+void avb::ForwardConverterThread::SetLayout(uint32_t t_layout)
 {
-    stlThread = std::thread(&ForwardConverterThread::Process, this);
+    layout = t_layout;
 }
-void avb::ForwardConverterThread::WaitForCompletion()
+void avb::ForwardConverterThread::ProcessBlocks(Pixel16* output, const float* samples, uint32_t count)
 {
-    stlThread.join();
+    uint32_t bins = (settings.fftSize/2+1);
+    uint32_t n = settings.fftSize;
+    uint32_t hop = n/2;
+    const float* win = &ctx->window[0];
+    if(stats)
+        stats->AddFrames(count);
+    while(count)
+    {
+        uint64_t t = StageStart(stats);
+        //full batches go through the many-plan, the leftovers one by one
+        uint32_t num = count >= AVB_FFT_BATCH ? AVB_FFT_BATCH : 1;
+        for(uint32_t j=0; j<num; j++)
+        {
+            const float* src = samples + j*hop;
+            float* dst = fftwAudioBuffer + j*n;
+            for(uint32_t i=0; i<n; i++)
+                dst[i] = src[i]*win[i];
+        }
+        ctx->plans.Forward(fftwAudioBuffer, fftwDFTBuffer, num);
+        t = StageLap(stats, AVB_STAGE_FFT, t);
+        for(uint32_t j=0; j<num; j++)
+            QuantizeBlock(output + j*bins, fftwDFTBuffer + j*bins);
+        StageLap(stats, AVB_STAGE_QUANTIZE, t);
+        output += num*bins;
+        samples += num*hop;
+        count -= num;
+    }
 }
 
 avb::ForwardConverter::ForwardConverter()
 {
+    pool = nullptr;
     numThreads = 0;
+    share = 1;
+    verbose = true;
+    pyramidBits = 0;
+    layout = AVB_LAYOUT_RGB16;
 }
 avb::ForwardConverter::~ForwardConverter()
 {
@@ -156,181 +223,390 @@ std::string avb::ForwardConverter::RemoveFilenameExtension(std::string s)
 
 bool avb::ForwardConverter::Init(avb::ConverterSettings t_settings)
 {
-    printf("Initializing converter...\n");
+    if(verbose)
+        printf("Initializing converter...\n");
 
     numThreads = std::thread::hardware_concurrency();
-    printf("Logical processors available: %d ", numThreads);
-    if(numThreads%2 == 1)
-    {
-        numThreads *= 2;
-        printf("(will create %d threads)", numThreads);
-    }
-    printf("\n");
+    if(verbose)
+        printf("Logical processors available: %d\n", numThreads);
 
+    ownPool.Start(numThreads);
+    return Init(t_settings, &ownPool, 1);
+}
+bool avb::ForwardConverter::Init(avb::ConverterSettings t_settings, ThreadPool* t_pool, uint32_t t_share)
+{
     settings = t_settings;
+    pool = t_pool;
+    share = std::max(1U, t_share);
 
+    numThreads = pool->GetWorkerCount();
+    ctx = ConversionContext::Get(settings, AVB_FFT_FORWARD);
+    if(!ctx)
+        return false;
+    //one per pool worker, a worker only ever runs one of our tasks at a time
     thr = std::vector<ForwardConverterThread>(numThreads);
-    printf("Initializing thread ");
+    if(verbose)
+        printf("Initializing thread ");
 
     for(uint32_t i=0; i<thr.size(); i++)
     {
-        printf("%d.. ", i+1);
-        if(!thr[i].Init(t_settings))
+        if(verbose)
+            printf("%d.. ", i+1);
+        thr[i].SetStats(&stats);
+        thr[i].SetLayout(layout);
+        if(!thr[i].Init(t_settings, ctx))
         {
             printf("Failed to init thread\n");
             return false;
         }
     }
-    printf("\n");
+    if(verbose)
+        printf("\n");
     return true;
 
 }
+void avb::ForwardConverter::SetVerbose(bool t_verbose)
+{
+    verbose = t_verbose;
+}
+void avb::ForwardConverter::SetPyramid(uint32_t bits)
+{
+    pyramidBits = bits;
+}
+void avb::ForwardConverter::SetLayout(uint32_t t_layout)
+{
+    layout = t_layout;
+    for(auto& t : thr)
+        t.SetLayout(layout);
+}
 
-void WriteInBlocks(FILE* f, void* dat, uint32_t dataSize, uint32_t blockSize)
+void WriteInBlocks(FILE* f, void* dat, uint64_t dataSize, uint64_t blockSize)
 {
-    uint32_t bytesLeft = dataSize;
-    uint32_t bytesSaved = 0;
+    uint64_t bytesLeft = dataSize;
+    uint64_t bytesSaved = 0;
     while(bytesLeft)
     {
-        uint32_t bytesToSave = std::min(blockSize, bytesLeft);
+        uint64_t bytesToSave = std::min(blockSize, bytesLeft);
         fwrite((char*)dat+bytesSaved, 1, bytesToSave, f);
         bytesLeft -= bytesToSave;
         bytesSaved += bytesToSave;
     }
 }
-void WriteHelper(std::vector<FILE*> f, std::vector<void*> d, std::vector<uint32_t> s)
-{
-    for(uint32_t i=0; i<f.size(); i++)
-        WriteInBlocks(f[i], d[i], s[i], 524288);
-}
-
-bool avb::ForwardConverter::Convert(const char* inputFilename)
+//strip holds numBlocks columns (stride stripBlocks) of every bin row, each
+//row lands at its own place in the horizontal image
+void WriteColumnStrip(FILE* f, const avb::Pixel16* strip, uint32_t stripBlocks, uint32_t bins, uint32_t firstBlock, uint32_t numBlocks, uint32_t totalBlocks, uint32_t layout)
 {
-    //TODO: break up this fucking 120-line monster of a function
-    printf("\nStarting conversion... (input filename: %s)\n", inputFilename);
-    bool wavValid = audioReader.Open(inputFilename);
-    if(!wavValid)
+    uint32_t pixelBytes = avb::GetPixelBytes(layout);
+    for(uint32_t y=0; y<bins; y++)
     {
-        printf("Could not open WAV file: %s\n", audioReader.status.errorMessage.c_str());
-        return false;
+        avb::SeekFile(f, sizeof(avb::ImageFileHeader) + ((uint64_t)y*totalBlocks + firstBlock)*pixelBytes);
+        avb::WritePixels(f, strip + (uint64_t)y*stripBlocks, numBlocks, layout);
     }
-    puts("WAV file ok");
-
+}
+bool avb::ForwardConverter::CreateOutputFiles(const char* inputFilename, uint32_t totalBlocks, std::vector<FILE*>& outFile)
+{
     uint32_t numCh = audioReader.status.hdr.sub1.NumChannels;
-    uint32_t blocksProcessed = 0;
-    uint32_t fftSize = settings.fftSize;
-    uint32_t totalBlocks = (audioReader.status.totalSamples+(fftSize/2-1))/(fftSize/2);
-    uint32_t blockCount = std::min(4096U, std::max(64U, totalBlocks/8));
-    uint32_t threads = thr.size();
-    uint32_t threadsPerCh = threads/numCh;
-    uint32_t prevProgressMsgLength = 0;
-    if(numCh > 2)
-    {
-        printf("sorry, more than 2 channels not supported\n");
-        return false;
-    }
-    std::vector<FILE*> outFile(numCh);
-    printf("Allocating hard drive space... ");
+    outFile = std::vector<FILE*>(numCh, nullptr);
+    outFilenames = std::vector<std::string>(numCh);
+    if(verbose)
+        printf("Allocating hard drive space... ");
     for(uint32_t i=0; i<numCh; i++)
     {
         //i apologize for this in advance
         std::string outFnTmp = RemoveFilenameExtension(std::string(inputFilename));
         std::vector<char> realFNBuf(outFnTmp.size()+69, 0);
         sprintf(&realFNBuf[0], "%s_ch%d.raw", outFnTmp.c_str(), i+1);
-        uint32_t fileSizeBytes = totalBlocks*(fftSize/2+1)*sizeof(Pixel16) + sizeof(ImageFileHeader);
+        uint64_t fileSizeBytes = (uint64_t)totalBlocks*(settings.fftSize/2+1)*GetPixelBytes(layout) + sizeof(ImageFileHeader);
+        outFilenames[i] = &realFNBuf[0];
         bool fileCreated = CreateCustomSizedFile(&realFNBuf[0], fileSizeBytes);
-        if(!fileCreated)
+        if(fileCreated)
+            outFile[i] = fopen(&realFNBuf[0], "r+b");
+        if(!outFile[i])
         {
-            printf("failure\n");
+            printf("Could not create %s\n", &realFNBuf[0]);
+            for(uint32_t j=0; j<i; j++)
+                fclose(outFile[j]);
             return false;
         }
-        outFile[i] = fopen(&realFNBuf[0], "r+b");
     }
-    puts("");
-    std::vector<std::valarray<float>> inputBuf(numCh);
-    for(uint32_t i=0; i<numCh; i++)
-        inputBuf[i] = std::valarray<float>(0.0f, fftSize);
-    bool firstIteration = true;
-    printf("Converting... ");
-
+    if(verbose)
+        puts("");
     for(uint32_t i=0; i<numCh; i++)
     {
         ImageFileHeader h = MakeBlankImageFileHeader();
+        SetImageLayout(&h, layout);
         h.convSettingsUsed = settings;
         h.inputWavHeader = audioReader.status.hdr;
+        h.totalSamples = audioReader.status.totalSamples;
         fwrite(&h, sizeof(h), 1, outFile[i]);
     }
+    return true;
+}
 
-    for(uint32_t it=0; ; it++)
+void avb::ForwardConverter::ProcessBatch(FrameBatch* batch)
+{
+    //frames of all channels form one range, idle workers steal from it
+    uint32_t bins = settings.fftSize/2+1;
+    uint32_t hop = settings.fftSize/2;
+    uint32_t numBlocks = batch->numBlocks;
+    uint32_t numCh = batch->samples.size();
+    if(!numBlocks)
     {
-        if(thr[0].outputsLast.size() == 0 && audioReader.status.endOfStream)
-            break;
-        for(uint32_t i=0; i<threads; i++)
-        {
-            thr[i].inputs = thr[i].inputsNext;
-            thr[i].inputsNext.resize(0);
-        }
-        for(uint32_t i=0; i<threads && !firstIteration; i++)
-            thr[i].ProcessAsync();
-        std::vector<FILE*> writeFilePtr(threads);
-        std::vector<void*> writePtr(threads);
-        std::vector<uint32_t> writeSizes(threads);
-        for(uint32_t t=0; t<threads && !firstIteration; t++)
+        doneBatches.Push(batch);
+        return;
+    }
+    pool->ParallelFor(processGroup, 0, numBlocks*numCh, AVB_FFT_BATCH, [this, batch, bins, hop, numBlocks](uint32_t worker, uint32_t first, uint32_t last)
+    {
+        //a range may straddle channels, hand each channel's run over in one go
+        for(uint32_t k=first; k<last;)
         {
-            writeFilePtr[t] = outFile[t/threadsPerCh];
-            writePtr[t] = &thr[t].outputsLast[0];
-            writeSizes[t] = sizeof(Pixel16)*thr[t].outputsLast.size();
+            uint32_t ch = k/numBlocks, j = k%numBlocks;
+            uint32_t count = std::min(last-k, numBlocks-j);
+            thr[worker].ProcessBlocks(&batch->outputs[ch][j*bins], &batch->samples[ch][j*hop], count);
+            for(uint32_t m=j; m<j+count; m++)
+                batch->checksums[ch][m] = RowChecksum(&batch->outputs[ch][m*bins], bins);
+            k += count;
         }
-        uint32_t blocksRead = audioReader.Buffer(fftSize/2, blockCount);
-        std::thread writeThread(WriteHelper, writeFilePtr, writePtr, writeSizes);
-        for(uint32_t i=0; i<numCh; i++)
+        if((batch->framesLeft -= last-first) == 0)
+            doneBatches.Push(batch);
+    });
+}
+
+void avb::ForwardConverter::WriterMain(std::vector<FILE*> outFile, uint32_t totalBlocks, uint32_t stripBlocks)
+{
+    //batches finish out of order, the ring of pending slots puts them back in sequence
+    std::vector<FrameBatch*> pending(batches.size(), nullptr);
+    uint32_t nextSeq = 0;
+    uint32_t bins = settings.fftSize/2+1;
+    //horizontal images get whole bin rows of a strip of frames at a time,
+    //so every row is written in runs of stripBlocks pixels instead of one per frame
+    std::vector<std::vector<Pixel16>> strip;
+    uint32_t stripFirst = 0, stripUsed = 0;
+    if(settings.horizontalTime)
+        strip.assign(outFile.size(), std::vector<Pixel16>((uint64_t)stripBlocks*bins));
+    FrameBatch* batch;
+    uint64_t t = RunStats::Now();
+    while(doneBatches.Pop(batch))
+    {
+        t = StageLap(&stats, AVB_STAGE_WAIT, t);
+        pending[batch->seq % pending.size()] = batch;
+        while((batch = pending[nextSeq % pending.size()]))
         {
-            for(uint32_t j=0; j<blocksRead; j++)
+            stats.AddBytesOut((uint64_t)batch->numBlocks*bins*GetPixelBytes(layout)*outFile.size());
+            stats.AddSamples((uint64_t)batch->numBlocks*(settings.fftSize/2));
+            for(uint32_t i=0; i<outFile.size(); i++)
+                rowChecksums[i].insert(rowChecksums[i].end(), batch->checksums[i].begin(), batch->checksums[i].begin()+batch->numBlocks);
+            //the previews are made from the rows while they're still in cache
+            for(uint32_t i=0; i<pyramids.size(); i++)
+                pyramids[i]->AddRows(&batch->outputs[i][0], batch->numBlocks);
+            if(!settings.horizontalTime)
             {
-                //buffer -> thread inputs
-                std::valarray<float> block = audioReader.GetBufferedBlock(i, j);
-                inputBuf[i] = inputBuf[i].shift(fftSize/2);
-                memcpy(&inputBuf[i][fftSize/2], &block[0], sizeof(float)*fftSize/2);
-                uint32_t blockThread = (j*threadsPerCh) / blockCount;
-                blockThread += i*threadsPerCh;
-                thr[blockThread].inputsNext.push_back(inputBuf[i]);
+                for(uint32_t i=0; i<outFile.size() && batch->numBlocks; i++)
+                {
+                    if(layout == AVB_LAYOUT_RGB16)
+                        WriteInBlocks(outFile[i], &batch->outputs[i][0], sizeof(Pixel16)*batch->numBlocks*bins, 524288);
+                    else
+                        WritePixels(outFile[i], &batch->outputs[i][0], (size_t)batch->numBlocks*bins, layout);
+                }
             }
+            for(uint32_t done=0; settings.horizontalTime && done<batch->numBlocks;)
+            {
+                uint32_t n = std::min(batch->numBlocks-done, stripBlocks-stripUsed);
+                for(uint32_t i=0; i<outFile.size(); i++)
+                    TransposePixels(&batch->outputs[i][(uint64_t)done*bins], bins, &strip[i][stripUsed], stripBlocks, n, bins);
+                done += n;
+                stripUsed += n;
+                if(stripUsed == stripBlocks || stripFirst+stripUsed == totalBlocks)
+                {
+                    for(uint32_t i=0; i<outFile.size(); i++)
+                        WriteColumnStrip(outFile[i], &strip[i][0], stripBlocks, bins, stripFirst, stripUsed, totalBlocks, layout);
+                    stripFirst += stripUsed;
+                    stripUsed = 0;
+                }
+            }
+            pending[nextSeq % pending.size()] = nullptr;
+            freeBatches.Push(batch);
+            nextSeq++;
+        }
+        t = StageLap(&stats, AVB_STAGE_WRITE, t);
+    }
+}
+
+void avb::ForwardConverter::SetReportFile(const char* filename)
+{
+    reportFilename = filename ? filename : "";
+}
+
+bool avb::ForwardConverter::Convert(const char* inputFilename)
+{
+    if(verbose)
+        printf("\nStarting conversion... (input filename: %s)\n", inputFilename);
+    bool wavValid = audioReader.Open(inputFilename);
+    if(!wavValid)
+    {
+        printf("Could not open WAV file %s: %s\n", inputFilename, audioReader.status.errorMessage.c_str());
+        return false;
+    }
+    if(verbose)
+        puts("WAV file ok");
+
+    uint32_t numCh = audioReader.status.hdr.sub1.NumChannels;
+    uint32_t blocksProcessed = 0;
+    uint32_t fftSize = settings.fftSize;
+    uint32_t bins = fftSize/2+1;
+    uint32_t totalBlocks = (audioReader.status.totalSamples+(fftSize/2-1))/(fftSize/2);
+    uint32_t prevProgressMsgLength = 0;
+    if(numCh > 2)
+    {
+        printf("sorry, more than 2 channels not supported (%s)\n", inputFilename);
+        audioReader.Close();
+        return false;
+    }
+    std::vector<FILE*> outFile;
+    if(!CreateOutputFiles(inputFilename, totalBlocks, outFile))
+    {
+        audioReader.Close();
+        return false;
+    }
+    //reader (this thread) -> pool workers -> writer thread.
+    //memory is bounded by the batches in flight, which all come from the free
+    //list with their buffers at full size, so the steady state never allocates
+    uint32_t hop = fftSize/2;
+    uint32_t batchBlocks = std::min(256U, std::max(16U, totalBlocks/(4*numThreads)));
+    //converters sharing the pool keep it busy together, each needs fewer batches
+    uint32_t numBatches = std::max(4U, (2*numThreads+2)/share);
+    batches.resize(numBatches);
+    freeBatches.Init(numBatches);
+    doneBatches.Init(numBatches);
+    for(auto& b : batches)
+    {
+        b = std::unique_ptr<FrameBatch>(new FrameBatch);
+        b->samples.assign(numCh, std::vector<float>((batchBlocks+1)*hop));
+        b->outputs.assign(numCh, std::vector<Pixel16>(batchBlocks*bins));
+        b->checksums.assign(numCh, std::vector<uint32_t>(batchBlocks));
+        freeBatches.Push(b.get());
+    }
+    //about 16 MiB of strip per channel, a whole number of batches wide,
+    //but no wider than the image
+    uint32_t stripBlocks = std::max(1U, (16U<<20)/(bins*(uint32_t)sizeof(Pixel16))/batchBlocks)*batchBlocks;
+    stripBlocks = std::min(stripBlocks, (totalBlocks+batchBlocks-1)/batchBlocks*batchBlocks);
+    stats.Start(audioReader.status.hdr.sub1.SampleRate, audioReader.status.totalSamples, numThreads);
+    rowChecksums.assign(numCh, std::vector<uint32_t>());
+    pyramids.clear();
+    for(uint32_t i=0; pyramidBits && i<numCh; i++)
+    {
+        pyramids.push_back(std::unique_ptr<PreviewPyramid>(new PreviewPyramid));
+        if(!pyramids[i]->Open(RemoveFilenameExtension(outFilenames[i]), bins, totalBlocks, pyramidBits, settings.horizontalTime, 0))
+        {
+            printf("Could not create the preview pyramid of %s\n", outFilenames[i].c_str());
+            pyramids.clear();
+            break;
         }
-        writeThread.join();
-        for(uint32_t i=0; i<thr.size() && !firstIteration; i++)
-            thr[i].WaitForCompletion();
-        for(uint32_t i=0; i<threads && !firstIteration; i++)
+    }
+    std::thread writer(&ForwardConverter::WriterMain, this, outFile, totalBlocks, stripBlocks);
+
+    if(verbose)
+        printf("Converting... ");
+    //the last hop of a batch is the first of the next one, the stream starts with a silent hop
+    std::vector<std::vector<float>> carry(numCh, std::vector<float>(hop, 0.0f));
+    std::vector<float*> readDst(numCh);
+    double lastProgress = 0.0;
+    for(uint32_t seq=0; audioReader.status.samplePos < audioReader.status.totalSamples; seq++)
+    {
+        FrameBatch* batch = nullptr;
+        uint64_t t = RunStats::Now();
+        //nobody closes the free list, every batch comes back to it from the writer
+        if(!freeBatches.Pop(batch))
+            break;
+        t = StageLap(&stats, AVB_STAGE_WAIT, t);
+        uint64_t samplesLeft = audioReader.status.totalSamples - audioReader.status.samplePos;
+        uint32_t blocksRead = std::min<uint64_t>(batchBlocks, (samplesLeft+hop-1)/hop);
+        for(uint32_t i=0; i<numCh; i++)
         {
-            thr[i].outputsLast = thr[i].outputs;
-            thr[i].outputs.resize(0);
+            memcpy(&batch->samples[i][0], &carry[i][0], hop*sizeof(float));
+            readDst[i] = &batch->samples[i][hop];
         }
-        firstIteration = false;
+        uint32_t framesRead = audioReader.ReadFrames(&readDst[0], blocksRead*hop);
+        for(uint32_t i=0; i<numCh; i++)
+            memcpy(&carry[i][0], &batch->samples[i][blocksRead*hop], hop*sizeof(float));
+        stats.AddBytesIn((uint64_t)framesRead*audioReader.status.hdr.sub1.BlockAlign);
+        StageLap(&stats, AVB_STAGE_READ, t);
+        batch->seq = seq;
+        batch->numBlocks = blocksRead;
+        batch->framesLeft = blocksRead*numCh;
+        ProcessBatch(batch);
+
+        blocksProcessed += blocksRead;
+        //redrawn a few times a second, with the realtime factor of the blocks written so far
+        double elapsed = stats.GetElapsed();
+        if(!verbose || (elapsed-lastProgress < 0.25 && blocksProcessed < totalBlocks))
+            continue;
+        lastProgress = elapsed;
         for(uint32_t i=0; i<prevProgressMsgLength; i++)
             printf("\b");
         char pmBuf[80];
-        sprintf(pmBuf, "%d/%d", blocksProcessed, totalBlocks);
+        sprintf(pmBuf, "%d/%d (%.1fx realtime)", blocksProcessed, totalBlocks, stats.GetRealtimeFactor());
         printf("%s", pmBuf);
+        fflush(stdout);
         prevProgressMsgLength = strlen(pmBuf);
-        blocksProcessed += blocksRead;
     }
+    uint64_t t = RunStats::Now();
+    processGroup.Wait();
+    doneBatches.Close();
+    writer.join();
+    StageLap(&stats, AVB_STAGE_WAIT, t);
     for(auto& f : outFile)
         fclose(f);
+    pyramids.clear();
+    //lets the backward pass find the rows that were edited since
+    for(uint32_t i=0; i<numCh; i++)
+    {
+        RowIndex index;
+        index.sourceFilename = inputFilename;
+        index.rowSize = bins;
+        index.checksums.swap(rowChecksums[i]);
+        if(!index.Write(RowIndex::GetFilename(outFilenames[i]).c_str()))
+            printf("Could not write row index for %s\n", outFilenames[i].c_str());
+    }
+    //batches keep their output files to themselves, the input goes too
+    audioReader.Close();
+    if(reportFilename.size() && !stats.WriteJson(reportFilename.c_str(), "forward"))
+        printf("Could not write report: %s\n", reportFilename.c_str());
+    if(!verbose)
+        return true;
     puts("");
-    printf("Conversion completed.\n\n");
+    printf("Conversion completed.\n");
+    stats.PrintSummary();
+    printf("\n");
 
     printf("Open the RAW image(s) in your editor of choice with these settings:\n\n");
-    printf("Header size: %d bytes (for PS, remember to check \"retain while saving\")\n", sizeof(ImageFileHeader));
+    printf("Header size: %d bytes (for PS, remember to check \"retain while saving\")\n", (int)sizeof(ImageFileHeader));
     printf("Byte order: little-endian (IBM PC, Intel)\n");
-    printf("Channels: 3 (interleaved)\n");
-    printf("Depth: R16G16B16 (48bpp)\n");
-    printf("Dimensions: %dx%d\n", fftSize/2+1, totalBlocks);
+    if(layout == AVB_LAYOUT_RG16)
+    {
+        printf("Channels: 2 (interleaved)\n");
+        printf("Depth: R16G16 (32bpp)\n");
+    }
+    else
+    {
+        printf("Channels: 3 (interleaved)\n");
+        printf("Depth: R16G16B16 (48bpp)\n");
+    }
+    if(settings.horizontalTime)
+        printf("Dimensions: %dx%d\n", totalBlocks, bins);
+    else
+        printf("Dimensions: %dx%d\n", bins, totalBlocks);
     return true;
 }
 
 void avb::ForwardConverter::Destroy()
 {
+    //a shared pool belongs to whoever passed it in
+    ownPool.Stop();
+    pool = nullptr;
     numThreads = 0;
     thr = std::vector<ForwardConverterThread>();
+    batches = std::vector<std::unique_ptr<FrameBatch>>();
     audioReader.Close();
 }
 
@@ -368,88 +644,288 @@ std::vector<std::string> avb::FindMatchingFilenamesBC(const char* name)
 
 avb::BackwardConverterThread::BackwardConverterThread()
 {
-    fftwPlanExists = false;
     fftwAudioBuffer = nullptr;
     fftwDFTBuffer = nullptr;
+    stats = nullptr;
+    layout = AVB_LAYOUT_RGB16;
     //Init(MakeDefaultConverterSettings());
 }
-avb::BackwardConverterThread::BackwardConverterThread(avb::ConverterSettings t_settings)
+avb::BackwardConverterThread::BackwardConverterThread(avb::ConverterSettings t_settings, std::shared_ptr<const ConversionContext> t_ctx)
 {
-    fftwPlanExists = false;
     fftwAudioBuffer = nullptr;
     fftwDFTBuffer = nullptr;
-    Init(t_settings);
+    stats = nullptr;
+    layout = AVB_LAYOUT_RGB16;
+    Init(t_settings, t_ctx);
 }
 avb::BackwardConverterThread::~BackwardConverterThread()
 {
     Deinit();
 }
 
-bool avb::BackwardConverterThread::Init(ConverterSettings t_settings)
+bool avb::BackwardConverterThread::Init(ConverterSettings t_settings, std::shared_ptr<const ConversionContext> t_ctx)
 {
     settings = t_settings;
+    ctx = t_ctx;
     uint32_t bins = t_settings.fftSize/2+1;
-    fftwAudioBuffer = (float*)fftwf_malloc(2*bins*sizeof(float));
-    fftwDFTBuffer = (fftwf_complex*)fftwf_malloc(bins*sizeof(fftwf_complex));
-    fftwPlan = fftwf_plan_dft_c2r_1d(settings.fftSize, fftwDFTBuffer, fftwAudioBuffer, FFTW_MEASURE);
-    fftwPlanExists = true;
-    window = MakeWindow(settings.fftSize, settings.windowFunction);
-    inverseSquareWindow = window*window;
-    inverseSquareWindow += inverseSquareWindow.cshift(settings.fftSize/2);
-    inverseSquareWindow = 1.0f / inverseSquareWindow;
-    expander.Init(t_settings.compandingMethod, t_settings.companderParam);
+    fftwAudioBuffer = (float*)fftwf_malloc(AVB_FFT_BATCH*settings.fftSize*sizeof(float));
+    fftwDFTBuffer = (fftwf_complex*)fftwf_malloc(AVB_FFT_BATCH*bins*sizeof(fftwf_complex));
+    if(!fftwAudioBuffer || !fftwDFTBuffer)
+        return false;
+    magn16.resize(bins);
+    magn.resize(bins);
+    if(settings.horizontalTime)
+        columns.resize(AVB_FFT_BATCH*bins);
+    overlap.resize(settings.fftSize/2);
     return true;
 }
 void avb::BackwardConverterThread::Deinit()
 {
-    if(fftwPlanExists)
-    {
-        fftwf_destroy_plan(fftwPlan);
-        fftwPlanExists = false;
-    }
+    ctx.reset();
     fftwf_free(fftwAudioBuffer);
     fftwf_free(fftwDFTBuffer);
+    fftwAudioBuffer = nullptr;
+    fftwDFTBuffer = nullptr;
+}
+void avb::BackwardConverterThread::DecodeRow(fftwf_complex* dft, const Pixel16* line)
+{
+    uint32_t numBins = settings.fftSize/2+1;
+    for(uint32_t i=0; i<numBins; i++)
+        magn16[i] = line[i].g;
+    ctx->compander.Expand(&magn16[0], &magn[0], numBins);
+    if(layout == AVB_LAYOUT_RG16)
+    {
+        spectrum::DecodePolar(line, &magn[0], numBins, dft);
+        return;
+    }
+    for(uint32_t i=0; i<numBins; i++)
+    {
+        dft[i][0] = ((float)line[i].r - 32768.0f) / 32768.0f * magn[i];
+        dft[i][1] = ((float)line[i].b - 32768.0f) / 32768.0f * magn[i];
+    }
 }
-void avb::BackwardConverterThread::ProcessBlock(float* out, RawImgReader16* reader, int32_t centerBlockPos)
+void avb::BackwardConverterThread::SynthesizeRows(float* out, uint32_t stride, RawImgReader16* reader, int32_t firstRow, uint32_t numRows)
 {
+    //every row is transformed once. the first one only fills the overlap,
+    //each later one completes the hop between it and the previous row
+    uint32_t hop = settings.fftSize/2;
     uint32_t numBins = settings.fftSize/2+1;
-    std::valarray<float> bf[3];
-    std::valarray<float> res;
-    for(int i=0; i<3; i++)
-        bf[i] = std::valarray<float>(settings.fftSize);
-    for(int i=0; i<3; i++)
-    {
-        std::vector<Pixel16> line(numBins);
-        std::valarray<uint16_t> magn16(numBins);
-        std::valarray<float> real, imag, magn;
-        real = imag = std::valarray<float>(numBins);
-        reader->GetScanline(&line[0], centerBlockPos+i-1);
-        for(uint32_t i=0; i<numBins; i++)
+    const Pixel16* lines[AVB_FFT_BATCH];
+    for(uint32_t row=0; row<numRows;)
+    {
+        uint32_t num = numRows-row >= AVB_FFT_BATCH ? AVB_FFT_BATCH : 1;
+        //rotated images are read a tile of columns at a time
+        if(settings.horizontalTime)
         {
-            real[i] = (float)line[i].r;
-            imag[i] = (float)line[i].b;
-            magn16[i] = line[i].g;
+            uint64_t stageTime = StageStart(stats);
+            reader->GetColumns(&columns[0], firstRow+row, num, numBins);
+            StageLap(stats, AVB_STAGE_READ, stageTime);
         }
-        real = (real-32768.0f)/32768.0f;
-        imag = (imag-32768.0f)/32768.0f;
-        magn = expander.Expand(magn16);
-        real *= magn;
-        imag *= magn;
-        for(uint32_t i=0; i<numBins; i++)
+        for(uint32_t k=0; k<num; k++)
         {
-            fftwDFTBuffer[i][0] = real[i];
-            fftwDFTBuffer[i][1] = imag[i];
+            Pixel16* buf = columns.size() ? &columns[k*numBins] : nullptr;
+            lines[k] = settings.horizontalTime ? buf : reader->GetScanlinePtr(firstRow+row+k, buf);
+        }
+        out += SynthesizeLines(out, stride, lines, num, row != 0)*hop*stride;
+        row += num;
+    }
+}
+uint32_t avb::BackwardConverterThread::SynthesizeLines(float* out, uint32_t stride, const Pixel16* const* lines, uint32_t num, bool continued)
+{
+    uint32_t fftSize = settings.fftSize;
+    uint32_t hop = fftSize/2;
+    uint32_t numBins = fftSize/2+1;
+    //the forward transform divides by fftSize/2 and the inverse one multiplies
+    //by fftSize, which leaves twice the windowed frame
+    float scale = 0.5f;
+    const float* win = &ctx->window[0];
+    const float* isw = &ctx->inverseSquareWindow[0];
+    if(stats)
+    {
+        stats->AddFrames(num);
+        stats->AddBytesIn((uint64_t)num*numBins*GetPixelBytes(layout));
+    }
+    uint32_t hops = 0;
+    for(uint32_t row=0; row<num;)
+    {
+        //full batches go through the many-plan, the leftovers one by one
+        uint32_t n = num-row >= AVB_FFT_BATCH ? AVB_FFT_BATCH : 1;
+        uint64_t stageTime = StageStart(stats);
+        for(uint32_t k=0; k<n; k++)
+            DecodeRow(fftwDFTBuffer + k*numBins, lines[row+k]);
+        stageTime = StageLap(stats, AVB_STAGE_QUANTIZE, stageTime);
+        ctx->plans.Inverse(fftwDFTBuffer, fftwAudioBuffer, n);
+        for(uint32_t k=0; k<n; k++, row++)
+        {
+            const float* cur = fftwAudioBuffer + k*fftSize;
+            if(row || continued)
+            {
+                for(uint32_t t=0; t<hop; t++)
+                    out[t*stride] = (cur[t]*win[t]*scale + overlap[t]) * isw[t];
+                out += hop*stride;
+                hops++;
+            }
+            for(uint32_t t=0; t<hop; t++)
+                overlap[t] = cur[hop+t]*win[hop+t]*scale;
         }
-        fftwf_execute(fftwPlan);
-        memcpy(&(bf[i][0]), fftwAudioBuffer, sizeof(float)*settings.fftSize);
-        bf[i] *= window;
-        bf[i] *= settings.fftSize*8;
+        StageLap(stats, AVB_STAGE_FFT, stageTime);
     }
-    res = bf[1];
-    res += bf[0].shift(settings.fftSize/2);
-    res += bf[2].shift(-(int)settings.fftSize/2);
-    res *= inverseSquareWindow;
-    memcpy(out, &res[0], sizeof(float)*settings.fftSize);
+    return hops;
+}
+
+void avb::BackwardConverterThread::SetStats(RunStats* t_stats)
+{
+    stats = t_stats;
+}
+void avb::BackwardConverterThread::SetLayout(uint32_t t_layout)
+{
+    layout = t_layout;
+    if(layout == AVB_LAYOUT_RG16)
+        columns.resize(AVB_FFT_BATCH*(settings.fftSize/2+1));
+}
+void avb::BackwardConverterThread::ProcessChunks(float* out, std::vector<RawImgReader16>& readers, uint32_t firstChunk, uint32_t lastChunk)
+{
+    //chunk i is centered on block 2i+1 and covers the hops ending at
+    //blocks 2i+1 and 2i+2, so a range of chunks needs blocks 2*first..2*last
+    uint32_t numCh = readers.size();
+    for(uint32_t ch=0; ch<numCh; ch++)
+        SynthesizeRows(out+ch, numCh, &readers[ch], 2*firstChunk, 2*(lastChunk-firstChunk)+1);
+}
+
+avb::BackwardConverter::BackwardConverter()
+{
+    settings = MakeDefaultConverterSettings();
+    numThreads = 0;
+    numCh = 0;
+    incremental = true;
+    verbose = true;
+    rangeUnit = AVB_RANGE_NONE;
+    rangeFirst = rangeLast = 0.0;
+}
+bool avb::BackwardConverter::Init(ConverterSettings t_settings)
+{
+    settings = t_settings;
+    return true;
+}
+void avb::BackwardConverter::SetReportFile(const char* filename)
+{
+    reportFilename = filename ? filename : "";
+}
+void avb::BackwardConverter::SetIncremental(bool t_incremental)
+{
+    incremental = t_incremental;
+}
+void avb::BackwardConverter::SetRange(uint32_t unit, double first, double last)
+{
+    rangeUnit = unit;
+    rangeFirst = first;
+    rangeLast = last;
+}
+void avb::BackwardConverter::SetOutputFile(const char* filename)
+{
+    outputFilename = filename ? filename : "";
+}
+void avb::BackwardConverter::SetVerbose(bool t_verbose)
+{
+    verbose = t_verbose;
+}
+
+bool avb::BackwardConverter::FindDirtyChunks(const std::vector<std::string>& names, const ImageFileHeader& hdr, uint32_t outBits, WavReader& source, std::vector<std::pair<uint32_t, uint32_t>>& ranges)
+{
+    uint32_t fftSize = hdr.convSettingsUsed.fftSize;
+    uint32_t bins = fftSize/2+1;
+    uint32_t totalBlocks = (hdr.totalSamples+(fftSize/2-1))/(fftSize/2);
+    uint32_t totalChunks = (totalBlocks+1)/2;
+    std::vector<RowIndex> index(numCh);
+    for(uint32_t i=0; i<numCh; i++)
+    {
+        if(!index[i].Read(RowIndex::GetFilename(names[i]).c_str()))
+            return false;
+        if(index[i].rowSize != bins || index[i].checksums.size() != totalBlocks)
+        {
+            if(verbose)
+                printf("Row index doesn't match %s\n", names[i].c_str());
+            return false;
+        }
+    }
+    //unchanged audio is copied from the source, so it has to be the file the
+    //images were made from, stored the way the output will be
+    std::string sourceName = index[0].sourceFilename;
+    if(!FileExists(sourceName.c_str()))
+        sourceName = names[0].substr(0, names[0].find("_ch")) + ".wav";
+    if(!source.Open(sourceName.c_str()))
+    {
+        if(verbose)
+            printf("Source audio %s not found\n", index[0].sourceFilename.c_str());
+        return false;
+    }
+    if(memcmp(&source.status.hdr, &hdr.inputWavHeader, sizeof(wav::Header)) != 0 || source.status.totalSamples != hdr.totalSamples)
+    {
+        if(verbose)
+            printf("%s isn't the audio the images were made from\n", sourceName.c_str());
+        return false;
+    }
+    if(source.status.hdr.sub1.BitsPerSample != outBits)
+    {
+        if(verbose)
+            printf("Source audio is %d-bit, the output %d-bit\n", source.status.hdr.sub1.BitsPerSample, outBits);
+        return false;
+    }
+
+    //only the checksums are computed here, a small fraction of the synthesis
+    std::vector<char> dirtyRow(totalBlocks, 0);
+    TaskGroup group;
+    pool.ParallelFor(group, 0, totalBlocks, AVB_FFT_BATCH, [&](uint32_t, uint32_t first, uint32_t last)
+    {
+        std::vector<Pixel16> columns;
+        if(hdr.convSettingsUsed.horizontalTime || GetImageLayout(hdr) == AVB_LAYOUT_RG16)
+            columns.resize(AVB_FFT_BATCH*bins);
+        for(uint32_t ch=0; ch<numCh; ch++)
+        {
+            for(uint32_t row=first; row<last; row+=AVB_FFT_BATCH)
+            {
+                uint32_t num = std::min<uint32_t>(AVB_FFT_BATCH, last-row);
+                if(hdr.convSettingsUsed.horizontalTime)
+                    imgReader[ch].GetColumns(&columns[0], row, num, bins);
+                for(uint32_t k=0; k<num; k++)
+                {
+                    Pixel16* buf = columns.size() ? &columns[k*bins] : nullptr;
+                    const Pixel16* line = hdr.convSettingsUsed.horizontalTime ? buf : imgReader[ch].GetScanlinePtr(row+k, buf);
+                    if(RowChecksum(line, bins) != index[ch].checksums[row+k])
+                        dirtyRow[row+k] = 1;
+                }
+            }
+        }
+    });
+    group.Wait();
+
+    //chunk c is made from rows 2c..2c+2, an edited row dirties the one or
+    //two chunks it takes part in
+    std::vector<char> dirtyChunk(totalChunks, 0);
+    uint32_t numDirtyRows = 0;
+    for(uint32_t row=0; row<totalBlocks; row++)
+    {
+        if(!dirtyRow[row])
+            continue;
+        numDirtyRows++;
+        for(uint32_t c=(row ? (row-1)/2 : 0); c<=row/2 && c<totalChunks; c++)
+            dirtyChunk[c] = 1;
+    }
+    ranges.clear();
+    uint32_t numDirtyChunks = 0;
+    for(uint32_t c=0; c<totalChunks; c++)
+    {
+        if(!dirtyChunk[c])
+            continue;
+        numDirtyChunks++;
+        if(ranges.size() && ranges.back().second == c)
+            ranges.back().second = c+1;
+        else
+            ranges.push_back(std::make_pair(c, c+1));
+    }
+    if(verbose)
+        printf("%d of %d rows edited, synthesizing %d of %d chunks\n", numDirtyRows, totalBlocks, numDirtyChunks, totalChunks);
+    return true;
 }
 
 bool avb::BackwardConverter::Convert(const char* name)
@@ -457,92 +933,243 @@ bool avb::BackwardConverter::Convert(const char* name)
     std::vector<std::string> names = FindMatchingFilenamesBC(name);
     if(!names.size())
     {
-        printf("File not found\n");
+        fprintf(stderr, "File not found\n");
+        Release();
         return false;
     }
     numCh = names.size();
-    numThreads = std::thread::hardware_concurrency();
-    if(numThreads%2 == 1)
-        numThreads *= 2;
+    pool.Start(std::thread::hardware_concurrency());
+    numThreads = pool.GetWorkerCount();
     thr = std::vector<BackwardConverterThread>(numThreads);
     imgReader = std::vector<RawImgReader16>(numCh);
     std::vector<ImageFileHeader> chHdr(numCh);
     for(uint32_t i=0; i<numCh; i++)
     {
-        //yes i know this is fucking terrible
-        //todo: get rid of this dirty ass hack and fix rawimgreader instead
-        uint32_t ss;
-        ImageFileHeader hTmp;
-        imgReader[i].Open(names[i].c_str(), 420, sizeof(ImageFileHeader), &hTmp);
-        imgReader[i].Close();
-        ss = hTmp.convSettingsUsed.fftSize/2+1;
-        imgReader[i].Open(names[i].c_str(), ss, sizeof(ImageFileHeader), &chHdr[i]);
-        uint32_t depthFactor = (32/chHdr[i].inputWavHeader.sub1.BitsPerSample);
-        chHdr[i].inputWavHeader.sub1.ByteRate *= depthFactor;
-        chHdr[i].inputWavHeader.sub1.BlockAlign *= depthFactor;
-        chHdr[i].inputWavHeader.sub2.Subchunk2Size *= depthFactor;
-        chHdr[i].inputWavHeader.sub1.Subchunk1Size = 16;
-        chHdr[i].inputWavHeader.sub1.BitsPerSample = 32;
+        if(!ReadImageFileHeader(names[i].c_str(), &chHdr[i]))
+        {
+            fprintf(stderr, "Invalid image header: %s\n", names[i].c_str());
+            Release();
+            return false;
+        }
+        //scanlines run along the frequency axis, or along time for horizontal images
+        uint32_t ss = chHdr[i].convSettingsUsed.fftSize/2+1;
+        if(chHdr[i].convSettingsUsed.horizontalTime)
+            ss = (chHdr[i].totalSamples+(ss-2))/(ss-1);
+        if(!imgReader[i].Open(names[i].c_str(), ss, chHdr[i].headerSize, nullptr, GetImageLayout(chHdr[i])))
+        {
+            fprintf(stderr, "Could not open image: %s\n", names[i].c_str());
+            Release();
+            return false;
+        }
+    }
+    std::shared_ptr<const ConversionContext> ctx = ConversionContext::Get(chHdr[0].convSettingsUsed, AVB_FFT_INVERSE);
+    if(!ctx)
+    {
+        fprintf(stderr, "Could not initialize the converter\n");
+        Release();
+        return false;
     }
     for(uint32_t i=0; i<numThreads; i++)
     {
-        thr[i].Init(chHdr[0].convSettingsUsed);
+        if(!thr[i].Init(chHdr[0].convSettingsUsed, ctx))
+        {
+            fprintf(stderr, "Failed to init thread\n");
+            Release();
+            return false;
+        }
+        thr[i].SetStats(&stats);
+        thr[i].SetLayout(GetImageLayout(chHdr[0]));
     }
     for(uint32_t i=0; i<numCh-1; i++)
     {
         if(memcmp(&chHdr[i], &chHdr[i+1], sizeof(ImageFileHeader)) != 0)
         {
-            printf("Header mismatch\n");
+            fprintf(stderr, "Header mismatch\n");
+            Release();
             return false;
         }
     }
     if(names.size() != chHdr[0].inputWavHeader.sub1.NumChannels)
     {
-        printf("Number of channels does not match number of input files\n");
+        fprintf(stderr, "Number of channels does not match number of input files\n");
+        Release();
         return false;
     }
     uint32_t fftSize = chHdr[0].convSettingsUsed.fftSize;
-    uint32_t totalSamples = chHdr[0].inputWavHeader.sub2.Subchunk2Size / chHdr[0].inputWavHeader.sub1.BlockAlign;
+    uint64_t totalSamples = chHdr[0].totalSamples;
     uint32_t totalBlocks = (totalSamples+(fftSize/2-1))/(fftSize/2);
-    uint32_t samplesToWrite = totalSamples;
+    //the part of the audio that gets written
+    uint64_t outFirst = 0, outLast = totalSamples;
+    if(rangeUnit != AVB_RANGE_NONE)
+    {
+        double unit = rangeUnit == AVB_RANGE_ROWS ? fftSize/2 : chHdr[0].inputWavHeader.sub1.SampleRate;
+        outFirst = std::min<double>(totalSamples, std::max(0.0, rangeFirst)*unit + 0.5);
+        outLast = std::min<double>(totalSamples, std::max(0.0, rangeLast)*unit + 0.5);
+        if(outLast <= outFirst)
+        {
+            fprintf(stderr, "The range is empty\n");
+            Release();
+            return false;
+        }
+    }
+    uint64_t samplesToWrite = outLast-outFirst;
 
+    wav::Header wavHdr = chHdr[0].inputWavHeader;
+    uint32_t outBits = GetBackwardOutputBits(chHdr[0], settings);
+    uint32_t sampleBytes = outBits/8;
+    wavHdr.sub1.AudioFormat = outBits == 32 ? 3 : 1;
+    wavHdr.sub1.BitsPerSample = outBits;
+    wavHdr.sub1.BlockAlign = numCh*sampleBytes;
+    wavHdr.sub1.ByteRate = wavHdr.sub1.SampleRate*numCh*sampleBytes;
+    bool dither = settings.ditherOutput && outBits != 32;
+
+    //keep the source container, plain RIFF is promoted to RF64 past 4 GiB
+    uint64_t dataSize = (outLast-outFirst)*numCh*sampleBytes;
+    uint32_t container = wav::GetContainer(wavHdr);
+    if(container == AVB_WAV_CONTAINER_RIFF && dataSize+36 > 0xFFFFFFFFULL)
+        container = AVB_WAV_CONTAINER_RF64;
+    std::vector<uint8_t> outHdr = wav::MakeHeader(wavHdr, dataSize, container);
+
+    //every chunk is centered on an odd block and yields fftSize samples
+    uint32_t totalChunks = (totalBlocks+1)/2;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    WavReader source;
+    bool ranged = rangeUnit != AVB_RANGE_NONE;
     auto underPos = names[0].find("_ch");
-    std::string outFileName = names[0].substr(0, underPos) + "_modified.wav";
-    CreateCustomSizedFile(outFileName.c_str(), totalSamples*numCh*sizeof(float)+sizeof(wav::Header));
-    FILE *outFile = fopen(outFileName.c_str(), "r+b");
-    fwrite(&chHdr[0].inputWavHeader, sizeof(wav::Header), 1, outFile);
-    for(uint32_t i=1; i<=totalBlocks; i+=2)
+    std::string outFileName = outputFilename;
+    if(!outFileName.size())
+        outFileName = names[0].substr(0, underPos) + (ranged ? "_preview.wav" : "_modified.wav");
+    bool toStdout = outFileName == "-";
+    //splicing seeks back over the copied audio, a pipe can't
+    bool spliced = !ranged && !toStdout && incremental && FindDirtyChunks(names, chHdr[0], outBits, source, ranges);
+    if(ranged)
+        ranges.assign(1, std::make_pair((uint32_t)(outFirst/fftSize), std::min<uint32_t>(totalChunks, (outLast+fftSize-1)/fftSize)));
+    else if(!spliced)
+        ranges.assign(1, std::make_pair(0U, totalChunks));
+
+    FILE *outFile = stdout;
+    if(toStdout)
+        SetBinaryMode(stdout);
+    else
     {
-        std::vector<float> audInterleaved(fftSize*numCh);
-        for(uint32_t ch=0; ch<numCh; ch++)
+        CreateCustomSizedFile(outFileName.c_str(), dataSize+outHdr.size());
+        outFile = fopen(outFileName.c_str(), "r+b");
+    }
+    if(!outFile)
+    {
+        fprintf(stderr, "Could not create output file\n");
+        Release();
+        return false;
+    }
+    fwrite(&outHdr[0], outHdr.size(), 1, outFile);
+    if(spliced)
+    {
+        //the untouched audio, the edited chunks are written over it below
+        WriteInBlocks(outFile, (void*)source.GetSampleData(), std::min(dataSize, source.status.dataSize), 524288);
+        source.Close();
+        samplesToWrite = 0;
+    }
+
+    uint32_t chunkCount = std::min(2048U, std::max(32U, totalChunks/8));
+    uint32_t chunkSize = fftSize*numCh;
+    TaskGroup processGroup, writeGroup;
+    stats.Start(chHdr[0].inputWavHeader.sub1.SampleRate, outLast-outFirst, numThreads);
+    //batches are cut from the ranges in order, at most chunkCount chunks each
+    uint32_t range = 0, nextChunk = ranges.size() ? ranges[0].first : 0;
+    uint32_t lastFirstChunk = 0;
+    for(;;)
+    {
+        uint32_t firstChunk = nextChunk, lastChunk = nextChunk;
+        if(range < ranges.size())
         {
-            std::vector<float> aud(fftSize);
-            thr[0].ProcessBlock(&aud[0], &imgReader[ch], i);
-            for(uint32_t j=0; j<fftSize; j++)
+            lastChunk = std::min(ranges[range].second, firstChunk+chunkCount);
+            nextChunk = lastChunk;
+            if(nextChunk == ranges[range].second && ++range < ranges.size())
+                nextChunk = ranges[range].first;
+        }
+        uint32_t batchChunks = lastChunk-firstChunk;
+        if(!batchChunks && !outputBytesLast.size())
+            break;
+        outputs.resize(batchChunks*chunkSize);
+        outputBytes.resize(batchChunks*chunkSize*sampleBytes);
+        pool.ParallelFor(processGroup, firstChunk, lastChunk, 16, [&](uint32_t worker, uint32_t first, uint32_t last)
+        {
+            float* out = &outputs[(first-firstChunk)*chunkSize];
+            thr[worker].ProcessChunks(out, imgReader, first, last);
+            //quantized while the range is still in cache. dither is seeded
+            //per chunk so the output doesn't depend on how ranges were cut
+            uint64_t t = RunStats::Now();
+            for(uint32_t c=first; c<last; c++)
             {
-                audInterleaved[j*numCh+ch] = aud[j];
+                uint32_t offset = (c-firstChunk)*chunkSize;
+                pcm::Quantize(&outputs[offset], outBits, chunkSize, &outputBytes[(uint64_t)offset*sampleBytes], dither ? c+1 : 0);
             }
+            StageLap(&stats, AVB_STAGE_QUANTIZE, t);
+        });
+        for(uint32_t i=0; i<numCh; i++)
+        {
+            if(chHdr[0].convSettingsUsed.horizontalTime)
+                imgReader[i].WillNeedColumns(2*nextChunk, 2*(nextChunk+chunkCount)+1);
+            else
+                imgReader[i].WillNeed(2*nextChunk, 2*(nextChunk+chunkCount)+1);
         }
-        uint32_t writeSize = std::min(samplesToWrite, fftSize);
-        fwrite(&audInterleaved[0], sizeof(float)*numCh, writeSize, outFile);
-        samplesToWrite -= writeSize;
-        if(i%512 == 1)
+
+        //the previous batch is written in chunk order while this one is synthesized
+        //clipped to the part being written, the first and last chunk of a range stick out
+        uint64_t writePos = (uint64_t)lastFirstChunk*fftSize;
+        uint64_t writeFrom = std::max(writePos, outFirst);
+        uint64_t writeEnd = std::min<uint64_t>(outLast, writePos + outputBytesLast.size()/(numCh*sampleBytes));
+        uint32_t samples = writeEnd > writeFrom ? writeEnd-writeFrom : 0;
+        if(samples)
         {
-            printf("%d/%d\n",i,totalBlocks);
+            pool.Submit(writeGroup, [&](uint32_t)
+            {
+                uint64_t t = RunStats::Now();
+                if(spliced)
+                    SeekFile(outFile, outHdr.size() + (writeFrom-outFirst)*numCh*sampleBytes);
+                WriteInBlocks(outFile, &outputBytesLast[(writeFrom-writePos)*numCh*sampleBytes], (uint64_t)samples*numCh*sampleBytes, 524288);
+                stats.AddBytesOut((uint64_t)samples*numCh*sampleBytes);
+                stats.AddSamples(samples);
+                StageLap(&stats, AVB_STAGE_WRITE, t);
+            });
         }
+        samplesToWrite -= std::min<uint64_t>(samplesToWrite, samples);
+        uint64_t t = RunStats::Now();
+        writeGroup.Wait();
+        processGroup.Wait();
+        StageLap(&stats, AVB_STAGE_WAIT, t);
+        outputBytesLast.swap(outputBytes);
+        outputBytes.resize(0);
+        lastFirstChunk = firstChunk;
+        if(batchChunks && verbose)
+            printf("%d/%d (%.1fx realtime)\n", std::min(2*lastChunk, totalBlocks), totalBlocks, stats.GetRealtimeFactor());
     }
-    printf("samplesToWrite=%d\n",samplesToWrite);
+    if(verbose)
+        printf("samplesToWrite=%llu\n", (unsigned long long)samplesToWrite);
     while(samplesToWrite)
     {
-        std::vector<float> nul(262144,0);
-        uint32_t writeSize = std::min(samplesToWrite*numCh*sizeof(float), 262144UL);
+        std::vector<uint8_t> nul(262144,0);
+        uint64_t writeSize = std::min<uint64_t>(samplesToWrite*numCh*sampleBytes, 262144/(numCh*sampleBytes)*(numCh*sampleBytes));
         fwrite(&nul[0],writeSize,1,outFile);
-        samplesToWrite -= writeSize;
+        samplesToWrite -= writeSize/(numCh*sampleBytes);
     }
 
-    for(uint32_t i=0; i<numCh; i++)
-    {
-        imgReader[i].Close();
-    }
+    if(toStdout)
+        fflush(outFile);
+    else
+        fclose(outFile);
+    if(verbose)
+        stats.PrintSummary();
+    if(reportFilename.size() && !stats.WriteJson(reportFilename.c_str(), "backward"))
+        printf("Could not write report: %s\n", reportFilename.c_str());
+    Release();
     return true;
 }
+void avb::BackwardConverter::Release()
+{
+    for(auto& r : imgReader)
+        r.Close();
+    imgReader = std::vector<RawImgReader16>();
+    thr = std::vector<BackwardConverterThread>();
+    pool.Stop();
+}
@@ -5,7 +5,19 @@
 #include "fftw3.h"
 #include "compander.hpp"
 #include "windowing.hpp"
+#include "spectrum.hpp"
 #include "fileio.hpp"
+#include "pcm.hpp"
+#include "threadpool.hpp"
+#include "queue.hpp"
+#include "fftplan.hpp"
+#include "stats.hpp"
+#include "rowindex.hpp"
+#include "pyramid.hpp"
+
+#define AVB_RANGE_NONE 0x00
+#define AVB_RANGE_SECONDS 0x01
+#define AVB_RANGE_ROWS 0x02
 
 namespace avb
 {
@@ -18,6 +30,8 @@ namespace avb
         char horizontalTime;
         char forceOverwrite;
         char outputFloat32Audio;
+        //backward only, never read from an image header
+        char ditherOutput;
     };
     struct ImageFileHeader
     {
@@ -26,89 +40,208 @@ namespace avb
         uint32_t headerSize;
         ConverterSettings convSettingsUsed;
         wav::Header inputWavHeader;
+        //since version 2, inputWavHeader sizes saturate at 4 GiB
+        uint64_t totalSamples;
     };
     ImageFileHeader MakeBlankImageFileHeader();
+    //headerVersion 3 marks the RG16 layout, the ones before are RGB16
+    uint32_t GetImageLayout(const ImageFileHeader& hdr);
+    void SetImageLayout(ImageFileHeader* hdr, uint32_t layout);
+    //accepts every header version, fields missing in older ones are filled in
+    bool ReadImageFileHeader(const char* filename, ImageFileHeader* hdr);
     ConverterSettings MakeDefaultConverterSettings();
+    //the sample format of the way back: float for float sources and float
+    //requests, 24-bit stays 24-bit, everything else (8 and 16) is 16-bit
+    uint32_t GetBackwardOutputBits(const ImageFileHeader& hdr, ConverterSettings settings);
+
+    //everything derived from the settings that stays fixed during a
+    //conversion. workers only read it, and converters with equal settings
+    //share one for as long as any of them holds it
+    class ConversionContext
+    {
+        ConversionContext(const ConversionContext&) = delete;
+        ConversionContext& operator=(const ConversionContext&) = delete;
+    public:
+        uint32_t direction;
+        std::valarray<float> window;
+        //overlap-add normalisation, 1/(w^2 + w^2 shifted by half a frame)
+        std::valarray<float> inverseSquareWindow;
+        Compander16 compander;
+        FFTPlanSet plans;
+
+        ConversionContext();
+        bool Init(ConverterSettings t_settings, uint32_t t_direction);
+
+        static std::shared_ptr<const ConversionContext> Get(ConverterSettings t_settings, uint32_t t_direction);
+    };
 
     class ForwardConverterThread
     {
-        bool fftwPlanExists;
-        fftwf_plan fftwPlan;
+        std::shared_ptr<const ConversionContext> ctx;
         float *fftwAudioBuffer;
         fftwf_complex *fftwDFTBuffer;
-        std::valarray<float> window;
-        std::valarray<float> outTmpReal, outTmpImag, outTmpMagn;
-        std::valarray<uint16_t> outTmpReal16, outTmpImag16, outTmpMagn16;
         ConverterSettings settings;
-        Compander16 compressor;
-        std::thread stlThread;
+        RunStats* stats;
+        uint32_t layout;
     public:
         ForwardConverterThread();
-        ForwardConverterThread(ConverterSettings t_settings);
+        ForwardConverterThread(ConverterSettings t_settings, std::shared_ptr<const ConversionContext> t_ctx);
         ~ForwardConverterThread();
 
-        std::vector<std::valarray<float>> inputs, inputsNext;
-        std::vector<Pixel16> outputs, outputsLast;
-
-        bool Init(ConverterSettings t_settings);
+        bool Init(ConverterSettings t_settings, std::shared_ptr<const ConversionContext> t_ctx);
         void Deinit();
         void Destroy();
-        void ProcessBlock(Pixel16* output, std::valarray<float>& input);
-        void Process();
-        void ProcessAsync();
-        void WaitForCompletion();
+        //stage times and frame counts go here, nullptr (the default) turns them off
+        void SetStats(RunStats* t_stats);
+        //AVB_LAYOUT_RGB16 (the default) or AVB_LAYOUT_RG16
+        void SetLayout(uint32_t t_layout);
+        void QuantizeBlock(Pixel16* output, fftwf_complex* dft);
+        //frames start every fftSize/2 samples, output gets count rows of fftSize/2+1 pixels
+        void ProcessBlocks(Pixel16* output, const float* samples, uint32_t count);
 
     };
 
     class ForwardConverter
     {
+        struct FrameBatch
+        {
+            uint32_t seq;
+            uint32_t numBlocks;
+            std::atomic<uint32_t> framesLeft;
+            //per channel, numBlocks+1 hops of samples. frame j is the
+            //fftSize samples from hop j on, so frames overlap in place
+            std::vector<std::vector<float>> samples;
+            std::vector<std::vector<Pixel16>> outputs;
+            //per channel, the RowChecksum of every output row
+            std::vector<std::vector<uint32_t>> checksums;
+        };
+        ThreadPool ownPool;
+        ThreadPool* pool;
+        std::shared_ptr<const ConversionContext> ctx;
         std::vector<ForwardConverterThread> thr;
         std::vector<ImageFileHeader> chHdr;
+        std::vector<std::string> outFilenames;
+        //per channel, the checksums of the rows written so far
+        std::vector<std::vector<uint32_t>> rowChecksums;
+        std::vector<std::unique_ptr<PreviewPyramid>> pyramids;
+        uint32_t pyramidBits;
+        uint32_t layout;
+        std::vector<std::unique_ptr<FrameBatch>> batches;
+        BoundedQueue<FrameBatch*> freeBatches, doneBatches;
+        TaskGroup processGroup;
         WavReader audioReader;
         ConverterSettings settings;
         //RawImgWriter imgWriter;
+        RunStats stats;
+        std::string reportFilename;
         int numThreads;
+        //converters running on the same pool at once, they split the batches in flight
+        uint32_t share;
+        bool verbose;
         bool isNumber7smooth(uint32_t n);
         std::string RemoveFilenameExtension(std::string s);
+        bool CreateOutputFiles(const char* inputFilename, uint32_t totalBlocks, std::vector<FILE*>& outFile);
+        void ProcessBatch(FrameBatch* batch);
+        void WriterMain(std::vector<FILE*> outFile, uint32_t totalBlocks, uint32_t stripBlocks);
     public:
         ForwardConverter();
         ~ForwardConverter();
 
         bool Init(ConverterSettings t_settings);
+        //runs on a pool shared with other converters instead of starting its
+        //own. t_share is how many of them convert at the same time
+        bool Init(ConverterSettings t_settings, ThreadPool* t_pool, uint32_t t_share);
+        //false keeps everything but errors off the console, set it before Init
+        void SetVerbose(bool t_verbose);
+        //8 or 16 also writes a PreviewPyramid of every image with that many
+        //bits per pixel, 0 (the default) doesn't
+        void SetPyramid(uint32_t bits);
+        //AVB_LAYOUT_RG16 stores magnitude and phase angle only, a third
+        //smaller than AVB_LAYOUT_RGB16 (the default)
+        void SetLayout(uint32_t t_layout);
+        //a JSON report of the stage times is written there after each Convert
+        void SetReportFile(const char* filename);
         bool Convert(const char* inputFilename);
         void Destroy();
     };
 
     class BackwardConverterThread
     {
-        std::thread stlThread;
-        bool fftwPlanExists;
-        fftwf_plan fftwPlan;
+        std::shared_ptr<const ConversionContext> ctx;
         float *fftwAudioBuffer;
         fftwf_complex *fftwDFTBuffer;
         ConverterSettings settings;
-        Compander16 expander;
         ImageFileHeader inputHdr;
+        RunStats* stats;
+        uint32_t layout;
         
-        std::valarray<float> window, inverseSquareWindow;
-        
+        std::vector<uint16_t> magn16;
+        std::vector<float> magn;
+        //windowed second half of the last row, waiting for the next one
+        std::vector<float> overlap;
+        //transposed columns of a horizontal image, or unpacked RG16 rows
+        std::vector<Pixel16> columns;
+
+        void DecodeRow(fftwf_complex* dft, const Pixel16* line);
+        void SynthesizeRows(float* out, uint32_t stride, RawImgReader16* reader, int32_t firstRow, uint32_t numRows);
     public:
-        void ProcessBlock(float* out, RawImgReader16* reader, int32_t centerBlockPos);
         BackwardConverterThread();
-        BackwardConverterThread(ConverterSettings t_settings);
+        BackwardConverterThread(ConverterSettings t_settings, std::shared_ptr<const ConversionContext> t_ctx);
         ~BackwardConverterThread();
 
-        bool Init(ConverterSettings t_settings);
+        bool Init(ConverterSettings t_settings, std::shared_ptr<const ConversionContext> t_ctx);
         void Deinit();
+        void SetStats(RunStats* t_stats);
+        //the layout of the rows coming in, set it after Init
+        void SetLayout(uint32_t t_layout);
+        void ProcessChunks(float* out, std::vector<RawImgReader16>& readers, uint32_t firstChunk, uint32_t lastChunk);
+        //the same for rows already in memory. the first row only fills the
+        //overlap unless it continues the previous call. writes hop samples
+        //(stride apart) per completed hop and returns the number of hops
+        uint32_t SynthesizeLines(float* out, uint32_t stride, const Pixel16* const* lines, uint32_t num, bool continued);
     };
     
     std::vector<std::string> FindMatchingFilenamesBC(const char* name);
     class BackwardConverter
     {
+        ThreadPool pool;
         std::vector<RawImgReader16> imgReader;
         std::vector<BackwardConverterThread> thr;
+        std::vector<float> outputs;
+        std::vector<uint8_t> outputBytes, outputBytesLast;
+        ConverterSettings settings;
+        RunStats stats;
+        std::string reportFilename;
         uint32_t numThreads, numCh;
+        bool incremental;
+        bool verbose;
+        uint32_t rangeUnit;
+        double rangeFirst, rangeLast;
+        std::string outputFilename;
+        //ranges of chunks whose rows differ from the forward pass' row index,
+        //false when the index or the source audio can't be used
+        bool FindDirtyChunks(const std::vector<std::string>& names, const ImageFileHeader& hdr, uint32_t outBits, WavReader& source, std::vector<std::pair<uint32_t, uint32_t>>& ranges);
+        //closes the images and stops the pool, after every Convert
+        void Release();
     public:
+        BackwardConverter();
+        //only the output options (outputFloat32Audio, ditherOutput) are
+        //taken from here, the rest comes from the image headers
+        bool Init(ConverterSettings t_settings);
+        void SetReportFile(const char* filename);
+        //true (the default) splices the chunks around edited rows into a copy
+        //of the source audio when a row index is there, false always
+        //synthesizes the whole image
+        void SetIncremental(bool t_incremental);
+        //only the audio from first up to last is converted, in seconds or in
+        //rows (row r stands for the fftSize/2 samples from r*fftSize/2 on).
+        //just the rows around it are read and synthesized, so the time
+        //doesn't depend on the length of the image. AVB_RANGE_NONE is everything
+        void SetRange(uint32_t unit, double first, double last);
+        //name_modified.wav by default, name_preview.wav for a range. "-" is stdout
+        void SetOutputFile(const char* filename);
+        //false keeps everything but errors off the console
+        void SetVerbose(bool t_verbose);
         bool Convert(const char* name);
     };
 
@@ -0,0 +1,180 @@
+#include "fftplan.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#include <sys/stat.h>
+#endif // _WIN32
+
+namespace
+{
+    //the fftw planner and wisdom are global and not thread safe
+    std::mutex& PlannerMutex()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    bool MakeDir(const std::string& path)
+    {
+#ifdef _WIN32
+        return CreateDirectoryA(path.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+        return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif // _WIN32
+    }
+
+    std::string GetCacheDir()
+    {
+#ifdef _WIN32
+        const char* base = getenv("LOCALAPPDATA");
+        if(!base || !*base)
+            return "";
+        return std::string(base) + "\\avbridge";
+#else
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        if(xdg && *xdg)
+            return std::string(xdg) + "/avbridge";
+        const char* home = getenv("HOME");
+        if(!home || !*home)
+            return "";
+        return std::string(home) + "/.cache/avbridge";
+#endif // _WIN32
+    }
+
+    //~/.cache itself may not exist yet, create every missing level
+    bool MakeCacheDir(const std::string& dir)
+    {
+        for(size_t cut=dir.find_first_of("/\\", 1); cut!=std::string::npos; cut=dir.find_first_of("/\\", cut+1))
+            MakeDir(dir.substr(0, cut));
+        return MakeDir(dir);
+    }
+
+    int GetPid()
+    {
+#ifdef _WIN32
+        return _getpid();
+#else
+        return getpid();
+#endif // _WIN32
+    }
+}
+
+std::string avb::GetWisdomFilename(uint32_t fftSize, uint32_t direction)
+{
+    std::string dir = GetCacheDir();
+    if(dir.empty())
+        return "";
+    const char* dirName = direction == AVB_FFT_INVERSE ? "c2r" : "r2c";
+#ifdef _WIN32
+    char sep = '\\';
+#else
+    char sep = '/';
+#endif // _WIN32
+    return dir + sep + "fftwf_" + std::to_string(fftSize) + "_" + dirName + ".wisdom";
+}
+
+avb::FFTPlanSet::FFTPlanSet()
+{
+    single = batch = nullptr;
+    fftSize = 0;
+    direction = AVB_FFT_FORWARD;
+}
+avb::FFTPlanSet::~FFTPlanSet()
+{
+    Deinit();
+}
+
+bool avb::FFTPlanSet::Init(uint32_t t_fftSize, uint32_t t_direction)
+{
+    Deinit();
+    fftSize = t_fftSize;
+    direction = t_direction;
+    int n = fftSize;
+    uint32_t bins = fftSize/2+1;
+
+    std::lock_guard<std::mutex> lock(PlannerMutex());
+    std::string wisdom = GetWisdomFilename(fftSize, direction);
+    bool haveWisdom = !wisdom.empty() && fftwf_import_wisdom_from_filename(wisdom.c_str());
+
+    //planning may scribble over the buffers, so use scratch ones
+    float* real = (float*)fftwf_malloc(AVB_FFT_BATCH*fftSize*sizeof(float));
+    fftwf_complex* cplx = (fftwf_complex*)fftwf_malloc(AVB_FFT_BATCH*bins*sizeof(fftwf_complex));
+    if(!real || !cplx)
+    {
+        fftwf_free(real);
+        fftwf_free(cplx);
+        return false;
+    }
+    bool measured = false;
+    for(int pass=haveWisdom?0:1; pass<2 && (!single || !batch); pass++)
+    {
+        //first try to get by on wisdom alone, measure what is missing
+        unsigned flags = pass ? FFTW_MEASURE : FFTW_MEASURE|FFTW_WISDOM_ONLY;
+        measured = pass == 1;
+        if(direction == AVB_FFT_INVERSE)
+        {
+            if(!single)
+                single = fftwf_plan_dft_c2r_1d(n, cplx, real, flags);
+            if(!batch)
+                batch = fftwf_plan_many_dft_c2r(1, &n, AVB_FFT_BATCH, cplx, nullptr, 1, bins,
+                                                real, nullptr, 1, fftSize, flags);
+        }
+        else
+        {
+            if(!single)
+                single = fftwf_plan_dft_r2c_1d(n, real, cplx, flags);
+            if(!batch)
+                batch = fftwf_plan_many_dft_r2c(1, &n, AVB_FFT_BATCH, real, nullptr, 1, fftSize,
+                                                cplx, nullptr, 1, bins, flags);
+        }
+    }
+    fftwf_free(real);
+    fftwf_free(cplx);
+    if(!single || !batch)
+    {
+        printf("Could not create FFT plans for size %d\n", fftSize);
+        return false;
+    }
+
+    //written to a temporary first so concurrent runs never see half a file
+    if(measured && !wisdom.empty() && MakeCacheDir(GetCacheDir()))
+    {
+        std::string tmp = wisdom + "." + std::to_string(GetPid());
+        if(fftwf_export_wisdom_to_filename(tmp.c_str()))
+        {
+#ifdef _WIN32
+            remove(wisdom.c_str());
+#endif // _WIN32
+            if(rename(tmp.c_str(), wisdom.c_str()) != 0)
+                remove(tmp.c_str());
+        }
+    }
+    return true;
+}
+void avb::FFTPlanSet::Deinit()
+{
+    if(!single && !batch)
+        return;
+    std::lock_guard<std::mutex> lock(PlannerMutex());
+    if(single)
+        fftwf_destroy_plan(single);
+    if(batch)
+        fftwf_destroy_plan(batch);
+    single = batch = nullptr;
+}
+uint32_t avb::FFTPlanSet::GetSize() const
+{
+    return fftSize;
+}
+
+void avb::FFTPlanSet::Forward(float* in, fftwf_complex* out, uint32_t count) const
+{
+    fftwf_execute_dft_r2c(count == AVB_FFT_BATCH ? batch : single, in, out);
+}
+void avb::FFTPlanSet::Inverse(fftwf_complex* in, float* out, uint32_t count) const
+{
+    fftwf_execute_dft_c2r(count == AVB_FFT_BATCH ? batch : single, in, out);
+}
@@ -0,0 +1,44 @@
+#ifndef AVB_FFTPLAN_H
+#define AVB_FFTPLAN_H
+
+#include "incl/c_cpp.hpp"
+#include "fftw3.h"
+
+//frames transformed by one fftw call
+#define AVB_FFT_BATCH 16
+
+#define AVB_FFT_FORWARD 0x00
+#define AVB_FFT_INVERSE 0x01
+
+namespace avb
+{
+    //single frame and AVB_FFT_BATCH frame plans for one size and direction.
+    //they are made once and shared, workers run them on their own
+    //fftwf_malloc'd buffers through the new-array execute functions
+    class FFTPlanSet
+    {
+        fftwf_plan single, batch;
+        uint32_t fftSize, direction;
+
+        FFTPlanSet(const FFTPlanSet&) = delete;
+        FFTPlanSet& operator=(const FFTPlanSet&) = delete;
+    public:
+        FFTPlanSet();
+        ~FFTPlanSet();
+
+        //uses and updates the wisdom cache, safe to call from any thread
+        bool Init(uint32_t t_fftSize, uint32_t t_direction);
+        void Deinit();
+        uint32_t GetSize() const;
+
+        //frames are back to back, count is 1 or AVB_FFT_BATCH
+        void Forward(float* in, fftwf_complex* out, uint32_t count) const;
+        void Inverse(fftwf_complex* in, float* out, uint32_t count) const;
+    };
+
+    //$XDG_CACHE_HOME/avbridge (~/.cache/avbridge, %LOCALAPPDATA%\avbridge on
+    //windows), one file per size and direction. empty if there is no home
+    std::string GetWisdomFilename(uint32_t fftSize, uint32_t direction);
+}
+
+#endif // AVB_FFTPLAN_H
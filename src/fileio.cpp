@@ -1,13 +1,26 @@
 #include "fileio.hpp"
+#include "pcm.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif // _WIN32
 
 avb::WavReader::WavReader()
 {
+    sampleData = nullptr;
     status.Clear();
 }
 avb::WavReader::~WavReader()
 {
-    status.Clear();
-    inputFile.close();
+    Close();
 }
 
 void avb::WavReader::Status::Clear()
@@ -17,36 +30,171 @@ void avb::WavReader::Status::Clear()
     endOfStream = false;
     samplePos = 0;
     totalSamples = 0;
+    dataSize = 0;
     errorMessage = std::string();
 }
 
+namespace
+{
+    const uint32_t idRIFF = 0x46464952;
+    const uint32_t idRF64 = 0x34364652;
+    const uint32_t idBW64 = 0x34365742;
+    const uint32_t idWAVE = 0x45564157;
+    const uint32_t idDs64 = 0x34367364;
+    const uint32_t idFmt  = 0x20746D66;
+    const uint32_t idData = 0x61746164;
+    const uint32_t idRiffW64 = 0x66666972; //"riff"
+
+    //Wave64 chunk GUIDs, only the first 4 bytes differ between them
+    const uint8_t guidRiff[16] = {0x72,0x69,0x66,0x66,0x2E,0x91,0xCF,0x11,0xA5,0xD6,0x28,0xDB,0x04,0xC1,0x00,0x00};
+    const uint8_t guidWave[16] = {0x77,0x61,0x76,0x65,0xF3,0xAC,0xD3,0x11,0x8C,0xD1,0x00,0xC0,0x4F,0x8E,0xDB,0x8A};
+    const uint8_t guidFmt[16]  = {0x66,0x6D,0x74,0x20,0xF3,0xAC,0xD3,0x11,0x8C,0xD1,0x00,0xC0,0x4F,0x8E,0xDB,0x8A};
+    const uint8_t guidData[16] = {0x64,0x61,0x74,0x61,0xF3,0xAC,0xD3,0x11,0x8C,0xD1,0x00,0xC0,0x4F,0x8E,0xDB,0x8A};
+
+    template<typename T>
+    T ReadLE(const uint8_t* p)
+    {
+        T r;
+        memcpy(&r, p, sizeof(T));
+        return r;
+    }
+    uint32_t Saturate32(uint64_t v)
+    {
+        return v > 0xFFFFFFFFULL ? 0xFFFFFFFFU : (uint32_t)v;
+    }
+}
+
+bool avb::WavReader::ParseRiff()
+{
+    const uint8_t* p = inputFile.Data();
+    uint64_t filesize = inputFile.Size();
+    uint64_t pos = 12;
+    uint64_t ds64DataSize = 0;
+    bool hasFmt = false;
+    memcpy(&status.hdr.riff, p, sizeof(wav::HdrRiff));
+    while(pos+8 <= filesize)
+    {
+        uint32_t id = ReadLE<uint32_t>(p+pos);
+        uint64_t size = ReadLE<uint32_t>(p+pos+4);
+        pos += 8;
+        if(id == idDs64 && size >= 24 && pos+24 <= filesize)
+        {
+            ds64DataSize = ReadLE<uint64_t>(p+pos+8);
+        }
+        else if(id == idFmt && size >= 16 && pos+16 <= filesize)
+        {
+            memcpy(&status.hdr.sub1, p+pos-8, sizeof(wav::HdrSub1));
+            hasFmt = true;
+        }
+        else if(id == idData)
+        {
+            //RF64 keeps the real size in ds64 and writes 0xFFFFFFFF here
+            if(size == 0xFFFFFFFF && ds64DataSize)
+                size = ds64DataSize;
+            status.hdr.sub2.Subchunk2ID = id;
+            status.hdr.sub2.Subchunk2Size = Saturate32(size);
+            status.dataSize = size;
+            if(filesize < pos+size)
+            {
+                status.errorMessage = "File smaller than header suggests";
+                return false;
+            }
+            sampleData = p+pos;
+            break;
+        }
+        pos += size + (size&1);
+    }
+    if(!hasFmt || !sampleData)
+    {
+        status.errorMessage = "Magic number invalid";
+        return false;
+    }
+    return true;
+}
+
+bool avb::WavReader::ParseW64()
+{
+    const uint8_t* p = inputFile.Data();
+    uint64_t filesize = inputFile.Size();
+    if(filesize < 40 || memcmp(p+24, guidWave, 16) != 0)
+    {
+        status.errorMessage = "Magic number invalid";
+        return false;
+    }
+    status.hdr.riff.ChunkID = idRiffW64;
+    status.hdr.riff.ChunkSize = Saturate32(ReadLE<uint64_t>(p+16));
+    status.hdr.riff.Format = idWAVE;
+    uint64_t pos = 40;
+    bool hasFmt = false;
+    while(pos+24 <= filesize)
+    {
+        //sizes include the 24-byte chunk header, chunks are 8-byte aligned
+        const uint8_t* guid = p+pos;
+        uint64_t size = ReadLE<uint64_t>(p+pos+16);
+        if(size < 24)
+            break;
+        if(memcmp(guid, guidFmt, 16) == 0 && size >= 40 && pos+40 <= filesize)
+        {
+            memcpy(&status.hdr.sub1.AudioFormat, p+pos+24, 16);
+            status.hdr.sub1.Subchunk1ID = idFmt;
+            status.hdr.sub1.Subchunk1Size = 16;
+            hasFmt = true;
+        }
+        else if(memcmp(guid, guidData, 16) == 0)
+        {
+            uint64_t dataSize = size-24;
+            status.hdr.sub2.Subchunk2ID = idData;
+            status.hdr.sub2.Subchunk2Size = Saturate32(dataSize);
+            status.dataSize = dataSize;
+            if(filesize < pos+size)
+            {
+                status.errorMessage = "File smaller than header suggests";
+                return false;
+            }
+            sampleData = p+pos+24;
+            break;
+        }
+        pos += (size+7) & ~7ULL;
+    }
+    if(!hasFmt || !sampleData)
+    {
+        status.errorMessage = "Magic number invalid";
+        return false;
+    }
+    return true;
+}
+
 bool avb::WavReader::Open(const char* filename)
 {
-    status.Clear();
-    inputFile = std::ifstream(filename, std::ios::binary);
-    if(!inputFile.good())
+    Close();
+    if(!inputFile.Open(filename))
     {
         status.errorMessage = "File not found / corrupted";
         return false;
     }
-    inputFile.seekg(0, inputFile.end);
-    uint32_t filesize = inputFile.tellg();
-    inputFile.seekg(0, inputFile.beg);
-    if(filesize < 45)
+    if(inputFile.Size() < 45)
     {
         status.errorMessage = "File too small to be a valid wav file";
         return false;
     }
-    inputFile.read((char*)&status.hdr.riff, sizeof(wav::HdrRiff));
-    inputFile.read((char*)&status.hdr.sub1, sizeof(wav::HdrSub1));
-    if(status.hdr.sub1.Subchunk1Size > 16)
-        inputFile.seekg(status.hdr.sub1.Subchunk1Size-16, inputFile.cur);
-    inputFile.read((char*)&status.hdr.sub2, sizeof(wav::HdrSub2));
-    if(filesize < (uint32_t)inputFile.tellg()+status.hdr.sub2.Subchunk2Size)
+    const uint8_t* p = inputFile.Data();
+    uint32_t chunkID = ReadLE<uint32_t>(p);
+    bool parsed;
+    if(memcmp(p, guidRiff, 16) == 0)
     {
-        status.errorMessage = "File smaller than header suggests";
+        parsed = ParseW64();
+    }
+    else if((chunkID == idRIFF || chunkID == idRF64 || chunkID == idBW64) && ReadLE<uint32_t>(p+8) == idWAVE)
+    {
+        parsed = ParseRiff();
+    }
+    else
+    {
+        status.errorMessage = "Magic number invalid";
         return false;
     }
+    if(!parsed)
+        return false;
 
     if(!(status.hdr.sub1.BitsPerSample == 8
     || status.hdr.sub1.BitsPerSample == 16
@@ -62,143 +210,45 @@ bool avb::WavReader::Open(const char* filename)
     {
         status.errorMessage = "Only mono and stereo files supported";
     }
-
-    if(status.hdr.riff.ChunkID     != 0x46464952 //RIFF
-    || status.hdr.riff.Format      != 0x45564157 //WAVE
-    || status.hdr.sub1.Subchunk1ID != 0x20746D66 //fmt
-    || status.hdr.sub2.Subchunk2ID != 0x61746164) //data
+    if(status.hdr.sub1.BlockAlign == 0)
     {
-        status.errorMessage = "Magic number invalid";
+        status.errorMessage = "Invalid block alignment";
         return false;
     }
 
     status.valid = true;
-    status.totalSamples = status.hdr.sub2.Subchunk2Size / status.hdr.sub1.BlockAlign;
+    status.totalSamples = status.dataSize / status.hdr.sub1.BlockAlign;
     return true;
 }
 
-std::vector<std::valarray<uint8_t>> avb::WavReader::ReadBlock8(uint32_t len)
-{
-    uint32_t numCh = status.hdr.sub1.NumChannels;
-    std::vector<uint8_t> readBuf(len*numCh, 0);
-    std::vector<std::valarray<uint8_t>> r(numCh);
-
-    uint32_t lenRead = std::min(len, status.totalSamples-status.samplePos);
-    inputFile.read((char*)&readBuf[0], lenRead*numCh*sizeof(uint8_t));
-    for(uint32_t i=0; i<numCh; i++)
-    {
-        r[i] = std::valarray<uint8_t>(len);
-        for(uint32_t j=0; j<len; j++)
-        {
-            r[i][j] = readBuf[j*numCh+i];
-        }
-    }
-    status.samplePos += lenRead;
-    return r;
-}
-std::vector<std::valarray<int16_t>> avb::WavReader::ReadBlock16(uint32_t len)
-{
-    uint32_t numCh = status.hdr.sub1.NumChannels;
-    std::vector<int16_t> readBuf(len*numCh, 0);
-    std::vector<std::valarray<int16_t>> r(numCh);
-
-    uint32_t lenRead = std::min(len, status.totalSamples-status.samplePos);
-    inputFile.read((char*)&readBuf[0], lenRead*numCh*sizeof(int16_t));
-    for(uint32_t i=0; i<numCh; i++)
-    {
-        r[i] = std::valarray<int16_t>(len);
-        for(uint32_t j=0; j<len; j++)
-        {
-            r[i][j] = readBuf[j*numCh+i];
-        }
-    }
-    status.samplePos += lenRead;
-    return r;
-}
-std::vector<std::valarray<int32_t>> avb::WavReader::ReadBlock24(uint32_t len)
-{
-    uint32_t numCh = status.hdr.sub1.NumChannels;
-    std::vector<uint8_t> readBuf(len*numCh*3 + 4, 0);
-    std::vector<std::valarray<int32_t>> r(numCh);
-
-    uint32_t lenRead = std::min(len, status.totalSamples-status.samplePos);
-    inputFile.read((char*)&readBuf[0], lenRead*numCh*3);
-    for(uint32_t i=0; i<numCh; i++)
-    {
-        r[i] = std::valarray<int32_t>(len);
-        for(uint32_t j=0; j<len; j++)
-        {
-            int32_t smpReal;
-            uint32_t smp = *reinterpret_cast<uint32_t*>(&readBuf[3*(j*numCh+i)]);
-            smp &= 0x00FFFFFF;
-            smpReal = smp;
-            if(smp & 0x00800000)
-            {
-                smp = ~smp;
-                smp &= 0x00FFFFFF;
-                smp += 1;
-                smpReal = -smp;
-            }
-            r[i][j] = smpReal;
-        }
-    }
-    status.samplePos += lenRead;
-    return r;
-}
-std::vector<std::valarray<float>> avb::WavReader::ReadBlock32f(uint32_t len)
+uint32_t avb::WavReader::ReadFrames(float** dst, uint32_t len)
 {
+    if(!status.valid)
+        return 0;
     uint32_t numCh = status.hdr.sub1.NumChannels;
-    std::vector<float> readBuf(len*numCh, 0);
-    std::vector<std::valarray<float>> r(numCh);
-
-    uint32_t lenRead = std::min(len, status.totalSamples-status.samplePos);
-    inputFile.read((char*)&readBuf[0], lenRead*numCh*sizeof(float));
+    uint32_t lenRead = std::min<uint64_t>(len, status.totalSamples-status.samplePos);
+    const uint8_t* src = sampleData + status.samplePos*status.hdr.sub1.BlockAlign;
+    pcm::Deinterleave(src, status.hdr.sub1.BitsPerSample, numCh, lenRead, dst);
     for(uint32_t i=0; i<numCh; i++)
-    {
-        r[i] = std::valarray<float>(len);
-        for(uint32_t j=0; j<len; j++)
-        {
-            r[i][j] = readBuf[j*numCh+i];
-        }
-    }
+        memset(dst[i]+lenRead, 0, sizeof(float)*(len-lenRead));
     status.samplePos += lenRead;
-    return r;
+    if(status.samplePos >= status.totalSamples)
+        status.endOfStream = true;
+    return lenRead;
 }
 
 std::vector<std::valarray<float>> avb::WavReader::ReadBlock(uint32_t len)
 {
     uint32_t numCh = status.hdr.sub1.NumChannels;
     std::vector<std::valarray<float>> r(numCh);
+    std::vector<float*> dst(numCh);
     for(uint32_t i=0; i<numCh; i++)
-        r[i] = std::valarray<float>(len);
-    if(status.hdr.sub1.BitsPerSample == 8)
-    {
-        std::vector<std::valarray<uint8_t>> b = ReadBlock8(len);
-        for(uint32_t i=0; i<numCh; i++)
-            for(uint32_t j=0; j<len; j++)
-                r[i][j] = ((float)b[i][j] - 128.0f) / 128.0f;
-        return r;
-    }
-    else if(status.hdr.sub1.BitsPerSample == 16)
     {
-        std::vector<std::valarray<int16_t>> b = ReadBlock16(len);
-        for(uint32_t i=0; i<numCh; i++)
-            for(uint32_t j=0; j<len; j++)
-                r[i][j] = (float)b[i][j] / 32768.0f;
-        return r;
-    }
-    else if(status.hdr.sub1.BitsPerSample == 24)
-    {
-        std::vector<std::valarray<int32_t>> b = ReadBlock24(len);
-        for(uint32_t i=0; i<numCh; i++)
-            for(uint32_t j=0; j<len; j++)
-                r[i][j] = (float)b[i][j] / 8388608.0f;
-        return r;
-    }
-    else if(status.hdr.sub1.BitsPerSample == 32)
-    {
-        return ReadBlock32f(len);
+        r[i] = std::valarray<float>(len);
+        dst[i] = &r[i][0];
     }
+    if(numCh)
+        ReadFrames(&dst[0], len);
     return r;
 }
 
@@ -208,24 +258,28 @@ uint32_t avb::WavReader::Buffer(uint32_t blockSize, uint32_t blockCount)
         return 0;
     uint32_t numCh = status.hdr.sub1.NumChannels;
     buffer.resize(numCh);
-    for(uint32_t i=0; i<numCh; i++)
+    std::vector<float*> dst(numCh);
+    uint32_t blocksRead = 0;
+    for(; blocksRead<blockCount && status.samplePos < status.totalSamples; blocksRead++)
     {
-        buffer[i] = std::vector<std::valarray<float>>();
-        buffer[i].reserve(blockCount);
-    }
-    for(uint32_t i=0; i<blockCount && status.samplePos < status.totalSamples; i++)
-    {
-        std::vector<std::valarray<float>> block = ReadBlock(blockSize);
+        //blocks are kept between calls, steady state reuses their storage
         for(uint32_t j=0; j<numCh; j++)
         {
-            buffer[j].push_back(block[j]);
+            if(buffer[j].size() <= blocksRead)
+                buffer[j].push_back(std::valarray<float>(blockSize));
+            if(buffer[j][blocksRead].size() != blockSize)
+                buffer[j][blocksRead].resize(blockSize);
+            dst[j] = &buffer[j][blocksRead][0];
         }
+        ReadFrames(&dst[0], blockSize);
     }
+    for(uint32_t j=0; j<numCh; j++)
+        buffer[j].resize(blocksRead);
     if(status.samplePos >= status.totalSamples)
     {
         status.endOfStream = true;
     }
-    return buffer[0].size();
+    return blocksRead;
 }
 
 std::vector<std::valarray<float>> avb::WavReader::GetBuffer(uint16_t channel)
@@ -238,140 +292,349 @@ std::valarray<float> avb::WavReader::GetBufferedBlock(uint16_t channel, uint32_t
     return buffer[channel][block];
 }
 
+const uint8_t* avb::WavReader::GetSampleData()
+{
+    return sampleData;
+}
 void avb::WavReader::Close()
 {
-    inputFile.close();
+    inputFile.Close();
+    sampleData = nullptr;
+    buffer = std::vector<std::vector<std::valarray<float>>>();
     status.Clear();
 }
 
-avb::RawImgReader16::RawImgReader16()
+avb::MappedFile::MappedFile()
 {
+    data = nullptr;
+    size = 0;
+#ifdef _WIN32
+    hFile = INVALID_HANDLE_VALUE;
+    hMapping = NULL;
+#else
+    fd = -1;
+#endif
 }
-avb::RawImgReader16::~RawImgReader16()
+avb::MappedFile::~MappedFile()
 {
+    Close();
 }
 
-uint32_t avb::RawImgReader16::GetImageHeight()
+bool avb::MappedFile::Open(const char* filename)
 {
-    return imageHeight;
+    Close();
+#ifdef _WIN32
+    hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER sz;
+    if(!GetFileSizeEx(hFile, &sz) || sz.QuadPart == 0)
+    {
+        Close();
+        return false;
+    }
+    size = sz.QuadPart;
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(hMapping)
+        data = (const uint8_t*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        Close();
+        return false;
+    }
+    size = st.st_size;
+    void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p != MAP_FAILED)
+        data = (const uint8_t*)p;
+#endif
+    if(!data)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void avb::MappedFile::Close()
+{
+#ifdef _WIN32
+    if(data)
+        UnmapViewOfFile(data);
+    if(hMapping)
+        CloseHandle(hMapping);
+    if(hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
+    hFile = INVALID_HANDLE_VALUE;
+    hMapping = NULL;
+#else
+    if(data)
+        munmap((void*)data, size);
+    if(fd >= 0)
+        close(fd);
+    fd = -1;
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+const uint8_t* avb::MappedFile::Data()
+{
+    return data;
+}
+uint64_t avb::MappedFile::Size()
+{
+    return size;
+}
+
+void avb::MappedFile::AdviseSequential()
+{
+#ifndef _WIN32
+    if(data)
+        madvise((void*)data, size, MADV_SEQUENTIAL);
+#endif
 }
-void avb::RawImgReader16::CopyBufferLine(uint32_t dst, uint32_t src)
+void avb::MappedFile::AdviseWillNeed(uint64_t offset, uint64_t len)
 {
-    if(dst==src)
+#ifndef _WIN32
+    if(!data || offset >= size)
         return;
-    memcpy(&buffer[scanlineSize*dst], &buffer[scanlineSize*src], scanlineSize*sizeof(Pixel16));
+    //madvise wants a page aligned start
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset%pageSize;
+    len = std::min(len + (offset-start), size-start);
+    madvise((void*)(data+start), len, MADV_WILLNEED);
+#endif
+}
+
+uint32_t avb::GetPixelBytes(uint32_t layout)
+{
+    return layout == AVB_LAYOUT_RG16 ? 2*sizeof(uint16_t) : sizeof(Pixel16);
 }
-void avb::RawImgReader16::ShiftBuffer(int32_t numLines)
+void avb::PackPixels(const Pixel16* src, uint8_t* dst, size_t n, uint32_t layout)
 {
-    if(numLines > 0)
+    if(layout != AVB_LAYOUT_RG16)
     {
-        for(int32_t i=0; i<(int32_t)bufferLines-numLines; i++)
-            CopyBufferLine(i, i+numLines);
-        for(int32_t i=(int32_t)bufferLines-numLines; i<(int32_t)bufferLines; i++)
-            memset(&buffer[scanlineSize*i], 0, scanlineSize*sizeof(Pixel16));
+        memcpy(dst, src, n*sizeof(Pixel16));
+        return;
     }
-    if(numLines < 0)
+    //r and g lead the struct, so each pixel is its first 4 bytes
+    for(size_t i=0; i<n; i++)
+        memcpy(dst+4*i, &src[i], 4);
+}
+void avb::UnpackPixels(const uint8_t* src, Pixel16* dst, size_t n, uint32_t layout)
+{
+    if(layout != AVB_LAYOUT_RG16)
     {
-        for(int32_t i=bufferLines-1; i>=-numLines; i--)
-            CopyBufferLine(i, i+numLines);
-        for(int32_t i=0; i<-numLines; i++)
-            memset(&buffer[scanlineSize*i], 0, scanlineSize*sizeof(Pixel16));
+        memcpy(dst, src, n*sizeof(Pixel16));
+        return;
+    }
+    for(size_t i=0; i<n; i++)
+    {
+        memcpy(&dst[i], src+4*i, 4);
+        dst[i].b = 0;
     }
 }
-
-void avb::RawImgReader16::SetBufferPos(uint32_t startLine)
+bool avb::WritePixels(FILE* f, const Pixel16* src, size_t n, uint32_t layout)
 {
-    std::pair<int32_t,int32_t> oldPos(bufferPos, bufferPos+bufferLines);
-    std::pair<int32_t,int32_t> newPos(startLine, startLine+bufferLines);
-    int32_t maxReadLines = imageHeight-newPos.first;
-    newPos.second = std::min(newPos.second, (int32_t)imageHeight);
-    bufferPos = startLine;
-
-    if(newPos.first < oldPos.first && newPos.second > oldPos.first)
+    if(layout != AVB_LAYOUT_RG16)
+        return fwrite(src, sizeof(Pixel16), n, f) == n;
+    uint8_t buf[4096*4];
+    for(size_t done=0; done<n;)
     {
-        uint32_t linesToRead = std::min(maxReadLines, oldPos.first-newPos.first);
-        ShiftBuffer(newPos.first-oldPos.first);
-        inputFile.seekg(headerSize+scanlineSize*newPos.first*sizeof(Pixel16), inputFile.beg);
-        inputFile.read((char*)&buffer[0], linesToRead*sizeof(Pixel16)*scanlineSize);
-        return;
+        size_t len = std::min<size_t>(4096, n-done);
+        PackPixels(src+done, buf, len, layout);
+        if(fwrite(buf, 4, len, f) != len)
+            return false;
+        done += len;
     }
-    else if(oldPos.first < newPos.first && oldPos.second > newPos.first)
+    return true;
+}
+bool avb::ReadPixels(FILE* f, Pixel16* dst, size_t n, uint32_t layout)
+{
+    if(layout != AVB_LAYOUT_RG16)
+        return fread(dst, sizeof(Pixel16), n, f) == n;
+    uint8_t buf[4096*4];
+    for(size_t done=0; done<n;)
     {
-        uint32_t linesToRead = std::min(maxReadLines, newPos.first-oldPos.first);
-        ShiftBuffer(newPos.first-oldPos.first);
-        inputFile.seekg(headerSize+scanlineSize*oldPos.second*sizeof(Pixel16), inputFile.beg);
-        inputFile.read((char*)&buffer[scanlineSize*(oldPos.second-newPos.first)], linesToRead*sizeof(Pixel16)*scanlineSize);
-        return;
+        size_t len = std::min<size_t>(4096, n-done);
+        if(fread(buf, 4, len, f) != len)
+            return false;
+        UnpackPixels(buf, dst+done, len, layout);
+        done += len;
     }
-    else
+    return true;
+}
+
+namespace
+{
+    //TransposePixels reading RG16 pixels, in the same tiles
+    void TransposePacked(const uint8_t* src, uint32_t srcStride, avb::Pixel16* dst, uint32_t dstStride, uint32_t rows, uint32_t cols)
     {
-        uint32_t linesToRead = std::min(maxReadLines, (int32_t)bufferLines);
-        memset(&buffer[0], 0, buffer.size()*sizeof(Pixel16));
-        inputFile.seekg(headerSize+scanlineSize*newPos.first*sizeof(Pixel16), inputFile.beg);
-        inputFile.read((char*)&buffer[0], sizeof(Pixel16)*scanlineSize*linesToRead);
+        const uint32_t tile = 16;
+        for(uint32_t r0=0; r0<rows; r0+=tile)
+        {
+            uint32_t r1 = std::min(rows, r0+tile);
+            for(uint32_t c0=0; c0<cols; c0+=tile)
+            {
+                uint32_t c1 = std::min(cols, c0+tile);
+                for(uint32_t r=r0; r<r1; r++)
+                {
+                    const uint8_t* s = src + (uint64_t)r*srcStride*4;
+                    for(uint32_t c=c0; c<c1; c++)
+                    {
+                        avb::Pixel16& d = dst[(uint64_t)c*dstStride+r];
+                        memcpy(&d, s+4*c, 4);
+                        d.b = 0;
+                    }
+                }
+            }
+        }
     }
 }
 
-void avb::RawImgReader16::UpdateBufferPos(uint32_t line)
+avb::RawImgReader16::RawImgReader16()
+{
+    pixels = nullptr;
+    scanlineSize = 0;
+    headerSize = 0;
+    imageHeight = 0;
+    layout = AVB_LAYOUT_RGB16;
+    pixelBytes = sizeof(Pixel16);
+}
+avb::RawImgReader16::~RawImgReader16()
 {
-    uint32_t newPos = line-(line%(bufferLines/2));
-    if(newPos >= bufferLines/4)
-        newPos -= bufferLines/4;
-    if(bufferPos != newPos)
-        SetBufferPos(newPos);
-    return;
 }
 
-bool avb::RawImgReader16::Open(const char* filename, uint32_t scanlineSize, uint32_t headerSize, void* headerPtr)
+uint32_t avb::RawImgReader16::GetImageHeight()
+{
+    return imageHeight;
+}
+
+bool avb::RawImgReader16::Open(const char* filename, uint32_t scanlineSize, uint32_t headerSize, void* headerPtr, uint32_t t_layout)
 {
     Close();
-    uint32_t sz = FileSize(filename);
-    inputFile.open(filename, std::ios::binary);
-    if(!inputFile.good())
-        return false;
-    if(!headerPtr)
-        inputFile.seekg(headerSize, inputFile.beg);
-    else
-        inputFile.read((char*)headerPtr, headerSize);
-    if(inputFile.eof())
+    file = std::unique_ptr<MappedFile>(new MappedFile);
+    if(!file->Open(filename) || file->Size() < headerSize)
+    {
+        Close();
         return false;
-    bufferLines = 256;
+    }
+    if(headerPtr)
+        memcpy(headerPtr, file->Data(), headerSize);
     this->scanlineSize = scanlineSize;
     this->headerSize = headerSize;
-    imageHeight = ((sz-headerSize)/sizeof(Pixel16))/scanlineSize;
-    buffer = std::vector<Pixel16>(scanlineSize*bufferLines);
-    memset(&buffer[0], 0, sizeof(Pixel16)*buffer.size());
-    bufferPos = 0;
-    SetBufferPos(0);
+    layout = t_layout;
+    pixelBytes = GetPixelBytes(layout);
+    imageHeight = ((file->Size()-headerSize)/pixelBytes)/scanlineSize;
+    pixels = file->Data()+headerSize;
+    blankLine = std::vector<Pixel16>(scanlineSize);
+    memset(&blankLine[0], 0, sizeof(Pixel16)*scanlineSize);
+    file->AdviseSequential();
     return true;
 }
 
 void avb::RawImgReader16::Close()
 {
-    inputFile.close();
-    buffer = std::vector<Pixel16>();
-    bufferLines = 0;
-    bufferPos = 0;
+    file = nullptr;
+    pixels = nullptr;
+    blankLine = std::vector<Pixel16>();
     scanlineSize = 0;
     headerSize = 0;
+    imageHeight = 0;
+}
+
+const avb::Pixel16* avb::RawImgReader16::GetScanlinePtr(int32_t y, Pixel16* buf)
+{
+    if(y < 0 || y >= (int32_t)imageHeight)
+        return &blankLine[0];
+    const uint8_t* line = pixels + (uint64_t)scanlineSize*y*pixelBytes;
+    if(layout == AVB_LAYOUT_RGB16)
+        return (const Pixel16*)line;
+    UnpackPixels(line, buf, scanlineSize, layout);
+    return buf;
 }
 
 void avb::RawImgReader16::GetScanline(Pixel16* out, int32_t y)
 {
-    memset(out, 0, sizeof(Pixel16)*scanlineSize);
-    if(y < 0 || y > (int32_t)imageHeight)
+    const Pixel16* line = GetScanlinePtr(y, out);
+    if(line != out)
+        memcpy(out, line, sizeof(Pixel16)*scanlineSize);
+}
+
+void avb::RawImgReader16::WillNeed(int32_t firstLine, int32_t lastLine)
+{
+    firstLine = std::max(firstLine, 0);
+    lastLine = std::min(lastLine, (int32_t)imageHeight);
+    if(!file || firstLine >= lastLine)
         return;
-    UpdateBufferPos(y);
-    memcpy(out, &buffer[scanlineSize*(y-bufferPos)], sizeof(Pixel16)*scanlineSize);
+    uint64_t lineBytes = (uint64_t)scanlineSize*pixelBytes;
+    file->AdviseWillNeed(headerSize + lineBytes*firstLine, lineBytes*(lastLine-firstLine));
 }
 
-uint32_t avb::FileSize(const char* filename)
+void avb::RawImgReader16::GetColumns(Pixel16* out, int32_t firstColumn, uint32_t numColumns, uint32_t columnSize)
+{
+    int32_t first = std::max(firstColumn, 0);
+    int32_t last = std::min(firstColumn+(int32_t)numColumns, (int32_t)scanlineSize);
+    uint32_t rows = std::min(columnSize, imageHeight);
+    if(first >= last || !rows)
+    {
+        memset(out, 0, sizeof(Pixel16)*numColumns*columnSize);
+        return;
+    }
+    uint32_t lead = first-firstColumn, cols = last-first;
+    memset(out, 0, sizeof(Pixel16)*lead*columnSize);
+    if(layout == AVB_LAYOUT_RGB16)
+        TransposePixels((const Pixel16*)pixels+first, scanlineSize, out+(uint64_t)lead*columnSize, columnSize, rows, cols);
+    else
+        TransposePacked(pixels+(uint64_t)first*pixelBytes, scanlineSize, out+(uint64_t)lead*columnSize, columnSize, rows, cols);
+    for(uint32_t c=lead; c<lead+cols && rows<columnSize; c++)
+        memset(out+(uint64_t)c*columnSize+rows, 0, sizeof(Pixel16)*(columnSize-rows));
+    memset(out+(uint64_t)(lead+cols)*columnSize, 0, sizeof(Pixel16)*(numColumns-lead-cols)*columnSize);
+}
+void avb::RawImgReader16::WillNeedColumns(int32_t firstColumn, int32_t lastColumn)
+{
+    //one short run per scanline
+    firstColumn = std::max(firstColumn, 0);
+    lastColumn = std::min(lastColumn, (int32_t)scanlineSize);
+    if(!file || firstColumn >= lastColumn)
+        return;
+    uint64_t lineBytes = (uint64_t)scanlineSize*pixelBytes;
+    for(uint32_t y=0; y<imageHeight; y++)
+        file->AdviseWillNeed(headerSize + lineBytes*y + pixelBytes*firstColumn, pixelBytes*(lastColumn-firstColumn));
+}
+
+void avb::TransposePixels(const Pixel16* src, uint32_t srcStride, Pixel16* dst, uint32_t dstStride, uint32_t rows, uint32_t cols)
+{
+    //16x16 tiles are 1.5 KiB on each side, both stay in L1
+    const uint32_t tile = 16;
+    for(uint32_t r0=0; r0<rows; r0+=tile)
+    {
+        uint32_t r1 = std::min(rows, r0+tile);
+        for(uint32_t c0=0; c0<cols; c0+=tile)
+        {
+            uint32_t c1 = std::min(cols, c0+tile);
+            for(uint32_t r=r0; r<r1; r++)
+            {
+                const Pixel16* s = src + (uint64_t)r*srcStride;
+                for(uint32_t c=c0; c<c1; c++)
+                    dst[(uint64_t)c*dstStride+r] = s[c];
+            }
+        }
+    }
+}
+
+uint64_t avb::FileSize(const char* filename)
 {
     std::ifstream f(filename, std::ios::binary);
     if(!f.good())
         return 0;
     f.seekg(0, f.end);
-    return f.tellg();
+    return (uint64_t)f.tellg();
 }
 bool avb::FileExists(const char* filename)
 {
@@ -379,25 +642,72 @@ bool avb::FileExists(const char* filename)
     return f.good();
 }
 
+bool avb::SeekFile(FILE* f, uint64_t pos)
+{
 #ifdef _WIN32
-#include <windows.h>
-#elif defined(__linux__)
-#include <fcntl.h>
-#endif // __linux__
-
-bool avb::CreateCustomSizedFile(const char* filename, uint32_t sz)
+    return _fseeki64(f, (__int64)pos, SEEK_SET) == 0;
+#else
+    return fseeko(f, (off_t)pos, SEEK_SET) == 0;
+#endif
+}
+void avb::SetBinaryMode(FILE* f)
+{
+#ifdef _WIN32
+    _setmode(_fileno(f), _O_BINARY);
+#else
+    (void)f;
+#endif
+}
+bool avb::IsDirectory(const char* path)
+{
+#ifdef _WIN32
+    DWORD attr = GetFileAttributesA(path);
+    return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+std::vector<std::string> avb::ListDirectory(const char* path)
+{
+    std::vector<std::string> r;
+#ifdef _WIN32
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA((std::string(path) + "\\*").c_str(), &fd);
+    if(h == INVALID_HANDLE_VALUE)
+        return r;
+    do
+    {
+        if(strcmp(fd.cFileName, ".") && strcmp(fd.cFileName, ".."))
+            r.push_back(fd.cFileName);
+    } while(FindNextFileA(h, &fd));
+    FindClose(h);
+#else
+    DIR* d = opendir(path);
+    if(!d)
+        return r;
+    while(struct dirent* e = readdir(d))
+    {
+        if(strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+            r.push_back(e->d_name);
+    }
+    closedir(d);
+#endif
+    return r;
+}
+bool avb::CreateCustomSizedFile(const char* filename, uint64_t sz)
 {
 #ifdef _WIN32
     return CreateCustomSizedFileWindows(filename, sz);
 #elif defined(__linux__)
     return CreateCustomSizedFileLinux(filename, sz);
 #else
-    uint32_t bufsize=1024576, saved=0, left=sz;
+    uint64_t bufsize=1024576, saved=0, left=sz;
     std::vector<char> buf(bufsize,0);
     std::ofstream file(filename, std::ios::binary);
     while(left)
     {
-        uint32_t n = std::min(bufsize, left);
+        uint64_t n = std::min(bufsize, left);
         if(!file.write(&buf[0], n))
             return false;
         saved += n;
@@ -407,7 +717,7 @@ bool avb::CreateCustomSizedFile(const char* filename, uint32_t sz)
 #endif
 }
 
-bool avb::CreateCustomSizedFileWindows(const char* filename, uint32_t sz)
+bool avb::CreateCustomSizedFileWindows(const char* filename, uint64_t sz)
 {
 #ifdef _WIN32
     if(FileExists(filename))
@@ -431,13 +741,132 @@ bool avb::CreateCustomSizedFileWindows(const char* filename, uint32_t sz)
     return false;
 }
 
-bool avb::CreateCustomSizedFileLinux(const char* filename, uint32_t sz) //NOT TESTED
+bool avb::CreateCustomSizedFileLinux(const char* filename, uint64_t sz) //NOT TESTED
 {
 #ifdef __linux__
     FILE* f = fopen(filename, "wb");
-    int r = fallocate(fileno(f), 0, 0, sz);
+    if(!f)
+        return false;
+    int r = fallocate(fileno(f), 0, 0, (off_t)sz);
     fclose(f);
     return r==0;
 #endif // __linux__
     return false;
 }
+
+uint32_t avb::wav::GetContainer(const Header& h)
+{
+    if(h.riff.ChunkID == idRF64 || h.riff.ChunkID == idBW64)
+        return AVB_WAV_CONTAINER_RF64;
+    if(h.riff.ChunkID == idRiffW64)
+        return AVB_WAV_CONTAINER_W64;
+    return AVB_WAV_CONTAINER_RIFF;
+}
+
+avb::wav::Header avb::wav::MakeFormat(uint32_t sampleRate, uint32_t numCh, uint32_t bitsPerSample)
+{
+    Header h;
+    memset(&h, 0, sizeof(h));
+    h.riff.ChunkID = idRIFF;
+    h.riff.Format = idWAVE;
+    h.sub1.Subchunk1ID = idFmt;
+    h.sub1.Subchunk1Size = 16;
+    h.sub1.AudioFormat = bitsPerSample == 32 ? 3 : 1;
+    h.sub1.NumChannels = numCh;
+    h.sub1.SampleRate = sampleRate;
+    h.sub1.BlockAlign = numCh*bitsPerSample/8;
+    h.sub1.ByteRate = sampleRate*h.sub1.BlockAlign;
+    h.sub1.BitsPerSample = bitsPerSample;
+    h.sub2.Subchunk2ID = idData;
+    return h;
+}
+bool avb::wav::ReadStreamHeader(FILE* f, Header* h)
+{
+    uint8_t buf[12];
+    if(fread(buf, 1, 12, f) != 12)
+        return false;
+    uint32_t chunkID = ReadLE<uint32_t>(buf);
+    if((chunkID != idRIFF && chunkID != idRF64 && chunkID != idBW64) || ReadLE<uint32_t>(buf+8) != idWAVE)
+        return false;
+    memset(h, 0, sizeof(Header));
+    memcpy(&h->riff, buf, sizeof(HdrRiff));
+    bool hasFmt = false;
+    for(;;)
+    {
+        if(fread(buf, 1, 8, f) != 8)
+            return false;
+        uint32_t id = ReadLE<uint32_t>(buf);
+        uint32_t size = ReadLE<uint32_t>(buf+4);
+        if(id == idData)
+        {
+            h->sub2.Subchunk2ID = id;
+            h->sub2.Subchunk2Size = size;
+            break;
+        }
+        //no seeking in a pipe, whatever isn't needed is read and dropped
+        std::vector<uint8_t> payload(size + (size&1));
+        if(payload.size() && fread(&payload[0], 1, payload.size(), f) != payload.size())
+            return false;
+        if(id == idFmt && size >= 16)
+        {
+            h->sub1.Subchunk1ID = id;
+            h->sub1.Subchunk1Size = size;
+            memcpy(&h->sub1.AudioFormat, &payload[0], 16);
+            hasFmt = true;
+        }
+    }
+    if(!hasFmt || !h->sub1.BlockAlign || h->sub1.NumChannels < 1 || h->sub1.NumChannels > 2)
+        return false;
+    uint32_t bits = h->sub1.BitsPerSample;
+    return bits == 8 || bits == 16 || bits == 24 || bits == 32;
+}
+std::vector<uint8_t> avb::wav::MakeHeader(const Header& h, uint64_t dataSize, uint32_t container)
+{
+    std::vector<uint8_t> r;
+    auto put = [&r](const void* p, uint32_t n)
+    {
+        r.insert(r.end(), (const uint8_t*)p, (const uint8_t*)p+n);
+    };
+    auto put32 = [&put](uint32_t v){ put(&v, 4); };
+    auto put64 = [&put](uint64_t v){ put(&v, 8); };
+    HdrSub1 fmt = h.sub1;
+    fmt.Subchunk1ID = idFmt;
+    fmt.Subchunk1Size = 16;
+    if(container == AVB_WAV_CONTAINER_W64)
+    {
+        //riff + wave guid (40) + fmt guid/size/payload (40) + data guid/size (24)
+        put(guidRiff, 16);
+        put64(104+dataSize);
+        put(guidWave, 16);
+        put(guidFmt, 16);
+        put64(40);
+        put(&fmt.AudioFormat, 16);
+        put(guidData, 16);
+        put64(24+dataSize);
+        return r;
+    }
+    if(container == AVB_WAV_CONTAINER_RF64)
+    {
+        uint32_t blockAlign = std::max<uint32_t>(1, fmt.BlockAlign);
+        put32(idRF64);
+        put32(0xFFFFFFFF);
+        put32(idWAVE);
+        put32(idDs64);
+        put32(28);
+        put64(72+dataSize);
+        put64(dataSize);
+        put64(dataSize/blockAlign);
+        put32(0);
+        put(&fmt, sizeof(fmt));
+        put32(idData);
+        put32(0xFFFFFFFF);
+        return r;
+    }
+    put32(idRIFF);
+    put32(Saturate32(36+dataSize));
+    put32(idWAVE);
+    put(&fmt, sizeof(fmt));
+    put32(idData);
+    put32(Saturate32(dataSize));
+    return r;
+}
@@ -3,12 +3,28 @@
 
 #include "incl/c_cpp.hpp"
 
+#define AVB_WAV_CONTAINER_RIFF 0x00
+#define AVB_WAV_CONTAINER_RF64 0x01
+#define AVB_WAV_CONTAINER_W64 0x02
+
+//how image files store their pixels. RGB16 is Pixel16 as it is, RG16 keeps
+//only r and g, the phase angle and the magnitude (4 bytes instead of 6)
+#define AVB_LAYOUT_RGB16 0x00
+#define AVB_LAYOUT_RG16 0x01
+
 namespace avb
 {
     struct Pixel16
     {
         uint16_t r,g,b;
     };
+    //bytes per pixel in a file of that layout
+    uint32_t GetPixelBytes(uint32_t layout);
+    //n pixels from memory to a file's layout and back. b comes back as 0 from RG16
+    void PackPixels(const Pixel16* src, uint8_t* dst, size_t n, uint32_t layout);
+    void UnpackPixels(const uint8_t* src, Pixel16* dst, size_t n, uint32_t layout);
+    bool WritePixels(FILE* f, const Pixel16* src, size_t n, uint32_t layout);
+    bool ReadPixels(FILE* f, Pixel16* dst, size_t n, uint32_t layout);
     namespace wav
     {
         struct HdrRiff
@@ -39,16 +55,48 @@ namespace avb
             HdrSub1 sub1;
             HdrSub2 sub2;
         };
+
+        //Header keeps the canonical 44-byte layout for every container.
+        //riff.ChunkID tells the container apart ("RIFF", "RF64", "riff" for
+        //Wave64) and sizes that don't fit into 32 bits are saturated
+        uint32_t GetContainer(const Header& h);
+        //serializes h for the given container with a 64-bit data size
+        std::vector<uint8_t> MakeHeader(const Header& h, uint64_t dataSize, uint32_t container);
+        //a RIFF header with everything filled in but the sizes, 32 bits is float
+        Header MakeFormat(uint32_t sampleRate, uint32_t numCh, uint32_t bitsPerSample);
+        //reads a RIFF/RF64 header from a pipe, up to the first sample. the
+        //sizes are ignored, live streams leave them at 0 or 0xFFFFFFFF
+        bool ReadStreamHeader(FILE* f, Header* h);
     }
+    //read-only view of a whole file
+    class MappedFile
+    {
+        const uint8_t* data;
+        uint64_t size;
+#ifdef _WIN32
+        void* hFile;
+        void* hMapping;
+#else
+        int fd;
+#endif
+    public:
+        MappedFile();
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool Open(const char* filename);
+        void Close();
+        const uint8_t* Data();
+        uint64_t Size();
+        void AdviseSequential();
+        void AdviseWillNeed(uint64_t offset, uint64_t len);
+    };
     class WavReader
     {
-        std::ifstream inputFile;
+        MappedFile inputFile;
+        const uint8_t* sampleData;
         std::vector<std::vector<std::valarray<float>>> buffer;
-
-        std::vector<std::valarray<uint8_t>> ReadBlock8(uint32_t len);
-        std::vector<std::valarray<int16_t>> ReadBlock16(uint32_t len);
-        std::vector<std::valarray<int32_t>> ReadBlock24(uint32_t len);
-        std::vector<std::valarray<float>> ReadBlock32f(uint32_t len);
         
         struct Status
         {
@@ -56,14 +104,22 @@ namespace avb
             wav::Header hdr;
             bool valid;
             bool endOfStream;
-            uint32_t samplePos;
-            uint32_t totalSamples;
+            uint64_t samplePos;
+            uint64_t totalSamples;
+            uint64_t dataSize;
             std::string errorMessage;
         };
+        bool ParseRiff();
+        bool ParseW64();
     public:
         Status status;
         WavReader();
         ~WavReader();
+        //decodes up to len frames straight from the mapping into dst[channel],
+        //zero-pads the rest and returns the number of frames actually read
+        uint32_t ReadFrames(float** dst, uint32_t len);
+        //the data chunk as stored, status.dataSize bytes of interleaved frames
+        const uint8_t* GetSampleData();
         std::vector<std::valarray<float>> ReadBlock(uint32_t len);
 
         bool Open(const char* filename);
@@ -72,34 +128,52 @@ namespace avb
         std::valarray<float> GetBufferedBlock(uint16_t channel, uint32_t block);
         void Close();
     };
+    //RGB16 scanlines are returned as pointers straight into the mapping,
+    //RG16 ones are unpacked into the caller's buffer. the reader has no
+    //mutable state after Open so threads can share it
     class RawImgReader16
     {
-        std::ifstream inputFile;
-        std::vector<Pixel16> buffer;
-        uint32_t bufferLines;
-        uint32_t bufferPos;
+        std::unique_ptr<MappedFile> file;
+        const uint8_t* pixels;
+        std::vector<Pixel16> blankLine;
         uint32_t scanlineSize;
         uint32_t headerSize;
         uint32_t imageHeight;
-        void CopyBufferLine(uint32_t dst, uint32_t src);
-        void ShiftBuffer(int32_t numLines);
-        void SetBufferPos(uint32_t startLine);
-        void UpdateBufferPos(uint32_t line);
+        uint32_t layout;
+        uint32_t pixelBytes;
     public:
         RawImgReader16();
         ~RawImgReader16();
         uint32_t GetImageHeight();
-        bool Open(const char* filename, uint32_t scanlineSize, uint32_t headerSize, void* headerPtr);
+        bool Open(const char* filename, uint32_t scanlineSize, uint32_t headerSize, void* headerPtr, uint32_t t_layout);
         void Close();
+        //buf (scanlineSize pixels) is only written to when the layout is packed
+        const Pixel16* GetScanlinePtr(int32_t y, Pixel16* buf);
         void GetScanline(Pixel16* out, int32_t y);
+        void WillNeed(int32_t firstLine, int32_t lastLine);
+        //for images stored with time running along the scanlines. copies
+        //numColumns columns into out, each one columnSize pixels long.
+        //columns outside the image come out blank
+        void GetColumns(Pixel16* out, int32_t firstColumn, uint32_t numColumns, uint32_t columnSize);
+        void WillNeedColumns(int32_t firstColumn, int32_t lastColumn);
     };
+
+    //dst[c*dstStride+r] = src[r*srcStride+c], done in small square tiles so
+    //neither side walks a whole stride per pixel
+    void TransposePixels(const Pixel16* src, uint32_t srcStride, Pixel16* dst, uint32_t dstStride, uint32_t rows, uint32_t cols);
     
-    uint32_t FileSize(const char* filename);
+    uint64_t FileSize(const char* filename);
     bool FileExists(const char* filename);
+    bool SeekFile(FILE* f, uint64_t pos);
+    //no newline translation, for binary data on stdin/stdout
+    void SetBinaryMode(FILE* f);
+    bool IsDirectory(const char* path);
+    //names of the files and subdirectories in path, without . and ..
+    std::vector<std::string> ListDirectory(const char* path);
     
-    bool CreateCustomSizedFile(const char* filename, uint32_t sz);
-    bool CreateCustomSizedFileWindows(const char* filename, uint32_t sz);
-    bool CreateCustomSizedFileLinux(const char* filename, uint32_t sz);
+    bool CreateCustomSizedFile(const char* filename, uint64_t sz);
+    bool CreateCustomSizedFileWindows(const char* filename, uint64_t sz);
+    bool CreateCustomSizedFileLinux(const char* filename, uint64_t sz);
 }
 
 #endif // AVB_FILEIO_H
@@ -25,5 +25,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <cmath>
 #include <cstdint>
 #include <cstring>
+#include <cerrno>
 
 #endif // INCL_C
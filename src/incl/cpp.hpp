@@ -28,8 +28,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <unordered_set>
 #include <algorithm>
 #include <valarray>
+#include <array>
 //#include <random>
 #include <thread>
+#include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <limits>
 
 #endif // INCL_CPP
@@ -1,77 +1,297 @@
 #include "incl/c_cpp.hpp"
-#include "converter.hpp"
-#include "fileio.hpp"
+#include "avbridge.hpp"
+#include "argparser.hpp"
 
-std::valarray<float> sinewave(uint32_t len, float freq, float phase, float amplitude)
+void PrintUsage(const char* name)
 {
-    std::valarray<float> r(len);
-    for(uint32_t i=0; i<len; i++)
+    printf("usage: %s [options] input.wav\n", name);
+    printf("       %s -b [options] image_name\n", name);
+    printf("       %s --batch [options] (file.wav | directory | list.txt)...\n", name);
+    printf("       %s --stream [options] [input.wav | -] > image_stream\n", name);
+    printf("       %s -b --stream [options] [image_stream | -] > output.wav\n\n", name);
+    printf("  --fft N            frame size (default 2048)\n");
+    printf("  --compander NAME   sqrt, mulaw or uvlaw (default uvlaw)\n");
+    printf("  --window NAME      rectangular, triangular, hann, hamming, blackman\n");
+    printf("                     or blackmanharris (default blackmanharris)\n");
+    printf("  --horizontal       time runs along the x axis\n");
+    printf("  --layout NAME      rgb16 (real, magnitude, imaginary) or rg16 (phase\n");
+    printf("                     angle, magnitude), a third smaller (default rgb16)\n");
+    printf("  --float            -b writes 32-bit float samples\n");
+    printf("  --dither           -b adds TPDF dither before rounding\n");
+    printf("  --full             -b synthesizes every row, even with a row index from\n");
+    printf("                     the forward pass (by default only edited rows are)\n");
+    printf("  --from T, --to T   -b converts only this part, T in seconds or [hh:]mm:ss\n");
+    printf("  --rows A:B         -b converts only rows A up to B\n");
+    printf("  --out FILE         -b output, - for stdout (default name_modified.wav,\n");
+    printf("                     or name_preview.wav for a part)\n");
+    printf("  --report FILE      JSON report of the stage times\n");
+    printf("  --pyramid BITS     also write 8 or 16-bit magnitude previews at 1/2, 1/4...\n");
+    printf("                     of the size (name_chN_mip1.pgm, _mip2.pgm...)\n");
+    printf("  --stream           live conversion from a pipe to stdout, a row per hop\n");
+    printf("  --pcm RATE:CH:BITS --stream input is headerless PCM (BITS 32 is float)\n");
+    printf("  --raw              -b --stream writes headerless PCM\n");
+    printf("  --jobs N           --batch converts N files at once (default: from the core count)\n");
+    printf("  --max-open N       --batch keeps at most N output files open (default %d)\n", AVB_BATCH_DEFAULT_MAX_OPEN_FILES);
+}
+
+//seconds, mm:ss or hh:mm:ss, each part may have a fraction
+bool ParseTime(const std::string& s, double* out)
+{
+    double r = 0.0;
+    size_t pos = 0;
+    for(int parts=0; parts<3; parts++)
     {
-        double x = i;
-        r[i] = amplitude*std::sin(2.0*3.141592653589793*freq*x-phase);
+        char* end = nullptr;
+        double v = strtod(s.c_str()+pos, &end);
+        if(end == s.c_str()+pos || v < 0.0)
+            return false;
+        r = r*60.0 + v;
+        pos = end-s.c_str();
+        if(pos == s.size())
+        {
+            *out = r;
+            return true;
+        }
+        if(s[pos] != ':')
+            return false;
+        pos++;
     }
-    return r;
+    return false;
 }
 
-void print_valarray(std::valarray<float> v)
+bool ReadRange(avb::ArgParser& args, avb::BackwardConverter* cnvB)
 {
-    for(auto& i : v)
-        printf("%f\t",i);
+    if(args.IsSet("--rows"))
+    {
+        std::string rows = args.Get("--rows", "");
+        unsigned long first, last;
+        char end;
+        if(sscanf(rows.c_str(), "%lu:%lu%c", &first, &last, &end) != 2 || last <= first)
+        {
+            printf("--rows takes first:last, e.g. 1000:1200\n");
+            return false;
+        }
+        cnvB->SetRange(AVB_RANGE_ROWS, first, last);
+        return true;
+    }
+    if(!args.IsSet("--from") && !args.IsSet("--to"))
+        return true;
+    double first = 0.0, last = std::numeric_limits<double>::max();
+    if((args.IsSet("--from") && !ParseTime(args.Get("--from", ""), &first)) || (args.IsSet("--to") && !ParseTime(args.Get("--to", ""), &last)))
+    {
+        printf("--from and --to take seconds or [hh:]mm:ss, e.g. 47:12.5\n");
+        return false;
+    }
+    cnvB->SetRange(AVB_RANGE_SECONDS, first, last);
+    return true;
 }
 
-int main(int argc, char** argv)
+//the stream's live, stdout only carries the data
+int RunStream(avb::ArgParser& args, avb::ConverterSettings settings, uint32_t layout)
 {
-    bool backward = false;
-    if(backward)
+    const std::vector<std::string>& inputs = args.GetPositional();
+    FILE* in = stdin;
+    if(inputs.size() && inputs[0] != "-")
+        in = fopen(inputs[0].c_str(), "rb");
+    if(!in)
     {
-        avb::BackwardConverter cnvB;
-        cnvB.Convert("unbrkn_edit");
+        fprintf(stderr, "Could not open %s\n", inputs[0].c_str());
+        return 1;
+    }
+    avb::SetBinaryMode(stdin);
+    avb::SetBinaryMode(stdout);
+    bool ok;
+    if(args.IsSet("-b"))
+    {
+        ok = avb::PipeBackward(in, stdout, settings, args.IsSet("--raw"));
+    }
+    else if(args.IsSet("--pcm"))
+    {
+        unsigned rate, numCh, bits;
+        char end;
+        if(sscanf(args.Get("--pcm", "").c_str(), "%u:%u:%u%c", &rate, &numCh, &bits, &end) != 3 || !rate || numCh < 1 || numCh > 2 || (bits != 8 && bits != 16 && bits != 24 && bits != 32))
+        {
+            fprintf(stderr, "--pcm takes rate:channels:bits, e.g. 44100:2:16\n");
+            return 1;
+        }
+        avb::wav::Header fmt = avb::wav::MakeFormat(rate, numCh, bits);
+        ok = avb::PipeForward(in, stdout, settings, &fmt, layout);
     }
     else
     {
-        avb::ForwardConverter cnv;
-        cnv.Init(avb::MakeDefaultConverterSettings());
+        ok = avb::PipeForward(in, stdout, settings, nullptr, layout);
+    }
+    if(in != stdin)
+        fclose(in);
+    return ok ? 0 : 1;
+}
 
-        bool conv_succ = cnv.Convert(argv[1]);
-        if(!conv_succ)
+bool ReadSettings(avb::ArgParser& args, avb::ConverterSettings* settings)
+{
+    if(!args.GetUInt("--fft", settings->fftSize, &settings->fftSize))
+    {
+        printf("%s\n", args.GetError().c_str());
+        return false;
+    }
+    if(settings->fftSize < 16 || settings->fftSize%2)
+    {
+        printf("--fft has to be an even number of at least 16\n");
+        return false;
+    }
+    if(args.IsSet("--compander"))
+    {
+        std::string name = args.Get("--compander", "");
+        avb::Compander16 comp;
+        settings->compandingMethod = comp.GetMethodID(name.c_str());
+        if(!settings->compandingMethod)
         {
-            puts("Conversion was aborted due to an error.");
+            printf("unknown compander: %s\n", name.c_str());
+            return false;
         }
+        //the default parameters are uvlaw's
+        float param[4][2] = {{0.0f, 0.0f}, {1.0f, 0.0f}, {64.0f, 0.0f}, {768.0f, 0.125f}};
+        settings->companderParam[0] = param[settings->compandingMethod][0];
+        settings->companderParam[1] = param[settings->compandingMethod][1];
     }
-    /*avb::ForwardConverterThread testthr;
-    testthr.Init(avb::MakeDefaultConverterSettings());
-
-    int blocks1024 = 0;
-    std::ifstream testfile("unbrkn.wav", std::ios::binary);
-    std::ofstream outfile("unbrkn.raw", std::ios::binary);
-    testfile.seekg(44);
-    std::valarray<float> block(0.0f, 2048);
-    while(1)
-    {
-        float dat[2048];
-        testfile.read((char*)dat, 2048*sizeof(float));
-        if(testfile.eof())
-            break;
-        block = block.cshift(1024);
-        for(int i=0; i<1024; i++)
-            block[i+1024] = dat[2*i+1];
-        std::vector<std::valarray<float>> xd(1);
-        xd[0] = block;
-        testthr.inputs = xd;
-        testthr.Process();
-
-        outfile.write((char*)&testthr.outputs[0][0], testthr.outputs[0].size()*sizeof(avb::Pixel16));
+    if(args.IsSet("--window"))
+    {
+        std::string name = args.Get("--window", "");
+        if(!avb::window::id.size())
+            avb::window::InitMaps();
+        if(!avb::window::id.count(name))
+        {
+            printf("unknown window: %s\n", name.c_str());
+            return false;
+        }
+        settings->windowFunction = avb::window::id[name];
+    }
+    settings->horizontalTime = args.IsSet("--horizontal");
+    settings->outputFloat32Audio = args.IsSet("--float");
+    settings->ditherOutput = args.IsSet("--dither");
+    return true;
+}
 
-        blocks1024++;
+//thin wrapper around the library, the converters do all the work
+int main(int argc, char** argv)
+{
+    avb::ArgParser args;
+    args.AddFlag("-b");
+    args.AddFlag("--batch");
+    args.AddFlag("--horizontal");
+    args.AddFlag("--float");
+    args.AddFlag("--dither");
+    args.AddFlag("--full");
+    args.AddFlag("--stream");
+    args.AddFlag("--raw");
+    args.AddOption("--fft");
+    args.AddOption("--compander");
+    args.AddOption("--window");
+    args.AddOption("--report");
+    args.AddOption("--from");
+    args.AddOption("--to");
+    args.AddOption("--rows");
+    args.AddOption("--out");
+    args.AddOption("--jobs");
+    args.AddOption("--max-open");
+    args.AddOption("--pcm");
+    args.AddOption("--pyramid");
+    args.AddOption("--layout");
+    if(!args.Parse(argc, argv))
+    {
+        printf("%s\n\n", args.GetError().c_str());
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    const std::vector<std::string>& inputs = args.GetPositional();
+    bool backward = args.IsSet("-b");
+    bool batch = args.IsSet("--batch");
+    bool stream = args.IsSet("--stream");
+    if((inputs.empty() && !stream) || (backward && batch) || (stream && batch) || (!batch && inputs.size() > 1))
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    avb::ConverterSettings settings = avb::MakeDefaultConverterSettings();
+    if(!ReadSettings(args, &settings))
+        return 1;
+    //only the way there picks one, the way back reads it from the header
+    std::string layoutName = args.Get("--layout", "rgb16");
+    if(layoutName != "rgb16" && layoutName != "rg16")
+    {
+        printf("unknown layout: %s\n", layoutName.c_str());
+        return 1;
+    }
+    uint32_t layout = layoutName == "rg16" ? AVB_LAYOUT_RG16 : AVB_LAYOUT_RGB16;
+    if(stream)
+        return RunStream(args, settings, layout);
+    std::string report = args.Get("--report", "");
+    uint32_t pyramidBits;
+    if(!args.GetUInt("--pyramid", 0, &pyramidBits) || (pyramidBits && pyramidBits != 8 && pyramidBits != 16))
+    {
+        printf("--pyramid takes 8 or 16\n");
+        return 1;
+    }
 
-        if(blocks1024 % 256 == 0)
+    if(batch)
+    {
+        uint32_t jobs, maxOpen;
+        if(!args.GetUInt("--jobs", 0, &jobs) || !args.GetUInt("--max-open", AVB_BATCH_DEFAULT_MAX_OPEN_FILES, &maxOpen))
         {
-            int seconds = (blocks1024*1024) / 44100;
-            //printf("block %d (timestamp: %d:%02d)\n", blocks1024, seconds/60, seconds%60);
+            printf("%s\n", args.GetError().c_str());
+            return 1;
         }
+        std::vector<std::string> files;
+        for(auto& in : inputs)
+        {
+            std::vector<std::string> found = avb::FindBatchInputs(in.c_str());
+            if(found.empty())
+                printf("No WAV files in %s\n", in.c_str());
+            files.insert(files.end(), found.begin(), found.end());
+        }
+        if(files.empty())
+            return 1;
+        avb::BatchConverter cnvBatch;
+        if(!cnvBatch.Init(settings, jobs, maxOpen))
+        {
+            puts("Could not initialize the converter.");
+            return 1;
+        }
+        cnvBatch.SetPyramid(pyramidBits);
+        cnvBatch.SetLayout(layout);
+        return cnvBatch.Convert(files) ? 1 : 0;
+    }
+    if(backward)
+    {
+        avb::BackwardConverter cnvB;
+        cnvB.Init(settings);
+        cnvB.SetIncremental(!args.IsSet("--full"));
+        cnvB.SetReportFile(report.size() ? report.c_str() : nullptr);
+        if(!ReadRange(args, &cnvB))
+            return 1;
+        std::string out = args.Get("--out", "");
+        cnvB.SetOutputFile(out.c_str());
+        //the audio goes to stdout, so must everything else but errors
+        cnvB.SetVerbose(out != "-");
+        if(!cnvB.Convert(inputs[0].c_str()))
+        {
+            fprintf(out == "-" ? stderr : stdout, "Conversion was aborted due to an error.\n");
+            return 1;
+        }
+        return 0;
+    }
+    avb::ForwardConverter cnv;
+    if(!cnv.Init(settings))
+    {
+        puts("Could not initialize the converter.");
+        return 1;
+    }
+    cnv.SetReportFile(report.size() ? report.c_str() : nullptr);
+    cnv.SetPyramid(pyramidBits);
+    cnv.SetLayout(layout);
+    if(!cnv.Convert(inputs[0].c_str()))
+    {
+        puts("Conversion was aborted due to an error.");
+        return 1;
     }
-
-    printf("Resulting image is 1025x%d", blocks1024);
-*/
     return 0;
 }
@@ -0,0 +1,466 @@
+#include "pcm.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define AVB_PCM_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(AVB_PCM_SSE2) && defined(__GNUC__)
+#define AVB_PCM_AVX2
+#define AVB_PCM_SSSE3
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    const float scale8 = 1.0f/128.0f;
+    const float scale16 = 1.0f/32768.0f;
+    const float scale24 = 1.0f/8388608.0f;
+
+    int32_t Load24(const uint8_t* p)
+    {
+        //sign extension through the top byte
+        uint32_t v = (uint32_t)p[0]<<8 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<24;
+        return (int32_t)v >> 8;
+    }
+
+    //scalar tails, also the generic path for more than 2 channels
+    void Scalar8(const uint8_t* src, uint32_t numCh, uint32_t first, uint32_t len, float** dst)
+    {
+        for(uint32_t j=first; j<len; j++)
+            for(uint32_t c=0; c<numCh; c++)
+                dst[c][j] = ((float)src[j*numCh+c] - 128.0f) * scale8;
+    }
+    void Scalar16(const uint8_t* src, uint32_t numCh, uint32_t first, uint32_t len, float** dst)
+    {
+        for(uint32_t j=first; j<len; j++)
+        {
+            for(uint32_t c=0; c<numCh; c++)
+            {
+                int16_t v;
+                memcpy(&v, src+2*(j*numCh+c), 2);
+                dst[c][j] = (float)v * scale16;
+            }
+        }
+    }
+    void Scalar32f(const uint8_t* src, uint32_t numCh, uint32_t first, uint32_t len, float** dst)
+    {
+        for(uint32_t j=first; j<len; j++)
+            for(uint32_t c=0; c<numCh; c++)
+                memcpy(&dst[c][j], src+4*(j*numCh+c), 4);
+    }
+
+    //tpdf dither, the difference of the two 16-bit halves of a xorshift32
+    //output is triangular over (-1, 1)
+    const float ditherScale = 1.0f/65536.0f;
+    struct Dither
+    {
+        uint32_t s[4];
+        bool on;
+        Dither(uint32_t seed)
+        {
+            on = seed != 0;
+            for(uint32_t i=0; i<4; i++)
+            {
+                uint32_t x = seed*0x9E3779B9U + i*0x85EBCA6BU;
+                x ^= x>>16;
+                x *= 0x7FEB352DU;
+                x ^= x>>15;
+                s[i] = x ? x : 1;
+            }
+        }
+        float Next(uint32_t j)
+        {
+            if(!on)
+                return 0.0f;
+            uint32_t& x = s[j&3];
+            x ^= x<<13;
+            x ^= x>>17;
+            x ^= x<<5;
+            return (float)((int32_t)(x>>16) - (int32_t)(x&0xFFFF)) * ditherScale;
+        }
+    };
+
+    //same operand order as maxps/minps/cvtps2dq, NaN ends up at the low end
+    int32_t QuantizeOne(float x, float k, float lo, float hi, float noise)
+    {
+        float v = x*k + noise;
+        v = v > lo ? v : lo;
+        v = v < hi ? v : hi;
+        return (int32_t)std::lrint(v);
+    }
+
+#ifdef AVB_PCM_SSE2
+    __m128 NextDither4(const Dither& d, __m128i& s)
+    {
+        if(!d.on)
+            return _mm_setzero_ps();
+        s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+        s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+        s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+        __m128i n = _mm_sub_epi32(_mm_srli_epi32(s, 16), _mm_and_si128(s, _mm_set1_epi32(0xFFFF)));
+        return _mm_mul_ps(_mm_cvtepi32_ps(n), _mm_set1_ps(ditherScale));
+    }
+    __m128i Quantize4(const float* src, __m128 k, __m128 lo, __m128 hi, __m128 noise)
+    {
+        __m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src), k), noise);
+        v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+        return _mm_cvtps_epi32(v);
+    }
+#endif
+
+#ifdef AVB_PCM_AVX2
+    bool HasAVX2()
+    {
+        static const bool r = __builtin_cpu_supports("avx2");
+        return r;
+    }
+
+    __attribute__((target("avx2")))
+    uint32_t AVX2_16(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst)
+    {
+        const __m256 k = _mm256_set1_ps(scale16);
+        uint32_t j = 0;
+        if(numCh == 1)
+        {
+            for(; j+16<=len; j+=16)
+            {
+                __m256i x = _mm256_loadu_si256((const __m256i*)(src+2*j));
+                __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+                __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+                _mm256_storeu_ps(dst[0]+j, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), k));
+                _mm256_storeu_ps(dst[0]+j+8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), k));
+            }
+        }
+        else if(numCh == 2)
+        {
+            for(; j+8<=len; j+=8)
+            {
+                //one frame per 32-bit lane: left in the low half, right in the high half
+                __m256i x = _mm256_loadu_si256((const __m256i*)(src+4*j));
+                __m256i l = _mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16);
+                __m256i r = _mm256_srai_epi32(x, 16);
+                _mm256_storeu_ps(dst[0]+j, _mm256_mul_ps(_mm256_cvtepi32_ps(l), k));
+                _mm256_storeu_ps(dst[1]+j, _mm256_mul_ps(_mm256_cvtepi32_ps(r), k));
+            }
+        }
+        return j;
+    }
+
+    __attribute__((target("avx2")))
+    uint32_t AVX2_32f(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst)
+    {
+        uint32_t j = 0;
+        if(numCh == 2)
+        {
+            for(; j+8<=len; j+=8)
+            {
+                __m256 a = _mm256_loadu_ps((const float*)(src+8*j));
+                __m256 b = _mm256_loadu_ps((const float*)(src+8*j+32));
+                __m256 l = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+                __m256 r = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+                l = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(l), _MM_SHUFFLE(3,1,2,0)));
+                r = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(r), _MM_SHUFFLE(3,1,2,0)));
+                _mm256_storeu_ps(dst[0]+j, l);
+                _mm256_storeu_ps(dst[1]+j, r);
+            }
+        }
+        return j;
+    }
+#endif // AVB_PCM_AVX2
+
+#ifdef AVB_PCM_SSSE3
+    bool HasSSSE3()
+    {
+        static const bool r = __builtin_cpu_supports("ssse3");
+        return r;
+    }
+
+    //pshufb puts the 3 bytes of a sample into the top of a 32-bit lane
+    //(-128 zeroes the low byte), an arithmetic shift sign-extends it.
+    //masks for 4 mono samples and for 2 stereo frames as L0 L1 R0 R1
+    #define AVB_PCM_MASK24_MONO -128,0,1,2, -128,3,4,5, -128,6,7,8, -128,9,10,11
+    #define AVB_PCM_MASK24_STEREO -128,0,1,2, -128,6,7,8, -128,3,4,5, -128,9,10,11
+
+    __attribute__((target("ssse3")))
+    uint32_t SSSE3_24(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst, uint32_t j)
+    {
+        const __m128 k = _mm_set1_ps(scale24);
+        //every load is 16 bytes of which 12 are used, the rest has to be in the buffer
+        if(numCh == 1)
+        {
+            const __m128i m = _mm_setr_epi8(AVB_PCM_MASK24_MONO);
+            for(; j+6<=len; j+=4)
+            {
+                __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+3*j)), m);
+                _mm_storeu_ps(dst[0]+j, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(x, 8)), k));
+            }
+        }
+        else if(numCh == 2)
+        {
+            const __m128i m = _mm_setr_epi8(AVB_PCM_MASK24_STEREO);
+            for(; j+5<=len; j+=4)
+            {
+                __m128i a = _mm_srai_epi32(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+6*j)), m), 8);
+                __m128i b = _mm_srai_epi32(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+6*j+12)), m), 8);
+                _mm_storeu_ps(dst[0]+j, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi64(a, b)), k));
+                _mm_storeu_ps(dst[1]+j, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi64(a, b)), k));
+            }
+        }
+        return j;
+    }
+
+    //two 16-byte loads, one per 128-bit lane, since vpshufb stays within lanes
+    __attribute__((target("avx2")))
+    __m256i Load24x2(const uint8_t* lo, const uint8_t* hi)
+    {
+        __m256i x = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+        return _mm256_inserti128_si256(x, _mm_loadu_si128((const __m128i*)hi), 1);
+    }
+
+    __attribute__((target("avx2")))
+    uint32_t AVX2_24(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst)
+    {
+        const __m256 k = _mm256_set1_ps(scale24);
+        uint32_t j = 0;
+        if(numCh == 1)
+        {
+            const __m256i m = _mm256_setr_epi8(AVB_PCM_MASK24_MONO, AVB_PCM_MASK24_MONO);
+            for(; j+10<=len; j+=8)
+            {
+                __m256i x = _mm256_shuffle_epi8(Load24x2(src+3*j, src+3*j+12), m);
+                _mm256_storeu_ps(dst[0]+j, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(x, 8)), k));
+            }
+        }
+        else if(numCh == 2)
+        {
+            //frames 0,1|4,5 and 2,3|6,7, so the 64-bit unpacks come out in order
+            const __m256i m = _mm256_setr_epi8(AVB_PCM_MASK24_STEREO, AVB_PCM_MASK24_STEREO);
+            for(; j+9<=len; j+=8)
+            {
+                __m256i a = _mm256_srai_epi32(_mm256_shuffle_epi8(Load24x2(src+6*j, src+6*j+24), m), 8);
+                __m256i b = _mm256_srai_epi32(_mm256_shuffle_epi8(Load24x2(src+6*j+12, src+6*j+36), m), 8);
+                _mm256_storeu_ps(dst[0]+j, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_unpacklo_epi64(a, b)), k));
+                _mm256_storeu_ps(dst[1]+j, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_unpackhi_epi64(a, b)), k));
+            }
+        }
+        return j;
+    }
+#endif // AVB_PCM_SSSE3
+}
+
+void avb::pcm::Deinterleave8(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst)
+{
+    uint32_t j = 0;
+#ifdef AVB_PCM_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(128);
+    const __m128 k = _mm_set1_ps(scale8);
+    if(numCh == 1)
+    {
+        for(; j+16<=len; j+=16)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*)(src+j));
+            __m128i w[2] = {_mm_unpacklo_epi8(x, zero), _mm_unpackhi_epi8(x, zero)};
+            for(int h=0; h<2; h++)
+            {
+                __m128i lo = _mm_sub_epi32(_mm_unpacklo_epi16(w[h], zero), bias);
+                __m128i hi = _mm_sub_epi32(_mm_unpackhi_epi16(w[h], zero), bias);
+                _mm_storeu_ps(dst[0]+j+8*h, _mm_mul_ps(_mm_cvtepi32_ps(lo), k));
+                _mm_storeu_ps(dst[0]+j+8*h+4, _mm_mul_ps(_mm_cvtepi32_ps(hi), k));
+            }
+        }
+    }
+    else if(numCh == 2)
+    {
+        const __m128i lowMask = _mm_set1_epi32(0xFFFF);
+        for(; j+8<=len; j+=8)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*)(src+2*j));
+            __m128i w[2] = {_mm_unpacklo_epi8(x, zero), _mm_unpackhi_epi8(x, zero)};
+            for(int h=0; h<2; h++)
+            {
+                __m128i l = _mm_sub_epi32(_mm_and_si128(w[h], lowMask), bias);
+                __m128i r = _mm_sub_epi32(_mm_srli_epi32(w[h], 16), bias);
+                _mm_storeu_ps(dst[0]+j+4*h, _mm_mul_ps(_mm_cvtepi32_ps(l), k));
+                _mm_storeu_ps(dst[1]+j+4*h, _mm_mul_ps(_mm_cvtepi32_ps(r), k));
+            }
+        }
+    }
+#endif
+    Scalar8(src, numCh, j, len, dst);
+}
+
+void avb::pcm::Deinterleave16(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst)
+{
+    uint32_t j = 0;
+#ifdef AVB_PCM_AVX2
+    if(HasAVX2())
+        j = AVX2_16(src, numCh, len, dst);
+#endif
+#ifdef AVB_PCM_SSE2
+    const __m128 k = _mm_set1_ps(scale16);
+    if(numCh == 1)
+    {
+        for(; j+8<=len; j+=8)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*)(src+2*j));
+            __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+            __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+            _mm_storeu_ps(dst[0]+j, _mm_mul_ps(_mm_cvtepi32_ps(lo), k));
+            _mm_storeu_ps(dst[0]+j+4, _mm_mul_ps(_mm_cvtepi32_ps(hi), k));
+        }
+    }
+    else if(numCh == 2)
+    {
+        for(; j+4<=len; j+=4)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*)(src+4*j));
+            __m128i l = _mm_srai_epi32(_mm_slli_epi32(x, 16), 16);
+            __m128i r = _mm_srai_epi32(x, 16);
+            _mm_storeu_ps(dst[0]+j, _mm_mul_ps(_mm_cvtepi32_ps(l), k));
+            _mm_storeu_ps(dst[1]+j, _mm_mul_ps(_mm_cvtepi32_ps(r), k));
+        }
+    }
+#endif
+    Scalar16(src, numCh, j, len, dst);
+}
+
+void avb::pcm::Deinterleave24(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst)
+{
+    //packed 3-byte samples need pshufb, so past plain SSE2 it's AVX2 or
+    //SSSE3 when the cpu has them and the scalar loop otherwise
+    uint32_t j = 0;
+#ifdef AVB_PCM_SSSE3
+    if(HasAVX2())
+        j = AVX2_24(src, numCh, len, dst);
+    if(HasSSSE3())
+        j = SSSE3_24(src, numCh, len, dst, j);
+#endif
+    for(; j<len; j++)
+        for(uint32_t c=0; c<numCh; c++)
+            dst[c][j] = (float)Load24(src+3*(j*numCh+c)) * scale24;
+}
+
+void avb::pcm::Deinterleave32f(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst)
+{
+    uint32_t j = 0;
+    if(numCh == 1)
+    {
+        memcpy(dst[0], src, 4*len);
+        return;
+    }
+#ifdef AVB_PCM_AVX2
+    if(HasAVX2())
+        j = AVX2_32f(src, numCh, len, dst);
+#endif
+#ifdef AVB_PCM_SSE2
+    if(numCh == 2)
+    {
+        for(; j+4<=len; j+=4)
+        {
+            __m128 a = _mm_loadu_ps((const float*)(src+8*j));
+            __m128 b = _mm_loadu_ps((const float*)(src+8*j+16));
+            _mm_storeu_ps(dst[0]+j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)));
+            _mm_storeu_ps(dst[1]+j, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1)));
+        }
+    }
+#endif
+    Scalar32f(src, numCh, j, len, dst);
+}
+
+bool avb::pcm::Deinterleave(const uint8_t* src, uint32_t bitsPerSample, uint32_t numCh, uint32_t len, float** dst)
+{
+    switch(bitsPerSample)
+    {
+    case 8:
+        Deinterleave8(src, numCh, len, dst);
+        return true;
+    case 16:
+        Deinterleave16(src, numCh, len, dst);
+        return true;
+    case 24:
+        Deinterleave24(src, numCh, len, dst);
+        return true;
+    case 32:
+        Deinterleave32f(src, numCh, len, dst);
+        return true;
+    }
+    return false;
+}
+
+void avb::pcm::Quantize16(const float* src, uint32_t len, uint8_t* dst, uint32_t ditherSeed)
+{
+    Dither d(ditherSeed);
+    uint32_t j = 0;
+#ifdef AVB_PCM_SSE2
+    const __m128 k = _mm_set1_ps(32768.0f);
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+    __m128i s = _mm_loadu_si128((const __m128i*)d.s);
+    for(; j+8<=len; j+=8)
+    {
+        __m128i a = Quantize4(src+j, k, lo, hi, NextDither4(d, s));
+        __m128i b = Quantize4(src+j+4, k, lo, hi, NextDither4(d, s));
+        _mm_storeu_si128((__m128i*)(dst+2*j), _mm_packs_epi32(a, b));
+    }
+    _mm_storeu_si128((__m128i*)d.s, s);
+#endif
+    for(; j<len; j++)
+    {
+        int16_t v = (int16_t)QuantizeOne(src[j], 32768.0f, -32768.0f, 32767.0f, d.Next(j));
+        memcpy(dst+2*j, &v, 2);
+    }
+}
+
+void avb::pcm::Quantize24(const float* src, uint32_t len, uint8_t* dst, uint32_t ditherSeed)
+{
+    Dither d(ditherSeed);
+    uint32_t j = 0;
+#ifdef AVB_PCM_SSE2
+    const __m128 k = _mm_set1_ps(8388608.0f);
+    const __m128 lo = _mm_set1_ps(-8388608.0f);
+    const __m128 hi = _mm_set1_ps(8388607.0f);
+    //each 64-bit half packs its two samples into 6 bytes
+    const __m128i low24 = _mm_set_epi32(0, 0xFFFFFF, 0, 0xFFFFFF);
+    const __m128i high24 = _mm_set_epi32(0xFFFF, 0xFF000000, 0xFFFF, 0xFF000000);
+    __m128i s = _mm_loadu_si128((const __m128i*)d.s);
+    //the second store spills 2 bytes into the next group, so stop a group early
+    for(; j+8<=len; j+=4)
+    {
+        __m128i v = Quantize4(src+j, k, lo, hi, NextDither4(d, s));
+        v = _mm_or_si128(_mm_and_si128(v, low24), _mm_and_si128(_mm_srli_epi64(v, 8), high24));
+        _mm_storel_epi64((__m128i*)(dst+3*j), v);
+        _mm_storel_epi64((__m128i*)(dst+3*j+6), _mm_srli_si128(v, 8));
+    }
+    _mm_storeu_si128((__m128i*)d.s, s);
+#endif
+    for(; j<len; j++)
+    {
+        int32_t v = QuantizeOne(src[j], 8388608.0f, -8388608.0f, 8388607.0f, d.Next(j));
+        dst[3*j] = v & 0xFF;
+        dst[3*j+1] = (v>>8) & 0xFF;
+        dst[3*j+2] = (v>>16) & 0xFF;
+    }
+}
+
+void avb::pcm::Quantize32f(const float* src, uint32_t len, uint8_t* dst)
+{
+    memcpy(dst, src, 4*len);
+}
+
+bool avb::pcm::Quantize(const float* src, uint32_t bitsPerSample, uint32_t len, uint8_t* dst, uint32_t ditherSeed)
+{
+    switch(bitsPerSample)
+    {
+    case 16:
+        Quantize16(src, len, dst, ditherSeed);
+        return true;
+    case 24:
+        Quantize24(src, len, dst, ditherSeed);
+        return true;
+    case 32:
+        Quantize32f(src, len, dst);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,35 @@
+#ifndef AVB_PCM_H
+#define AVB_PCM_H
+
+#include "incl/c_cpp.hpp"
+
+namespace avb
+{
+    //interleaved PCM <-> planar float kernels. every kernel converts and
+    //deinterleaves in a single pass into buffers owned by the caller.
+    //the scale factors are powers of two, so the results match a plain
+    //(float)x / 2^(bits-1) bit for bit
+    namespace pcm
+    {
+        void Deinterleave8(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst);
+        void Deinterleave16(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst);
+        void Deinterleave24(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst);
+        void Deinterleave32f(const uint8_t* src, uint32_t numCh, uint32_t len, float** dst);
+
+        //dispatches on bitsPerSample (8, 16, 24 or 32 meaning float)
+        bool Deinterleave(const uint8_t* src, uint32_t bitsPerSample, uint32_t numCh, uint32_t len, float** dst);
+
+        //the way back: already interleaved float to PCM. samples are scaled
+        //to full scale, clamped and rounded to nearest even. a nonzero
+        //ditherSeed adds +-1 LSB of TPDF noise from 4 xorshift32 streams
+        //(sample j uses stream j%4), so a seed gives the same output on every path
+        void Quantize16(const float* src, uint32_t len, uint8_t* dst, uint32_t ditherSeed);
+        void Quantize24(const float* src, uint32_t len, uint8_t* dst, uint32_t ditherSeed);
+        void Quantize32f(const float* src, uint32_t len, uint8_t* dst);
+
+        //dispatches on bitsPerSample (16, 24 or 32 meaning float)
+        bool Quantize(const float* src, uint32_t bitsPerSample, uint32_t len, uint8_t* dst, uint32_t ditherSeed);
+    }
+}
+
+#endif // AVB_PCM_H
@@ -0,0 +1,179 @@
+#include "pyramid.hpp"
+
+namespace
+{
+    //the size of the next level, false when neither axis can halve any more
+    bool ShrinkLevel(uint32_t& width, uint32_t& height, bool& pairColumns, bool& pairRows)
+    {
+        pairColumns = (width+1)/2 >= AVB_PYRAMID_MIN_WIDTH;
+        pairRows = (height+1)/2 >= AVB_PYRAMID_MIN_WIDTH;
+        if(pairColumns)
+            width = (width+1)/2;
+        if(pairRows)
+            height = (height+1)/2;
+        return pairColumns || pairRows;
+    }
+}
+
+avb::PreviewPyramid::PreviewPyramid()
+{
+    bits = 16;
+    horizontal = false;
+}
+avb::PreviewPyramid::~PreviewPyramid()
+{
+    Close();
+}
+
+bool avb::PreviewPyramid::Open(const std::string& baseFilename, uint32_t rowSize, uint32_t totalRows, uint32_t t_bits, bool t_horizontal, uint32_t numLevels)
+{
+    Close();
+    bits = t_bits == 8 ? 8 : 16;
+    horizontal = t_horizontal;
+    uint32_t width = rowSize, height = totalRows;
+    Level lv;
+    for(uint32_t i=0; (!numLevels || i<numLevels) && height && ShrinkLevel(width, height, lv.pairColumns, lv.pairRows); i++)
+    {
+        lv.width = width;
+        lv.height = height;
+        lv.sums.assign(width, 0);
+        lv.rowsSummed = 0;
+        lv.row.resize(width);
+        lv.bytes.resize(width*bits/8);
+        lv.rowsEmitted = 0;
+        //about 1 MiB of columns at a time
+        lv.stripRows = horizontal ? std::min(height, std::max(1U, (1U<<20)/(uint32_t)lv.bytes.size())) : 0;
+        lv.stripUsed = 0;
+        lv.strip.assign((size_t)lv.stripRows*lv.bytes.size(), 0);
+        std::string fn = baseFilename + "_mip" + std::to_string(i+1) + ".pgm";
+        lv.file = fopen(fn.c_str(), "wb");
+        if(!lv.file)
+        {
+            Close();
+            return false;
+        }
+        if(horizontal)
+            lv.dataOffset = fprintf(lv.file, "P5\n%u %u\n%u\n", height, width, bits == 8 ? 255U : 65535U);
+        else
+            lv.dataOffset = fprintf(lv.file, "P5\n%u %u\n%u\n", width, height, bits == 8 ? 255U : 65535U);
+        levels.push_back(lv);
+    }
+    magnitudes.resize(rowSize);
+    return true;
+}
+
+uint32_t avb::PreviewPyramid::CountLevels(uint32_t rowSize, uint32_t totalRows)
+{
+    uint32_t n = 0;
+    bool pairColumns, pairRows;
+    while(totalRows && ShrinkLevel(rowSize, totalRows, pairColumns, pairRows))
+        n++;
+    return n;
+}
+
+void avb::PreviewPyramid::AddRow(uint32_t level, const uint16_t* row, uint32_t rowWidth)
+{
+    //an odd last column is paired with itself
+    Level& lv = levels[level];
+    uint32_t rowWeight = lv.pairRows ? 1 : 2;
+    if(lv.pairColumns)
+    {
+        for(uint32_t x=0; x<lv.width; x++)
+        {
+            uint32_t a = row[2*x];
+            lv.sums[x] += (a + (2*x+1 < rowWidth ? row[2*x+1] : a)) * rowWeight;
+        }
+    }
+    else
+    {
+        for(uint32_t x=0; x<lv.width; x++)
+            lv.sums[x] += row[x] * 2 * rowWeight;
+    }
+    if(!lv.pairRows || ++lv.rowsSummed == 2)
+        EmitRow(level);
+}
+
+void avb::PreviewPyramid::EmitRow(uint32_t level)
+{
+    Level& lv = levels[level];
+    for(uint32_t x=0; x<lv.width; x++)
+    {
+        lv.row[x] = (lv.sums[x]+2) >> 2;
+        lv.sums[x] = 0;
+    }
+    lv.rowsSummed = 0;
+    //PGM wants the most significant byte first
+    if(bits == 8)
+    {
+        for(uint32_t x=0; x<lv.width; x++)
+            lv.bytes[x] = lv.row[x] >> 8;
+    }
+    else
+    {
+        for(uint32_t x=0; x<lv.width; x++)
+        {
+            lv.bytes[2*x] = lv.row[x] >> 8;
+            lv.bytes[2*x+1] = lv.row[x] & 0xFF;
+        }
+    }
+    if(horizontal)
+    {
+        //row k of the strip is column k of each frequency line
+        size_t pixelBytes = bits/8;
+        for(uint32_t x=0; x<lv.width; x++)
+            memcpy(&lv.strip[((size_t)x*lv.stripRows + lv.stripUsed)*pixelBytes], &lv.bytes[x*pixelBytes], pixelBytes);
+        lv.stripUsed++;
+        if(lv.stripUsed == lv.stripRows || lv.rowsEmitted + lv.stripUsed == lv.height)
+            FlushStrip(lv);
+    }
+    else
+        fwrite(&lv.bytes[0], 1, lv.bytes.size(), lv.file);
+    if(level+1 < levels.size())
+        AddRow(level+1, &lv.row[0], lv.width);
+}
+
+void avb::PreviewPyramid::FlushStrip(Level& lv)
+{
+    size_t pixelBytes = bits/8;
+    for(uint32_t x=0; lv.stripUsed && x<lv.width; x++)
+    {
+        SeekFile(lv.file, lv.dataOffset + ((uint64_t)x*lv.height + lv.rowsEmitted)*pixelBytes);
+        fwrite(&lv.strip[(size_t)x*lv.stripRows*pixelBytes], 1, lv.stripUsed*pixelBytes, lv.file);
+    }
+    lv.rowsEmitted += lv.stripUsed;
+    lv.stripUsed = 0;
+}
+
+void avb::PreviewPyramid::AddRows(const Pixel16* rows, uint32_t count)
+{
+    if(levels.empty())
+        return;
+    uint32_t rowSize = magnitudes.size();
+    for(uint32_t i=0; i<count; i++)
+    {
+        const Pixel16* src = rows + (size_t)i*rowSize;
+        for(uint32_t x=0; x<rowSize; x++)
+            magnitudes[x] = src[x].g;
+        AddRow(0, &magnitudes[0], rowSize);
+    }
+}
+
+void avb::PreviewPyramid::Close()
+{
+    //top down, a row finished here may leave an odd one in the next level
+    for(uint32_t i=0; i<levels.size(); i++)
+    {
+        if(levels[i].rowsSummed)
+        {
+            for(auto& s : levels[i].sums)
+                s *= 2;
+            EmitRow(i);
+        }
+    }
+    for(auto& lv : levels)
+    {
+        FlushStrip(lv);
+        fclose(lv.file);
+    }
+    levels.clear();
+}
@@ -0,0 +1,67 @@
+#ifndef AVB_PYRAMID_H
+#define AVB_PYRAMID_H
+
+#include "incl/c_cpp.hpp"
+#include "fileio.hpp"
+
+//an axis stops halving before it gets shorter than this
+#define AVB_PYRAMID_MIN_WIDTH 32
+
+namespace avb
+{
+    //magnitude-only previews of an image at 1/2, 1/4, 1/8... of its size,
+    //written as PGM next to the image and turned the same way it is. rows go
+    //in as the converter writes them and every level is made from the one
+    //above, a pair of rows at a time, so the previews take no pass of their
+    //own. once frequency is down to AVB_PYRAMID_MIN_WIDTH only time keeps
+    //halving, so a long recording still ends in a small preview
+    class PreviewPyramid
+    {
+        struct Level
+        {
+            FILE* file;
+            uint32_t width, height;
+            //whether the level halves frequency, time or both
+            bool pairColumns, pairRows;
+            //sums of 2x2 pixels of the level above, filled one row at a time.
+            //an axis that is not halved counts its pixel twice
+            std::vector<uint32_t> sums;
+            uint32_t rowsSummed;
+            std::vector<uint16_t> row;
+            std::vector<uint8_t> bytes;
+            //transposed levels gather rows into a strip of columns and write
+            //one run per frequency line when it is full
+            uint32_t rowsEmitted;
+            uint64_t dataOffset;
+            std::vector<uint8_t> strip;
+            uint32_t stripRows, stripUsed;
+        };
+        std::vector<Level> levels;
+        std::vector<uint16_t> magnitudes;
+        uint32_t bits;
+        bool horizontal;
+
+        PreviewPyramid(const PreviewPyramid&) = delete;
+        PreviewPyramid& operator=(const PreviewPyramid&) = delete;
+        void AddRow(uint32_t level, const uint16_t* row, uint32_t rowWidth);
+        void EmitRow(uint32_t level);
+        void FlushStrip(Level& lv);
+    public:
+        PreviewPyramid();
+        ~PreviewPyramid();
+
+        //levels get the names baseFilename_mip1.pgm, _mip2.pgm... with 8 or
+        //16 bits per pixel. t_horizontal puts time across the PGMs, as in a
+        //horizontalTime image. numLevels caps the count, 0 makes as many as
+        //AVB_PYRAMID_MIN_WIDTH allows
+        bool Open(const std::string& baseFilename, uint32_t rowSize, uint32_t totalRows, uint32_t t_bits, bool t_horizontal, uint32_t numLevels);
+        void AddRows(const Pixel16* rows, uint32_t count);
+        //the last odd rows count twice, then the files are closed
+        void Close();
+
+        //how many levels Open makes by default
+        static uint32_t CountLevels(uint32_t rowSize, uint32_t totalRows);
+    };
+}
+
+#endif // AVB_PYRAMID_H
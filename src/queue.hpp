@@ -0,0 +1,158 @@
+#ifndef AVB_QUEUE_H
+#define AVB_QUEUE_H
+
+#include "incl/c_cpp.hpp"
+
+namespace avb
+{
+    //bounded MPMC ring (Vyukov). Try* never block; Push/Pop only touch
+    //the mutex when they actually have to sleep
+    template<typename T>
+    class BoundedQueue
+    {
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+        std::unique_ptr<Cell[]> cells;
+        size_t mask;
+        std::atomic<size_t> enqueuePos, dequeuePos;
+        std::atomic<uint32_t> waiters;
+        std::atomic<bool> closed;
+        std::mutex mtx;
+        std::condition_variable cv;
+
+        bool Enqueue(const T& v)
+        {
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            Cell* cell;
+            for(;;)
+            {
+                cell = &cells[pos & mask];
+                size_t seq = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if(diff == 0)
+                {
+                    if(enqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                        break;
+                }
+                else if(diff < 0)
+                    return false;
+                else
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+            cell->data = v;
+            cell->sequence.store(pos+1, std::memory_order_release);
+            return true;
+        }
+        bool Dequeue(T& v)
+        {
+            size_t pos = dequeuePos.load(std::memory_order_relaxed);
+            Cell* cell;
+            for(;;)
+            {
+                cell = &cells[pos & mask];
+                size_t seq = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+                if(diff == 0)
+                {
+                    if(dequeuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                        break;
+                }
+                else if(diff < 0)
+                    return false;
+                else
+                    pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+            v = cell->data;
+            cell->sequence.store(pos+mask+1, std::memory_order_release);
+            return true;
+        }
+        void Notify()
+        {
+            //pairs with the fence in Sleep: either we see the waiter or it sees our update
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(waiters.load())
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                cv.notify_all();
+            }
+        }
+        template<typename Op>
+        bool Sleep(Op op)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            waiters++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool ok;
+            while(!(ok = op()) && !closed)
+                cv.wait(lock);
+            if(!ok)
+                ok = op();
+            waiters--;
+            return ok;
+        }
+    public:
+        BoundedQueue()
+        {
+            mask = 0;
+            enqueuePos = dequeuePos = 0;
+            waiters = 0;
+            closed = false;
+        }
+        void Init(uint32_t capacity)
+        {
+            size_t sz = 2;
+            while(sz < capacity)
+                sz *= 2;
+            cells = std::unique_ptr<Cell[]>(new Cell[sz]);
+            for(size_t i=0; i<sz; i++)
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            mask = sz-1;
+            enqueuePos = dequeuePos = 0;
+            closed = false;
+        }
+
+        bool TryPush(const T& v)
+        {
+            if(!Enqueue(v))
+                return false;
+            Notify();
+            return true;
+        }
+        bool TryPop(T& v)
+        {
+            if(!Dequeue(v))
+                return false;
+            Notify();
+            return true;
+        }
+        //false if the queue was closed
+        bool Push(const T& v)
+        {
+            if(closed)
+                return false;
+            bool ok = Enqueue(v) || Sleep([&]{ return Enqueue(v); });
+            if(ok)
+                Notify();
+            return ok;
+        }
+        //false once the queue is closed and drained
+        bool Pop(T& v)
+        {
+            bool ok = Dequeue(v) || Sleep([&]{ return Dequeue(v); });
+            if(ok)
+                Notify();
+            return ok;
+        }
+        void Close()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+            cv.notify_all();
+        }
+    };
+}
+
+#endif // AVB_QUEUE_H
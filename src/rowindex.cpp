@@ -0,0 +1,141 @@
+#include "rowindex.hpp"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define AVB_ROWINDEX_SSE42
+#include <nmmintrin.h>
+#endif
+
+namespace
+{
+    //slicing by 8, table[k][b] is the crc of byte b followed by k zero bytes
+    struct Crc32cTable
+    {
+        uint32_t t[8][256];
+        Crc32cTable()
+        {
+            for(uint32_t b=0; b<256; b++)
+            {
+                uint32_t c = b;
+                for(int k=0; k<8; k++)
+                    c = (c >> 1) ^ (0x82F63B78 & (0-(c & 1)));
+                t[0][b] = c;
+            }
+            for(uint32_t b=0; b<256; b++)
+                for(int k=1; k<8; k++)
+                    t[k][b] = (t[k-1][b] >> 8) ^ t[0][t[k-1][b] & 0xFF];
+        }
+    };
+    const Crc32cTable& GetTable()
+    {
+        static const Crc32cTable table;
+        return table;
+    }
+
+    uint32_t Scalar(const uint8_t* p, size_t len, uint32_t c)
+    {
+        const Crc32cTable& tb = GetTable();
+        for(; len >= 8; len -= 8, p += 8)
+        {
+            uint32_t lo, hi;
+            memcpy(&lo, p, 4);
+            memcpy(&hi, p+4, 4);
+            lo ^= c;
+            c = tb.t[7][lo & 0xFF] ^ tb.t[6][(lo >> 8) & 0xFF] ^ tb.t[5][(lo >> 16) & 0xFF] ^ tb.t[4][lo >> 24]
+              ^ tb.t[3][hi & 0xFF] ^ tb.t[2][(hi >> 8) & 0xFF] ^ tb.t[1][(hi >> 16) & 0xFF] ^ tb.t[0][hi >> 24];
+        }
+        for(; len; len--, p++)
+            c = (c >> 8) ^ tb.t[0][(c ^ *p) & 0xFF];
+        return c;
+    }
+
+#ifdef AVB_ROWINDEX_SSE42
+    bool HasSSE42()
+    {
+        static const bool r = __builtin_cpu_supports("sse4.2");
+        return r;
+    }
+    __attribute__((target("sse4.2")))
+    uint32_t SSE42(const uint8_t* p, size_t len, uint32_t c)
+    {
+        uint64_t c64 = c;
+        for(; len >= 8; len -= 8, p += 8)
+        {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            c64 = _mm_crc32_u64(c64, v);
+        }
+        c = (uint32_t)c64;
+        for(; len; len--, p++)
+            c = _mm_crc32_u8(c, *p);
+        return c;
+    }
+#endif // AVB_ROWINDEX_SSE42
+}
+
+uint32_t avb::Crc32c(const void* data, size_t len, uint32_t crc)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+#ifdef AVB_ROWINDEX_SSE42
+    if(HasSSE42())
+        return ~SSE42(p, len, crc);
+#endif
+    return ~Scalar(p, len, crc);
+}
+
+avb::RowIndex::RowIndex()
+{
+    rowSize = 0;
+}
+
+bool avb::RowIndex::Write(const char* filename)
+{
+    FILE* f = fopen(filename, "wb");
+    if(!f)
+        return false;
+    FileHeader h;
+    h.magicNumber = AVB_ROW_INDEX_MAGIC;
+    h.version = AVB_ROW_INDEX_VERSION;
+    h.rowSize = rowSize;
+    h.numRows = checksums.size();
+    h.sourceNameLength = sourceFilename.size();
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    if(ok && h.sourceNameLength)
+        ok = fwrite(sourceFilename.data(), h.sourceNameLength, 1, f) == 1;
+    if(ok && h.numRows)
+        ok = fwrite(&checksums[0], sizeof(uint32_t), h.numRows, f) == h.numRows;
+    fclose(f);
+    return ok;
+}
+
+bool avb::RowIndex::Read(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if(!f)
+        return false;
+    FileHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1;
+    ok = ok && h.magicNumber == AVB_ROW_INDEX_MAGIC && h.version == AVB_ROW_INDEX_VERSION;
+    //the lengths come from the file, don't trust them further than its size
+    ok = ok && (uint64_t)h.sourceNameLength + (uint64_t)h.numRows*sizeof(uint32_t) + sizeof(h) <= FileSize(filename);
+    if(ok)
+    {
+        sourceFilename.assign(h.sourceNameLength, '\0');
+        if(h.sourceNameLength)
+            ok = fread(&sourceFilename[0], h.sourceNameLength, 1, f) == 1;
+        rowSize = h.rowSize;
+        checksums.resize(h.numRows);
+        if(ok && h.numRows)
+            ok = fread(&checksums[0], sizeof(uint32_t), h.numRows, f) == h.numRows;
+    }
+    fclose(f);
+    return ok;
+}
+
+std::string avb::RowIndex::GetFilename(const std::string& imageFilename)
+{
+    std::string s = imageFilename;
+    if(s.size() >= 4 && s.compare(s.size()-4, 4, ".raw") == 0)
+        s.resize(s.size()-4);
+    return s + ".idx";
+}
@@ -0,0 +1,47 @@
+#ifndef AVB_ROWINDEX_H
+#define AVB_ROWINDEX_H
+
+#include "incl/c_cpp.hpp"
+#include "fileio.hpp"
+
+#define AVB_ROW_INDEX_MAGIC 0x58444952
+#define AVB_ROW_INDEX_VERSION 1
+
+namespace avb
+{
+    //CRC32C (Castagnoli), continuing from crc
+    uint32_t Crc32c(const void* data, size_t len, uint32_t crc);
+    inline uint32_t RowChecksum(const Pixel16* row, uint32_t len)
+    {
+        return Crc32c(row, (size_t)len*sizeof(Pixel16), 0);
+    }
+
+    //a checksum for every frame of an image as the forward pass wrote it,
+    //and the WAV it was made from. the backward pass compares the rows
+    //against it and only synthesizes the parts that were edited
+    class RowIndex
+    {
+        struct FileHeader
+        {
+            uint32_t magicNumber;
+            uint32_t version;
+            uint32_t rowSize;
+            uint32_t numRows;
+            uint32_t sourceNameLength;
+        };
+    public:
+        std::string sourceFilename;
+        //pixels per frame, fftSize/2+1 whatever the layout
+        uint32_t rowSize;
+        std::vector<uint32_t> checksums;
+
+        RowIndex();
+        bool Write(const char* filename);
+        bool Read(const char* filename);
+
+        //foo_ch1.raw -> foo_ch1.idx
+        static std::string GetFilename(const std::string& imageFilename);
+    };
+}
+
+#endif // AVB_ROWINDEX_H
@@ -0,0 +1,269 @@
+#include "spectrum.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define AVB_SPECTRUM_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    //bins done per pass, small enough for the temporaries to stay in L1
+    const uint32_t chunkSize = 256;
+
+    //x*0.5+0.5 scaled to 16 bits, NaN (from a zero magnitude) gives 0
+    inline uint16_t PhaseCode(float x)
+    {
+        float v = (x*0.5f + 0.5f) * 65535.0f;
+        if(!(v > 0.0f))
+            v = 0.0f;
+        v = std::min(v, 65535.0f);
+        return v;
+    }
+
+    //atan2 reduced to [0, tan(pi/8)] and the polynomial, as in cephes'
+    //atanf. good to a few 1e-7 rad, a phase step is about 1e-4
+    const float tanPi8 = 0.414213562f;
+    const float quarterPi = 0.785398163f;
+    const float halfPi = 1.57079633f;
+    const float pi = 3.14159265f;
+    const float atanP[4] = {8.05374449538e-2f, -1.38776856032e-1f, 1.99777106478e-1f, -3.33329491539e-1f};
+    const float codesPerRadian = 65536.0f/6.28318531f;
+    //sin and cos on [-pi/4, pi/4], cephes' sinf and cosf
+    const float sinP[3] = {-1.9515295891e-4f, 8.3321608736e-3f, -1.6666654611e-1f};
+    const float cosP[3] = {2.443315711809948e-5f, -1.388731625493765e-3f, 4.166664568298827e-2f};
+    const float radiansPerCode = 6.28318531f/65536.0f;
+
+    //the angle of re+im*i in 65536ths of a turn, 0 for 0
+    inline uint16_t AngleCode(float re, float im)
+    {
+        float ax = std::fabs(re), ay = std::fabs(im);
+        float t = std::min(ax, ay) / std::max(std::max(ax, ay), std::numeric_limits<float>::min());
+        bool big = t > tanPi8;
+        float x = big ? (t-1.0f)/(t+1.0f) : t;
+        float z = x*x;
+        float a = (((atanP[0]*z + atanP[1])*z + atanP[2])*z + atanP[3])*z*x + x;
+        if(big)
+            a = a + quarterPi;
+        if(ay > ax)
+            a = halfPi - a;
+        if(re < 0.0f)
+            a = pi - a;
+        if(im < 0.0f)
+            a = -a;
+        return (uint16_t)std::lrint(a*codesPerRadian);
+    }
+    //cos and sin of a code. the nearest quarter turn is split off exactly in
+    //integers, the polynomials only see the rest
+    inline void AngleVector(uint16_t code, float* c, float* s)
+    {
+        uint32_t q = ((code+8192) >> 14) & 3;
+        float x = (float)((int32_t)((code+8192) & 16383) - 8192) * radiansPerCode;
+        float z = x*x;
+        float sx = ((sinP[0]*z + sinP[1])*z + sinP[2])*z*x + x;
+        float cx = ((cosP[0]*z + cosP[1])*z + cosP[2])*z*z - 0.5f*z + 1.0f;
+        *c = (q & 1) ? sx : cx;
+        *s = (q & 1) ? cx : sx;
+        if((q+1) & 2)
+            *c = -*c;
+        if(q & 2)
+            *s = -*s;
+    }
+
+    void ScalarPolar(const float* src, uint32_t first, uint32_t len, float norm, float* magn, avb::Pixel16* out)
+    {
+        for(uint32_t j=first; j<len; j++)
+        {
+            float re = src[2*j] / norm;
+            float im = src[2*j+1] / norm;
+            magn[j] = std::sqrt(re*re + im*im);
+            out[j].r = AngleCode(re, im);
+            out[j].b = 0;
+        }
+    }
+
+    void ScalarPhase(const float* src, uint32_t first, uint32_t len, float norm, float* magn, avb::Pixel16* out)
+    {
+        for(uint32_t j=first; j<len; j++)
+        {
+            float re = src[2*j] / norm;
+            float im = src[2*j+1] / norm;
+            float m = std::sqrt(re*re + im*im);
+            out[j].r = PhaseCode(re / m);
+            out[j].b = PhaseCode(im / m);
+            magn[j] = m;
+        }
+    }
+
+#ifdef AVB_SPECTRUM_SSE2
+    inline __m128i PhaseCode4(__m128 x)
+    {
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 top = _mm_set1_ps(65535.0f);
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(x, half), half), top);
+        //maxps returns the second operand for NaN
+        v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), top);
+        return _mm_cvttps_epi32(v);
+    }
+
+    uint32_t SSE2Phase(const float* src, uint32_t len, float norm, float* magn, avb::Pixel16* out)
+    {
+        const __m128 k = _mm_set1_ps(norm);
+        uint32_t j = 0;
+        for(; j+4<=len; j+=4)
+        {
+            __m128 a = _mm_loadu_ps(src+2*j);
+            __m128 b = _mm_loadu_ps(src+2*j+4);
+            __m128 re = _mm_div_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)), k);
+            __m128 im = _mm_div_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1)), k);
+            __m128 m = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im)));
+            _mm_storeu_ps(magn+j, m);
+            alignas(16) int32_t rc[4], ic[4];
+            _mm_store_si128((__m128i*)rc, PhaseCode4(_mm_div_ps(re, m)));
+            _mm_store_si128((__m128i*)ic, PhaseCode4(_mm_div_ps(im, m)));
+            for(uint32_t i=0; i<4; i++)
+            {
+                out[j+i].r = rc[i];
+                out[j+i].b = ic[i];
+            }
+        }
+        return j;
+    }
+
+    //AngleCode on 4 lanes, both sides of every branch are computed and blended
+    inline __m128i AngleCode4(__m128 re, __m128 im)
+    {
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        const __m128 one = _mm_set1_ps(1.0f);
+        __m128 ax = _mm_andnot_ps(sign, re), ay = _mm_andnot_ps(sign, im);
+        __m128 t = _mm_div_ps(_mm_min_ps(ax, ay), _mm_max_ps(_mm_max_ps(ax, ay), _mm_set1_ps(std::numeric_limits<float>::min())));
+        __m128 big = _mm_cmpgt_ps(t, _mm_set1_ps(tanPi8));
+        __m128 x = _mm_or_ps(_mm_and_ps(big, _mm_div_ps(_mm_sub_ps(t, one), _mm_add_ps(t, one))), _mm_andnot_ps(big, t));
+        __m128 z = _mm_mul_ps(x, x);
+        __m128 p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(atanP[0]), z), _mm_set1_ps(atanP[1]));
+        p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(atanP[2]));
+        p = _mm_add_ps(_mm_mul_ps(p, z), _mm_set1_ps(atanP[3]));
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, z), x), x);
+        a = _mm_or_ps(_mm_and_ps(big, _mm_add_ps(a, _mm_set1_ps(quarterPi))), _mm_andnot_ps(big, a));
+        __m128 m = _mm_cmpgt_ps(ay, ax);
+        a = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(_mm_set1_ps(halfPi), a)), _mm_andnot_ps(m, a));
+        m = _mm_cmplt_ps(re, _mm_setzero_ps());
+        a = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(_mm_set1_ps(pi), a)), _mm_andnot_ps(m, a));
+        a = _mm_xor_ps(a, _mm_and_ps(_mm_cmplt_ps(im, _mm_setzero_ps()), sign));
+        //rounds to nearest like lrint, the low 16 bits wrap negative angles
+        return _mm_cvtps_epi32(_mm_mul_ps(a, _mm_set1_ps(codesPerRadian)));
+    }
+
+    uint32_t SSE2Polar(const float* src, uint32_t len, float norm, float* magn, avb::Pixel16* out)
+    {
+        const __m128 k = _mm_set1_ps(norm);
+        uint32_t j = 0;
+        for(; j+4<=len; j+=4)
+        {
+            __m128 a = _mm_loadu_ps(src+2*j);
+            __m128 b = _mm_loadu_ps(src+2*j+4);
+            __m128 re = _mm_div_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0)), k);
+            __m128 im = _mm_div_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1)), k);
+            _mm_storeu_ps(magn+j, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im))));
+            alignas(16) int32_t ac[4];
+            _mm_store_si128((__m128i*)ac, AngleCode4(re, im));
+            for(uint32_t i=0; i<4; i++)
+            {
+                out[j+i].r = (uint16_t)ac[i];
+                out[j+i].b = 0;
+            }
+        }
+        return j;
+    }
+
+    uint32_t SSE2DecodePolar(const avb::Pixel16* line, const float* magn, uint32_t bins, fftwf_complex* dft)
+    {
+        const __m128i three = _mm_set1_epi32(3);
+        const __m128i one = _mm_set1_epi32(1);
+        const __m128i two = _mm_set1_epi32(2);
+        uint32_t j = 0;
+        for(; j+4<=bins; j+=4)
+        {
+            __m128i code = _mm_setr_epi32(line[j].r, line[j+1].r, line[j+2].r, line[j+3].r);
+            __m128i sh = _mm_add_epi32(code, _mm_set1_epi32(8192));
+            __m128i q = _mm_and_si128(_mm_srli_epi32(sh, 14), three);
+            __m128i r = _mm_sub_epi32(_mm_and_si128(sh, _mm_set1_epi32(16383)), _mm_set1_epi32(8192));
+            __m128 x = _mm_mul_ps(_mm_cvtepi32_ps(r), _mm_set1_ps(radiansPerCode));
+            __m128 z = _mm_mul_ps(x, x);
+            __m128 sx = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(sinP[0]), z), _mm_set1_ps(sinP[1]));
+            sx = _mm_add_ps(_mm_mul_ps(sx, z), _mm_set1_ps(sinP[2]));
+            sx = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(sx, z), x), x);
+            __m128 cx = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(cosP[0]), z), _mm_set1_ps(cosP[1]));
+            cx = _mm_add_ps(_mm_mul_ps(cx, z), _mm_set1_ps(cosP[2]));
+            cx = _mm_mul_ps(_mm_mul_ps(cx, z), z);
+            cx = _mm_add_ps(_mm_sub_ps(cx, _mm_mul_ps(_mm_set1_ps(0.5f), z)), _mm_set1_ps(1.0f));
+            //odd quarters swap sin and cos, the signs follow the quarter
+            __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(q, one), one));
+            __m128 c = _mm_or_ps(_mm_and_ps(swap, sx), _mm_andnot_ps(swap, cx));
+            __m128 s = _mm_or_ps(_mm_and_ps(swap, cx), _mm_andnot_ps(swap, sx));
+            c = _mm_xor_ps(c, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(q, one), two), 30)));
+            s = _mm_xor_ps(s, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(q, two), 30)));
+            __m128 m = _mm_loadu_ps(magn+j);
+            __m128 re = _mm_mul_ps(c, m), im = _mm_mul_ps(s, m);
+            float* dst = (float*)(dft+j);
+            _mm_storeu_ps(dst, _mm_unpacklo_ps(re, im));
+            _mm_storeu_ps(dst+4, _mm_unpackhi_ps(re, im));
+        }
+        return j;
+    }
+#endif
+}
+
+void avb::spectrum::Quantize(const fftwf_complex* dft, uint32_t bins, float norm, const Compander16& comp, Pixel16* out)
+{
+    float magn[chunkSize];
+    uint16_t magn16[chunkSize];
+    for(uint32_t base=0; base<bins; base+=chunkSize)
+    {
+        uint32_t len = std::min(chunkSize, bins-base);
+        const float* src = (const float*)(dft+base);
+        Pixel16* dst = out+base;
+        uint32_t j = 0;
+#ifdef AVB_SPECTRUM_SSE2
+        j = SSE2Phase(src, len, norm, magn, dst);
+#endif
+        ScalarPhase(src, j, len, norm, magn, dst);
+        comp.Compress(magn, magn16, len);
+        for(uint32_t i=0; i<len; i++)
+            dst[i].g = magn16[i];
+    }
+}
+
+void avb::spectrum::QuantizePolar(const fftwf_complex* dft, uint32_t bins, float norm, const Compander16& comp, Pixel16* out)
+{
+    float magn[chunkSize];
+    uint16_t magn16[chunkSize];
+    for(uint32_t base=0; base<bins; base+=chunkSize)
+    {
+        uint32_t len = std::min(chunkSize, bins-base);
+        const float* src = (const float*)(dft+base);
+        Pixel16* dst = out+base;
+        uint32_t j = 0;
+#ifdef AVB_SPECTRUM_SSE2
+        j = SSE2Polar(src, len, norm, magn, dst);
+#endif
+        ScalarPolar(src, j, len, norm, magn, dst);
+        comp.Compress(magn, magn16, len);
+        for(uint32_t i=0; i<len; i++)
+            dst[i].g = magn16[i];
+    }
+}
+
+void avb::spectrum::DecodePolar(const Pixel16* line, const float* magn, uint32_t bins, fftwf_complex* dft)
+{
+    uint32_t j = 0;
+#ifdef AVB_SPECTRUM_SSE2
+    j = SSE2DecodePolar(line, magn, bins, dft);
+#endif
+    for(; j<bins; j++)
+    {
+        float c, s;
+        AngleVector(line[j].r, &c, &s);
+        dft[j][0] = c*magn[j];
+        dft[j][1] = s*magn[j];
+    }
+}
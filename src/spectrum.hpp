@@ -0,0 +1,26 @@
+#ifndef AVB_SPECTRUM_H
+#define AVB_SPECTRUM_H
+
+#include "incl/c_cpp.hpp"
+#include "fftw3.h"
+#include "compander.hpp"
+#include "fileio.hpp"
+
+namespace avb
+{
+    //fftw output <-> image pixel kernels. the arithmetic is done in the same
+    //order as the old valarray code (scale, magnitude, normalise, code), so
+    //the output is identical to it on every path
+    namespace spectrum
+    {
+        //r/b get the normalised real/imaginary parts, g the companded magnitude
+        void Quantize(const fftwf_complex* dft, uint32_t bins, float norm, const Compander16& comp, Pixel16* out);
+        //the RG16 layout: r gets the phase angle (a full turn in 65536 steps,
+        //0 pointing along the real axis), g the same magnitude as Quantize, b 0
+        void QuantizePolar(const fftwf_complex* dft, uint32_t bins, float norm, const Compander16& comp, Pixel16* out);
+        //and back, magn holds the expanded g of every bin
+        void DecodePolar(const Pixel16* line, const float* magn, uint32_t bins, fftwf_complex* dft);
+    }
+}
+
+#endif // AVB_SPECTRUM_H
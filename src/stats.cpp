@@ -0,0 +1,102 @@
+#include "stats.hpp"
+
+avb::RunStats::RunStats()
+{
+    Start(0, 0, 0);
+}
+uint64_t avb::RunStats::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+const char* avb::RunStats::GetStageName(uint32_t stage)
+{
+    const char* names[AVB_STAGE_COUNT] = {"read", "fft", "quantize", "wait", "write"};
+    return stage < AVB_STAGE_COUNT ? names[stage] : "unknown";
+}
+
+void avb::RunStats::Start(uint32_t t_sampleRate, uint64_t t_totalSamples, uint32_t t_numThreads)
+{
+    for(uint32_t i=0; i<AVB_STAGE_COUNT; i++)
+    {
+        stageNs[i] = 0;
+        stageCalls[i] = 0;
+    }
+    bytesIn = 0;
+    bytesOut = 0;
+    frames = 0;
+    samples = 0;
+    sampleRate = t_sampleRate;
+    totalSamples = t_totalSamples;
+    numThreads = t_numThreads;
+    startNs = Now();
+}
+void avb::RunStats::AddTime(uint32_t stage, uint64_t ns)
+{
+    stageNs[stage].fetch_add(ns, std::memory_order_relaxed);
+    stageCalls[stage].fetch_add(1, std::memory_order_relaxed);
+}
+void avb::RunStats::AddBytesIn(uint64_t n)
+{
+    bytesIn.fetch_add(n, std::memory_order_relaxed);
+}
+void avb::RunStats::AddBytesOut(uint64_t n)
+{
+    bytesOut.fetch_add(n, std::memory_order_relaxed);
+}
+void avb::RunStats::AddFrames(uint64_t n)
+{
+    frames.fetch_add(n, std::memory_order_relaxed);
+}
+void avb::RunStats::AddSamples(uint64_t n)
+{
+    samples.fetch_add(n, std::memory_order_relaxed);
+}
+
+double avb::RunStats::GetElapsed()
+{
+    return (Now()-startNs)*1e-9;
+}
+double avb::RunStats::GetRealtimeFactor()
+{
+    double t = GetElapsed();
+    if(!sampleRate || t <= 0.0)
+        return 0.0;
+    return std::min<uint64_t>(samples, totalSamples) / (double)sampleRate / t;
+}
+void avb::RunStats::PrintSummary()
+{
+    double wall = GetElapsed();
+    printf("%.2f s, %.1fx realtime. stage time summed over threads:", wall, GetRealtimeFactor());
+    for(uint32_t i=0; i<AVB_STAGE_COUNT; i++)
+        printf(" %s %.2f s", GetStageName(i), stageNs[i]*1e-9);
+    printf("\n");
+}
+bool avb::RunStats::WriteJson(const char* filename, const char* direction)
+{
+    FILE* f = fopen(filename, "w");
+    if(!f)
+        return false;
+    double wall = GetElapsed();
+    double audio = sampleRate ? std::min<uint64_t>(samples, totalSamples)/(double)sampleRate : 0.0;
+    uint64_t busy = 0;
+    for(uint32_t i=0; i<AVB_STAGE_COUNT; i++)
+        busy += stageNs[i];
+    fprintf(f, "{\n");
+    fprintf(f, "  \"direction\": \"%s\",\n", direction);
+    fprintf(f, "  \"threads\": %u,\n", numThreads);
+    fprintf(f, "  \"wall_seconds\": %.6f,\n", wall);
+    fprintf(f, "  \"audio_seconds\": %.6f,\n", audio);
+    fprintf(f, "  \"realtime_factor\": %.3f,\n", GetRealtimeFactor());
+    fprintf(f, "  \"bytes_in\": %llu,\n", (unsigned long long)bytesIn);
+    fprintf(f, "  \"bytes_out\": %llu,\n", (unsigned long long)bytesOut);
+    fprintf(f, "  \"frames\": %llu,\n", (unsigned long long)frames);
+    fprintf(f, "  \"samples\": %llu,\n", (unsigned long long)samples);
+    fprintf(f, "  \"stages\": {\n");
+    for(uint32_t i=0; i<AVB_STAGE_COUNT; i++)
+    {
+        fprintf(f, "    \"%s\": {\"seconds\": %.6f, \"calls\": %llu, \"share\": %.4f}%s\n", GetStageName(i),
+            stageNs[i]*1e-9, (unsigned long long)stageCalls[i], busy ? (double)stageNs[i]/busy : 0.0, i+1<AVB_STAGE_COUNT ? "," : "");
+    }
+    fprintf(f, "  }\n}\n");
+    return fclose(f) == 0;
+}
@@ -0,0 +1,66 @@
+#ifndef AVB_STATS_H
+#define AVB_STATS_H
+
+#include "incl/c_cpp.hpp"
+
+#define AVB_STAGE_READ 0x00
+#define AVB_STAGE_FFT 0x01
+#define AVB_STAGE_QUANTIZE 0x02
+#define AVB_STAGE_WAIT 0x03
+#define AVB_STAGE_WRITE 0x04
+#define AVB_STAGE_COUNT 0x05
+
+namespace avb
+{
+    //time and traffic counters for one conversion. stage times are summed
+    //over every thread that ran the stage, so with N workers they can add
+    //up to N times the wall time. all counters are relaxed atomics
+    class RunStats
+    {
+        std::atomic<uint64_t> stageNs[AVB_STAGE_COUNT];
+        std::atomic<uint64_t> stageCalls[AVB_STAGE_COUNT];
+        std::atomic<uint64_t> bytesIn, bytesOut, frames, samples;
+        uint64_t startNs;
+        uint64_t totalSamples;
+        uint32_t sampleRate;
+        uint32_t numThreads;
+        RunStats(const RunStats&) = delete;
+        RunStats& operator=(const RunStats&) = delete;
+    public:
+        RunStats();
+        static uint64_t Now();
+        static const char* GetStageName(uint32_t stage);
+
+        void Start(uint32_t t_sampleRate, uint64_t t_totalSamples, uint32_t t_numThreads);
+        void AddTime(uint32_t stage, uint64_t ns);
+        void AddBytesIn(uint64_t n);
+        void AddBytesOut(uint64_t n);
+        void AddFrames(uint64_t n);
+        //audio samples per channel that made it to the output
+        void AddSamples(uint64_t n);
+
+        double GetElapsed();
+        //seconds of audio done per second of wall time
+        double GetRealtimeFactor();
+        void PrintSummary();
+        bool WriteJson(const char* filename, const char* direction);
+    };
+
+    //start and lap of a stage timer. both are free without stats, so the
+    //converter threads can be used on their own
+    inline uint64_t StageStart(RunStats* stats)
+    {
+        return stats ? RunStats::Now() : 0;
+    }
+    //adds the time since t0 to stage and returns the time it stopped at
+    inline uint64_t StageLap(RunStats* stats, uint32_t stage, uint64_t t0)
+    {
+        if(!stats)
+            return 0;
+        uint64_t t = RunStats::Now();
+        stats->AddTime(stage, t-t0);
+        return t;
+    }
+}
+
+#endif // AVB_STATS_H
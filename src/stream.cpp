@@ -0,0 +1,404 @@
+#include "stream.hpp"
+
+avb::ForwardStream::ForwardStream()
+{
+    pool = nullptr;
+    numCh = 0;
+    samplesPushed = 0;
+    rowsMade = 0;
+    finished = false;
+}
+
+bool avb::ForwardStream::Init(ConverterSettings t_settings, uint32_t t_numCh, ThreadPool* t_pool)
+{
+    settings = t_settings;
+    numCh = t_numCh;
+    pool = t_pool;
+    samplesPushed = 0;
+    rowsMade = 0;
+    finished = false;
+    if(!numCh || settings.fftSize < 4 || settings.fftSize%2)
+        return false;
+    ctx = ConversionContext::Get(settings, AVB_FFT_FORWARD);
+    if(!ctx)
+        return false;
+    thr = std::vector<ForwardConverterThread>(pool ? std::max(1U, pool->GetWorkerCount()) : 1);
+    for(auto& t : thr)
+        if(!t.Init(settings, ctx))
+            return false;
+    pending.assign(numCh, std::vector<float>(settings.fftSize/2, 0.0f));
+    rows.assign(numCh, std::vector<Pixel16>());
+    planar.assign(numCh, std::vector<float>());
+    return true;
+}
+
+void avb::ForwardStream::SetLayout(uint32_t layout)
+{
+    for(auto& t : thr)
+        t.SetLayout(layout);
+}
+
+void avb::ForwardStream::MakeRows(uint32_t count)
+{
+    uint32_t hop = settings.fftSize/2;
+    uint32_t bins = settings.fftSize/2+1;
+    size_t base = rows[0].size()/bins;
+    for(uint32_t ch=0; ch<numCh; ch++)
+        rows[ch].resize((base+count)*bins);
+    if(pool && count >= 2*AVB_FFT_BATCH)
+    {
+        TaskGroup group;
+        pool->ParallelFor(group, 0, count*numCh, AVB_FFT_BATCH, [this, base, count, bins, hop](uint32_t worker, uint32_t first, uint32_t last)
+        {
+            for(uint32_t k=first; k<last;)
+            {
+                uint32_t ch = k/count, j = k%count;
+                uint32_t n = std::min(last-k, count-j);
+                thr[worker].ProcessBlocks(&rows[ch][(base+j)*bins], &pending[ch][(size_t)j*hop], n);
+                k += n;
+            }
+        });
+        group.Wait();
+    }
+    else
+    {
+        for(uint32_t ch=0; ch<numCh; ch++)
+            thr[0].ProcessBlocks(&rows[ch][base*bins], &pending[ch][0], count);
+    }
+    //the last hop of the last frame is the first of the next one
+    for(uint32_t ch=0; ch<numCh; ch++)
+        pending[ch].erase(pending[ch].begin(), pending[ch].begin() + (size_t)count*hop);
+    rowsMade += count;
+}
+
+void avb::ForwardStream::PushFrames(const float* const* samples, uint32_t len)
+{
+    if(finished || !numCh)
+        return;
+    for(uint32_t ch=0; ch<numCh; ch++)
+        pending[ch].insert(pending[ch].end(), samples[ch], samples[ch]+len);
+    samplesPushed += len;
+    uint32_t fftSize = settings.fftSize;
+    size_t have = pending[0].size();
+    if(have >= fftSize)
+        MakeRows((have-fftSize)/(fftSize/2) + 1);
+}
+
+bool avb::ForwardStream::PushPCM(const uint8_t* data, uint32_t bitsPerSample, uint32_t len)
+{
+    if(!numCh)
+        return false;
+    std::vector<float*> dst(numCh);
+    for(uint32_t ch=0; ch<numCh; ch++)
+    {
+        planar[ch].resize(len);
+        dst[ch] = planar[ch].data();
+    }
+    if(!pcm::Deinterleave(data, bitsPerSample, numCh, len, dst.data()))
+        return false;
+    PushFrames(dst.data(), len);
+    return true;
+}
+
+void avb::ForwardStream::Finish()
+{
+    if(finished || !numCh)
+        return;
+    //as many rows as the converter makes, ceil(samples/hop)
+    uint32_t hop = settings.fftSize/2;
+    uint64_t total = (samplesPushed+hop-1)/hop;
+    if(total > rowsMade)
+    {
+        uint32_t need = total-rowsMade;
+        for(uint32_t ch=0; ch<numCh; ch++)
+            pending[ch].resize(std::max<size_t>(pending[ch].size(), (size_t)(need+1)*hop), 0.0f);
+        MakeRows(need);
+    }
+    finished = true;
+}
+
+uint32_t avb::ForwardStream::GetRowSize()
+{
+    return settings.fftSize/2+1;
+}
+uint64_t avb::ForwardStream::GetRowsAvailable()
+{
+    return numCh ? rows[0].size()/GetRowSize() : 0;
+}
+uint32_t avb::ForwardStream::PullRows(Pixel16** out, uint32_t maxRows)
+{
+    uint32_t n = std::min<uint64_t>(maxRows, GetRowsAvailable());
+    size_t len = (size_t)n*GetRowSize();
+    for(uint32_t ch=0; ch<numCh && n; ch++)
+    {
+        memcpy(out[ch], rows[ch].data(), len*sizeof(Pixel16));
+        rows[ch].erase(rows[ch].begin(), rows[ch].begin()+len);
+    }
+    return n;
+}
+
+avb::BackwardStream::BackwardStream()
+{
+    numCh = 0;
+    bitsPerSample = 0;
+    sampleBytes = 0;
+    totalSamples = 0;
+    batchRows = AVB_FFT_BATCH;
+    rowsDone = 0;
+    chunksDone = 0;
+    framesOut = 0;
+    finished = false;
+}
+
+bool avb::BackwardStream::Init(ConverterSettings t_settings, uint32_t t_numCh, uint32_t t_bitsPerSample, uint64_t t_totalSamples)
+{
+    settings = t_settings;
+    numCh = t_numCh;
+    bitsPerSample = t_bitsPerSample;
+    sampleBytes = t_bitsPerSample/8;
+    totalSamples = t_totalSamples;
+    rowsDone = 0;
+    chunksDone = 0;
+    framesOut = 0;
+    finished = false;
+    if(!numCh || settings.fftSize < 4 || settings.fftSize%2)
+        return false;
+    if(bitsPerSample != 16 && bitsPerSample != 24 && bitsPerSample != 32)
+        return false;
+    ctx = ConversionContext::Get(settings, AVB_FFT_INVERSE);
+    if(!ctx)
+        return false;
+    //rows come from memory, the layout only matters to the image reader
+    ConverterSettings thrSettings = settings;
+    thrSettings.horizontalTime = false;
+    thr = std::vector<BackwardConverterThread>(numCh);
+    for(auto& t : thr)
+        if(!t.Init(thrSettings, ctx))
+            return false;
+    rows.assign(numCh, std::vector<Pixel16>());
+    samples.clear();
+    bytes.clear();
+    return true;
+}
+
+void avb::BackwardStream::SetLowLatency(bool lowLatency)
+{
+    batchRows = lowLatency ? 1 : AVB_FFT_BATCH;
+}
+
+void avb::BackwardStream::SetLayout(uint32_t layout)
+{
+    for(auto& t : thr)
+        t.SetLayout(layout);
+}
+
+void avb::BackwardStream::Synthesize(uint32_t count)
+{
+    uint32_t hop = settings.fftSize/2;
+    uint32_t bins = settings.fftSize/2+1;
+    //the very first row only primes the overlap
+    uint32_t hops = rowsDone ? count : count-1;
+    size_t base = samples.size();
+    samples.resize(base + (size_t)hops*hop*numCh);
+    std::vector<const Pixel16*> lines(count);
+    for(uint32_t ch=0; ch<numCh; ch++)
+    {
+        for(uint32_t k=0; k<count; k++)
+            lines[k] = &rows[ch][(size_t)k*bins];
+        thr[ch].SynthesizeLines(&samples[base+ch], numCh, lines.data(), count, rowsDone != 0);
+        rows[ch].erase(rows[ch].begin(), rows[ch].begin()+(size_t)count*bins);
+    }
+    rowsDone += count;
+}
+
+void avb::BackwardStream::QuantizeChunks(bool all)
+{
+    //whole chunks of fftSize frames with the converter's per-chunk dither
+    //seed, so the bytes don't depend on how the rows were pushed
+    size_t chunkSize = (size_t)settings.fftSize*numCh;
+    size_t done = 0;
+    while(samples.size()-done >= chunkSize || (all && samples.size() > done))
+    {
+        size_t len = std::min(chunkSize, samples.size()-done);
+        uint64_t frames = len/numCh;
+        if(totalSamples)
+            frames = std::min<uint64_t>(frames, totalSamples-std::min(totalSamples, framesOut));
+        size_t at = bytes.size();
+        bytes.resize(at + len*sampleBytes);
+        pcm::Quantize(&samples[done], bitsPerSample, len, &bytes[at], settings.ditherOutput && bitsPerSample != 32 ? chunksDone+1 : 0);
+        bytes.resize(at + frames*numCh*sampleBytes);
+        framesOut += frames;
+        chunksDone++;
+        done += len;
+    }
+    samples.erase(samples.begin(), samples.begin()+done);
+}
+
+void avb::BackwardStream::PushRows(const Pixel16* const* t_rows, uint32_t count)
+{
+    if(finished || !numCh)
+        return;
+    uint32_t bins = settings.fftSize/2+1;
+    for(uint32_t ch=0; ch<numCh; ch++)
+        rows[ch].insert(rows[ch].end(), t_rows[ch], t_rows[ch]+(size_t)count*bins);
+    //full batches only, the rest waits for more rows or Finish
+    uint32_t ready = rows[0].size()/bins/batchRows*batchRows;
+    if(ready)
+    {
+        Synthesize(ready);
+        QuantizeChunks(false);
+    }
+}
+
+void avb::BackwardStream::Finish()
+{
+    if(finished || !numCh)
+        return;
+    //one blank row after the last one completes the final hop, as the
+    //image reader does past the end
+    uint32_t bins = settings.fftSize/2+1;
+    for(uint32_t ch=0; ch<numCh; ch++)
+        rows[ch].resize(rows[ch].size()+bins, Pixel16{0, 0, 0});
+    if(rowsDone || rows[0].size() > bins)
+        Synthesize(rows[0].size()/bins);
+    QuantizeChunks(true);
+    //short images are padded with silence up to the length they were made from
+    if(totalSamples > framesOut)
+    {
+        bytes.resize(bytes.size() + (totalSamples-framesOut)*numCh*sampleBytes, 0);
+        framesOut = totalSamples;
+    }
+    finished = true;
+}
+
+uint64_t avb::BackwardStream::GetFramesAvailable()
+{
+    return numCh ? bytes.size()/(numCh*sampleBytes) : 0;
+}
+uint32_t avb::BackwardStream::Pull(uint8_t* out, uint32_t maxFrames)
+{
+    uint32_t n = std::min<uint64_t>(maxFrames, GetFramesAvailable());
+    size_t len = (size_t)n*numCh*sampleBytes;
+    if(n)
+    {
+        memcpy(out, bytes.data(), len);
+        bytes.erase(bytes.begin(), bytes.begin()+len);
+    }
+    return n;
+}
+
+bool avb::PipeForward(FILE* in, FILE* out, ConverterSettings settings, const wav::Header* rawFormat, uint32_t layout)
+{
+    //stdout carries the rows, so complaints go to stderr
+    wav::Header fmt;
+    if(rawFormat)
+        fmt = *rawFormat;
+    else if(!wav::ReadStreamHeader(in, &fmt))
+    {
+        fprintf(stderr, "Input is not a WAV stream avbridge can read\n");
+        return false;
+    }
+    uint32_t numCh = fmt.sub1.NumChannels;
+    uint32_t hop = settings.fftSize/2;
+    uint32_t bins = settings.fftSize/2+1;
+    //rows go out one at a time, a stream has no layout
+    settings.horizontalTime = false;
+    ForwardStream stream;
+    if(!stream.Init(settings, numCh, nullptr))
+    {
+        fprintf(stderr, "Could not initialize the converter\n");
+        return false;
+    }
+    stream.SetLayout(layout);
+    ImageFileHeader hdr = MakeBlankImageFileHeader();
+    SetImageLayout(&hdr, layout);
+    hdr.convSettingsUsed = settings;
+    hdr.inputWavHeader = fmt;
+    hdr.totalSamples = 0;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fflush(out);
+
+    std::vector<uint8_t> samples((size_t)hop*fmt.sub1.BlockAlign);
+    std::vector<std::vector<Pixel16>> rows(numCh, std::vector<Pixel16>(bins));
+    std::vector<Pixel16*> rowPtr(numCh);
+    for(uint32_t ch=0; ch<numCh; ch++)
+        rowPtr[ch] = &rows[ch][0];
+    auto writeRows = [&]()
+    {
+        while(stream.PullRows(&rowPtr[0], 1))
+            for(uint32_t ch=0; ch<numCh; ch++)
+                WritePixels(out, &rows[ch][0], bins, layout);
+        return fflush(out) == 0 && !ferror(out);
+    };
+    for(;;)
+    {
+        //a hop at a time, which is when the next frame completes
+        size_t n = fread(&samples[0], fmt.sub1.BlockAlign, hop, in);
+        if(n && !stream.PushPCM(&samples[0], fmt.sub1.BitsPerSample, n))
+            return false;
+        if(!writeRows())
+            return false;
+        if(n < hop)
+            break;
+    }
+    stream.Finish();
+    return writeRows();
+}
+
+bool avb::PipeBackward(FILE* in, FILE* out, ConverterSettings settings, bool rawOutput)
+{
+    ImageFileHeader hdr;
+    ImageFileHeader blank = MakeBlankImageFileHeader();
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magicNumber != blank.magicNumber || hdr.headerVersion < 2 || hdr.headerVersion > 3 || hdr.headerSize != sizeof(hdr))
+    {
+        fprintf(stderr, "Input is not an image stream\n");
+        return false;
+    }
+    uint32_t numCh = hdr.inputWavHeader.sub1.NumChannels;
+    uint32_t bins = hdr.convSettingsUsed.fftSize/2+1;
+    uint32_t layout = GetImageLayout(hdr);
+    uint32_t outBits = GetBackwardOutputBits(hdr, settings);
+    ConverterSettings streamSettings = hdr.convSettingsUsed;
+    streamSettings.ditherOutput = settings.ditherOutput;
+    BackwardStream stream;
+    if(!stream.Init(streamSettings, numCh, outBits, 0))
+    {
+        fprintf(stderr, "Could not initialize the converter\n");
+        return false;
+    }
+    stream.SetLowLatency(true);
+    stream.SetLayout(layout);
+    if(!rawOutput)
+    {
+        //the length isn't known, the sizes say as much as they can
+        wav::Header fmt = wav::MakeFormat(hdr.inputWavHeader.sub1.SampleRate, numCh, outBits);
+        std::vector<uint8_t> wavHdr = wav::MakeHeader(fmt, 0xFFFFFFFF, AVB_WAV_CONTAINER_RIFF);
+        fwrite(&wavHdr[0], wavHdr.size(), 1, out);
+    }
+
+    std::vector<Pixel16> rows((size_t)numCh*bins);
+    std::vector<const Pixel16*> rowPtr(numCh);
+    for(uint32_t ch=0; ch<numCh; ch++)
+        rowPtr[ch] = &rows[(size_t)ch*bins];
+    std::vector<uint8_t> samples;
+    uint32_t frameSize = numCh*outBits/8;
+    auto writeSamples = [&]()
+    {
+        uint32_t n = stream.GetFramesAvailable();
+        if(n)
+        {
+            samples.resize((size_t)n*frameSize);
+            stream.Pull(&samples[0], n);
+            fwrite(&samples[0], frameSize, n, out);
+        }
+        return fflush(out) == 0 && !ferror(out);
+    };
+    while(ReadPixels(in, &rows[0], (size_t)numCh*bins, layout))
+    {
+        stream.PushRows(&rowPtr[0], 1);
+        if(!writeSamples())
+            return false;
+    }
+    stream.Finish();
+    return writeSamples();
+}
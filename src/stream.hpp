@@ -0,0 +1,115 @@
+#ifndef AVB_STREAM_H
+#define AVB_STREAM_H
+
+#include "incl/c_cpp.hpp"
+#include "converter.hpp"
+
+namespace avb
+{
+    //in-memory conversion without files. audio is pushed in any amount and
+    //image rows (fftSize/2+1 pixels per channel) come out as soon as their
+    //frame is complete, in the same order and with the same values as the
+    //rows of ForwardConverter's _chN.raw files. everything runs on the
+    //calling thread, or on the given pool for bigger pushes. a stream is not
+    //meant to be shared between threads
+    class ForwardStream
+    {
+        std::shared_ptr<const ConversionContext> ctx;
+        std::vector<ForwardConverterThread> thr;
+        ThreadPool* pool;
+        ConverterSettings settings;
+        uint32_t numCh;
+        //per channel, everything from the start of the next frame on. the
+        //stream starts with a silent hop like the converter's
+        std::vector<std::vector<float>> pending;
+        //per channel, finished rows not pulled yet
+        std::vector<std::vector<Pixel16>> rows;
+        std::vector<std::vector<float>> planar;
+        uint64_t samplesPushed;
+        uint64_t rowsMade;
+        bool finished;
+
+        ForwardStream(const ForwardStream&) = delete;
+        ForwardStream& operator=(const ForwardStream&) = delete;
+        void MakeRows(uint32_t count);
+    public:
+        ForwardStream();
+
+        //t_pool may be nullptr. it must not be called from one of its own tasks
+        bool Init(ConverterSettings t_settings, uint32_t t_numCh, ThreadPool* t_pool);
+        //what the rows hold, see ForwardConverter::SetLayout. set it after Init
+        void SetLayout(uint32_t layout);
+        //samples[channel], len frames each
+        void PushFrames(const float* const* samples, uint32_t len);
+        //interleaved PCM as in a WAV data chunk, 8/16/24-bit or 32 meaning float
+        bool PushPCM(const uint8_t* data, uint32_t bitsPerSample, uint32_t len);
+        //end of input, the last frames are padded with silence
+        void Finish();
+
+        uint32_t GetRowSize();
+        uint64_t GetRowsAvailable();
+        //out[channel] gets up to maxRows rows, returns how many
+        uint32_t PullRows(Pixel16** out, uint32_t maxRows);
+    };
+
+    //the way back: rows in, interleaved PCM out, matching the data chunk
+    //BackwardConverter writes for the same rows and format
+    class BackwardStream
+    {
+        std::shared_ptr<const ConversionContext> ctx;
+        //one per channel, each keeps the overlap of its channel between pushes
+        std::vector<BackwardConverterThread> thr;
+        ConverterSettings settings;
+        uint32_t numCh;
+        uint32_t bitsPerSample;
+        uint32_t sampleBytes;
+        //0 means the output ends where the rows do
+        uint64_t totalSamples;
+        //per channel, rows waiting for a full batch
+        std::vector<std::vector<Pixel16>> rows;
+        uint32_t batchRows;
+        //interleaved samples of the chunk being filled
+        std::vector<float> samples;
+        std::vector<uint8_t> bytes;
+        uint64_t rowsDone;
+        uint64_t chunksDone;
+        uint64_t framesOut;
+        bool finished;
+
+        BackwardStream(const BackwardStream&) = delete;
+        BackwardStream& operator=(const BackwardStream&) = delete;
+        void Synthesize(uint32_t count);
+        void QuantizeChunks(bool all);
+    public:
+        BackwardStream();
+
+        //t_settings are the ones the image was made with (convSettingsUsed),
+        //plus ditherOutput. t_totalSamples may be 0 when it isn't known
+        bool Init(ConverterSettings t_settings, uint32_t t_numCh, uint32_t t_bitsPerSample, uint64_t t_totalSamples);
+        //rows are synthesized as they come instead of AVB_FFT_BATCH at a time.
+        //slower, but audio is out at most fftSize samples after its rows
+        void SetLowLatency(bool lowLatency);
+        //the layout the rows were made with, set it after Init
+        void SetLayout(uint32_t layout);
+        //rows[channel], count rows of fftSize/2+1 pixels each
+        void PushRows(const Pixel16* const* rows, uint32_t count);
+        void Finish();
+
+        uint64_t GetFramesAvailable();
+        //up to maxFrames interleaved frames, returns how many
+        uint32_t Pull(uint8_t* out, uint32_t maxFrames);
+    };
+
+    //live conversion between pipes. the image stream is an ImageFileHeader
+    //(totalSamples 0) and then, for every hop, one row per channel. each
+    //row is written and flushed as soon as its frame is complete
+
+    //rawFormat describes headerless PCM on in, nullptr means a WAV stream.
+    //the rows are stored in the given layout, and the header says which
+    bool PipeForward(FILE* in, FILE* out, ConverterSettings settings, const wav::Header* rawFormat, uint32_t layout);
+    //only outputFloat32Audio and ditherOutput are taken from settings.
+    //rawOutput leaves out the WAV header
+    bool PipeBackward(FILE* in, FILE* out, ConverterSettings settings, bool rawOutput);
+}
+
+#endif // AVB_STREAM_H
@@ -0,0 +1,179 @@
+#include "threadpool.hpp"
+
+avb::TaskGroup::TaskGroup()
+{
+    pending = 0;
+}
+
+void avb::TaskGroup::Add(uint32_t n)
+{
+    pending += n;
+}
+void avb::TaskGroup::Finish()
+{
+    //decremented under the lock, so Wait can't return and let the group go
+    //out of scope while this is still notifying it
+    std::lock_guard<std::mutex> lock(mtx);
+    if(--pending == 0)
+        cv.notify_all();
+}
+
+bool avb::TaskGroup::Done()
+{
+    return pending.load() == 0;
+}
+void avb::TaskGroup::Wait()
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{ return pending.load() == 0; });
+}
+
+avb::ThreadPool::ThreadPool()
+{
+    queued = 0;
+    nextQueue = 0;
+    stopping = false;
+}
+avb::ThreadPool::~ThreadPool()
+{
+    Stop();
+}
+
+bool avb::ThreadPool::Start(uint32_t numWorkers)
+{
+    Stop();
+    if(numWorkers == 0)
+        numWorkers = std::max(1U, std::thread::hardware_concurrency());
+    stopping = false;
+    queues.resize(numWorkers);
+    for(auto& q : queues)
+        q = std::unique_ptr<WorkerQueue>(new WorkerQueue);
+    for(uint32_t i=0; i<numWorkers; i++)
+        threads.push_back(std::thread(&ThreadPool::WorkerMain, this, i));
+    return true;
+}
+
+void avb::ThreadPool::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMtx);
+        stopping = true;
+    }
+    sleepCv.notify_all();
+    for(auto& t : threads)
+        t.join();
+    threads = std::vector<std::thread>();
+    queues = std::vector<std::unique_ptr<WorkerQueue>>();
+}
+
+uint32_t avb::ThreadPool::GetWorkerCount()
+{
+    return queues.size();
+}
+
+void avb::ThreadPool::Push(uint32_t queue, Task t)
+{
+    {
+        std::lock_guard<std::mutex> lock(queues[queue]->mtx);
+        queues[queue]->tasks.push_back(t);
+    }
+    queued++;
+    {
+        std::lock_guard<std::mutex> lock(sleepMtx);
+    }
+    sleepCv.notify_one();
+}
+
+bool avb::ThreadPool::PopTask(uint32_t worker, Task& t)
+{
+    {
+        WorkerQueue& own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mtx);
+        if(own.tasks.size())
+        {
+            t = own.tasks.back();
+            own.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    for(uint32_t i=1; i<queues.size(); i++)
+    {
+        WorkerQueue& victim = *queues[(worker+i)%queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mtx);
+        if(victim.tasks.size())
+        {
+            t = victim.tasks.front();
+            victim.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void avb::ThreadPool::RunTask(uint32_t worker, Task& t)
+{
+    while(t.last - t.first > t.grain)
+    {
+        //split on grain boundaries so every piece but the last is whole grains
+        Task upper = t;
+        upper.first = t.first + ((t.last-t.first)/2 + t.grain-1)/t.grain*t.grain;
+        t.last = upper.first;
+        t.group->Add(1);
+        Push(worker, upper);
+    }
+    (*t.fn)(worker, t.first, t.last);
+    t.group->Finish();
+}
+
+void avb::ThreadPool::WorkerMain(uint32_t worker)
+{
+    for(;;)
+    {
+        Task t;
+        if(PopTask(worker, t))
+        {
+            RunTask(worker, t);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMtx);
+        sleepCv.wait(lock, [this]{ return stopping || queued.load() > 0; });
+        if(stopping && queued.load() == 0)
+            return;
+    }
+}
+
+void avb::ThreadPool::ParallelFor(TaskGroup& group, uint32_t first, uint32_t last, uint32_t grain, RangeTaskFunc fn)
+{
+    if(first >= last)
+        return;
+    grain = std::max(1U, grain);
+    uint32_t numWorkers = queues.size();
+    uint32_t numGrains = (last-first+grain-1)/grain;
+    uint32_t numChunks = std::min(numWorkers, numGrains);
+    Task t;
+    t.fn = std::make_shared<RangeTaskFunc>(fn);
+    t.grain = grain;
+    t.group = &group;
+    group.Add(numChunks);
+    uint32_t start = nextQueue++;
+    for(uint32_t i=0; i<numChunks; i++)
+    {
+        t.first = first + (uint64_t(numGrains)*i)/numChunks*grain;
+        t.last = std::min<uint64_t>(last, first + (uint64_t(numGrains)*(i+1))/numChunks*grain);
+        Push((start+i)%numWorkers, t);
+    }
+}
+
+void avb::ThreadPool::Submit(TaskGroup& group, TaskFunc fn)
+{
+    Task t;
+    t.fn = std::make_shared<RangeTaskFunc>([fn](uint32_t worker, uint32_t, uint32_t){ fn(worker); });
+    t.first = 0;
+    t.last = 1;
+    t.grain = 1;
+    t.group = &group;
+    group.Add(1);
+    Push((nextQueue++)%queues.size(), t);
+}
@@ -0,0 +1,66 @@
+#ifndef AVB_THREADPOOL_H
+#define AVB_THREADPOOL_H
+
+#include "incl/c_cpp.hpp"
+
+namespace avb
+{
+    typedef std::function<void(uint32_t worker, uint32_t first, uint32_t last)> RangeTaskFunc;
+    typedef std::function<void(uint32_t worker)> TaskFunc;
+
+    class TaskGroup
+    {
+        friend class ThreadPool;
+        std::atomic<uint32_t> pending;
+        std::mutex mtx;
+        std::condition_variable cv;
+        void Add(uint32_t n);
+        void Finish();
+    public:
+        TaskGroup();
+        bool Done();
+        void Wait();
+    };
+
+    //long-lived workers with one deque each. ranges are split in halves
+    //on the owner side and idle workers steal the biggest pieces from the front
+    class ThreadPool
+    {
+        struct Task
+        {
+            std::shared_ptr<RangeTaskFunc> fn;
+            uint32_t first, last, grain;
+            TaskGroup* group;
+        };
+        struct WorkerQueue
+        {
+            std::mutex mtx;
+            std::deque<Task> tasks;
+        };
+        std::vector<std::unique_ptr<WorkerQueue>> queues;
+        std::vector<std::thread> threads;
+        std::mutex sleepMtx;
+        std::condition_variable sleepCv;
+        std::atomic<uint32_t> queued;
+        std::atomic<uint32_t> nextQueue;
+        bool stopping;
+
+        void Push(uint32_t queue, Task t);
+        bool PopTask(uint32_t worker, Task& t);
+        void RunTask(uint32_t worker, Task& t);
+        void WorkerMain(uint32_t worker);
+    public:
+        ThreadPool();
+        ~ThreadPool();
+
+        bool Start(uint32_t numWorkers);
+        void Stop();
+        uint32_t GetWorkerCount();
+
+        //ranges are cut on multiples of grain, only the last piece may be shorter
+        void ParallelFor(TaskGroup& group, uint32_t first, uint32_t last, uint32_t grain, RangeTaskFunc fn);
+        void Submit(TaskGroup& group, TaskFunc fn);
+    };
+}
+
+#endif // AVB_THREADPOOL_H